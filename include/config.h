@@ -38,14 +38,19 @@
 
 /* I/O Engine: determine what method to use.
  * So, the way this works is we determine using the preprocessor
- * what polling backend to use for the eventloop.  We prefer epoll,
- * followed by kqueue, followed by poll, and then finally select.
+ * what polling backend to use for the eventloop.  We prefer io_uring
+ * (with a fallback to epoll at runtime), then epoll, followed by kqueue,
+ * followed by poll, and then finally select.
  * Kind of ugly, but it gets the job done.  You can also fiddle with
  * this to determine what backend is used.
  */
 #ifndef _WIN32
 # ifdef HAVE_EPOLL
 #  define BACKEND_EPOLL
+   /* Use io_uring if possible, the epoll backend is the fallback */
+#  ifdef HAVE_IO_URING
+#   define BACKEND_IO_URING
+#  endif
 # else
 #  ifdef HAVE_KQUEUE
 #   define BACKEND_KQUEUE
@@ -61,6 +66,14 @@
 # define BACKEND_SELECT
 #endif
 
+/* With the epoll backend, client and listener sockets are registered only
+ * once in edge-triggered mode and UnrealIRCd keeps track of which sockets
+ * are ready by itself. This saves an epoll_ctl() call every time we start
+ * or stop waiting for a socket to become writable, which is very often.
+ * Comment this out to use level-triggered epoll for all sockets.
+ */
+#define EPOLL_EDGE_TRIGGERED
+
 /* Define the ircd module suffix, should be .so on UNIX, and .dll on Windows. */
 #ifndef _WIN32
 # define MODULE_SUFFIX	".so"
@@ -208,8 +221,9 @@
 
 /*
  * Maximum delay for socket loop (in miliseconds, so 1000 = 1 second). 
- * This means any other events and such may be delayed up to this value
- * when there is no socket data waiting for us (no clients sending anything).
+ * The socket loop wakes up earlier if an event is due sooner (see
+ * EventNextDelay()), this is the upper limit when there is no socket
+ * data waiting for us (no clients sending anything).
  * Was 2000ms in 3.2.x, 1000ms for versions below 3.4-alpha4.
  * 500ms in UnrealIRCd 4 (?)
  * 250ms in UnrealIRCd 5.
@@ -28,6 +28,18 @@
 /* 512 bytes -- 510 character bytes + \r\n, per rfc1459 */
 #define DBUF_BLOCK_SIZE		(512)
 
+/* Bigger blocks are used once a lot of data is queued, eg: for
+ * server links during a netburst or users doing a LIST.
+ * The maximum can be lowered via set::sendq-block-size.
+ */
+#define DBUF_BLOCK_SIZE_MEDIUM	(4096)
+#define DBUF_BLOCK_SIZE_MAX	(16384)
+
+/* dbuf_reserve() only uses the room left in the last block if there
+ * is at least this much, otherwise it starts a new block.
+ */
+#define DBUF_RESERVE_MIN	DBUF_BLOCK_SIZE
+
 /*
 ** dbuf is a collection of functions which can be used to
 ** maintain a dynamic buffering of a byte stream.
@@ -49,6 +61,17 @@ typedef struct dbuf {
 	struct list_head dbuf_list;
 } dbuf;
 
+/*
+** A 'dbufshared' holds a payload that is queued in several dbufs
+** at once, such as a channel message that is sent to many clients.
+** It is reference counted and freed when the last user lets go.
+*/
+typedef struct dbufshared {
+	int refcount;		/* Number of references to this payload */
+	size_t size;		/* Length of the payload */
+	char data[1];		/* The payload (allocated with the struct) */
+} dbufshared;
+
 /*
 ** And this 'dbufbuf' should never be referenced outside the
 ** implementation of 'dbuf'--would be "hidden" if C had such
@@ -57,11 +80,20 @@ typedef struct dbuf {
 ** page in size. 2048 bytes seems to be the most common size, so
 ** as long as a pointer is 4 bytes, we get 2032 bytes for buffer
 ** data after we take away a bit for malloc to play with. -avalon
+**
+** A block either stores its data in 'buf' or, if 'shared' is set,
+** is a (data, size) reference into a shared payload. In the latter
+** case 'buf' is not even allocated. Either way, the bytes to be read
+** are always the 'size' bytes starting at 'data'. Consuming data
+** from the front of a block simply moves 'data' forward.
 */
 typedef struct dbufbuf {
 	struct list_head dbuf_node;
-	size_t size;
-	char data[DBUF_BLOCK_SIZE];
+	size_t size;		/* Number of bytes at 'data' */
+	char *data;		/* Start of the data, in 'buf' or in 'shared' */
+	dbufshared *shared;	/* Shared payload, or NULL for a private block */
+	size_t bufsize;		/* Allocated size of 'buf' */
+	char buf[1];		/* Allocated with the struct ('bufsize' bytes) */
 } dbufbuf;
 
 /*
@@ -79,6 +111,24 @@ void dbuf_delete(dbuf *, size_t);
 					/* Dynamic buffer header */
 					/* Number of bytes to delete */
 
+/*
+** dbuf_put_shared
+**	Append a reference to a shared payload to the buffer.
+**	No data is copied, the reference count is increased instead.
+*/
+void dbuf_put_shared(dbuf *, dbufshared *);
+					/* Dynamic buffer header */
+					/* Shared payload to be queued */
+
+/*
+** dbuf_shared_new, dbuf_shared_release
+**	Create a shared payload (with a refcount of 1) from a buffer,
+**	and release a reference to it. The payload is freed when the
+**	last reference is released.
+*/
+extern dbufshared *dbuf_shared_new(char *, size_t);
+extern void dbuf_shared_release(dbufshared *);
+
 /*
 ** DBufLength
 **	Return the current number of bytes stored into the buffer.
@@ -94,7 +144,55 @@ void dbuf_delete(dbuf *, size_t);
 */
 #define DBufClear(dyn)	dbuf_delete((dyn),DBufLength(dyn))
 
+/*
+** dbuf_map
+**	Get a pointer to the first (up to) 'want' bytes of the buffer
+**	as one contiguous region. If the first block holds everything
+**	this points into the block itself, otherwise the data is copied
+**	into 'tmp' (which must be at least 'want' bytes). Nothing is
+**	removed from the buffer. Returns the number of bytes available.
+*/
+extern size_t dbuf_map(dbuf *, char *, size_t, char **);
+					/* Dynamic buffer header */
+					/* Temporary buffer */
+					/* Maximum number of bytes wanted */
+					/* Returned pointer to the data */
+
+#ifndef _WIN32
+/*
+** dbuf_map_iovec
+**	Fill in an iovec array with the blocks at the start of the
+**	buffer (up to 'max' of them), for use with writev(). Nothing is
+**	removed from the buffer. Returns the number of entries used,
+**	the total number of bytes is stored in *len.
+*/
+extern int dbuf_map_iovec(dbuf *, struct iovec *, int, size_t *);
+#endif
+
+/*
+** dbuf_reserve, dbuf_commit
+**	Get room at the end of the buffer to read data into directly,
+**	without going through a separate read buffer. dbuf_reserve()
+**	returns a pointer to at least DBUF_RESERVE_MIN bytes (the exact
+**	amount is stored in *room). This is either the end of the last
+**	block, or a new block that is not on the buffer yet, which is
+**	returned via the second argument (NULL otherwise). After the data
+**	is stored there, dbuf_commit() adds it to the buffer. Always call
+**	dbuf_commit(), with 0 if nothing was stored.
+*/
+extern char *dbuf_reserve(dbuf *, dbufbuf **, size_t *);
+					/* Dynamic buffer header */
+					/* Returned new block (or NULL) */
+					/* Returned number of bytes available */
+extern void dbuf_commit(dbuf *, dbufbuf *, size_t);
+					/* Dynamic buffer header */
+					/* New block from dbuf_reserve() (or NULL) */
+					/* Number of bytes stored */
+
 extern int dbuf_getmsg(dbuf *, char *);
+extern int dbuf_getmsg_inplace(dbuf *, char *, char **, dbufbuf **);
+extern int dbuf_getmsg_next(dbufbuf *, char **);
+extern void dbuf_getmsg_done(dbuf *, dbufbuf *, int);
 extern void dbuf_queue_init(dbuf *dyn);
 extern void dbuf_init(void);
 
@@ -160,6 +160,10 @@ struct Configuration {
 	long handshake_timeout;
 	long sasl_timeout;
 	long handshake_delay;
+	int sendq_block_size;
+	int tls_workers;
+	int max_concurrent_handshakes;
+	int main_loop_stall_threshold;
 	BanTarget automatic_ban_target;
 	BanTarget manual_ban_target;
 	char *reject_message_too_many_connections;
@@ -16,6 +16,8 @@ typedef struct fd_entry {
 	time_t deadline;
 	unsigned char is_open;
 	unsigned int backend_flags;
+	unsigned char edge_triggered;	/**< I/O code calls fd_wouldblock(), see fd_setedge() */
+	unsigned char ready_flags;	/**< FD_SELECT_* the backend knows to be ready (edge-triggered only) */
 } FDEntry;
 
 extern MODVAR FDEntry fd_table[MAXCONNECTIONS + 1];
@@ -45,7 +47,10 @@ extern int fd_fileopen(const char *path, unsigned int flags);
 #define SERVER_SOCKET_SEND_BUFFER	131072
 
 extern void fd_setselect(int fd, int flags, IOCallbackFunc iocb, void *data);
-extern void fd_select(time_t delay);		/* backend-specific */
+extern void fd_setedge(int fd);
+extern void fd_wouldblock(int fd, int flags);
+extern int fd_select(time_t delay);		/* backend-specific, returns the number of ready fds */
+extern uint64_t fd_select_woke;
 extern void fd_refresh(int fd);			/* backend-specific */
 extern void fd_fork(); /* backend-specific */
 
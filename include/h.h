@@ -238,6 +238,8 @@ extern void terminate(), write_pidfile();
 extern void *safe_alloc(size_t size);
 extern void set_socket_buffers(int fd, int rcvbuf, int sndbuf);
 extern int send_queued(Client *);
+extern void mark_data_to_send(Client *to);
+extern void flush_marked_clients(void);
 extern void send_queued_cb(int fd, int revents, void *data);
 extern void sendto_connectnotice(Client *client, int disconnect, char *comment);
 extern void sendto_serv_butone_nickcmd(Client *one, Client *client, char *umodes);
@@ -276,6 +278,9 @@ extern void sendto_ops_and_log(FORMAT_STRING(const char *pattern), ...) __attrib
 
 extern MODVAR int writecalls, writeb[];
 extern int deliver_it(Client *cptr, char *str, int len, int *want_read);
+#ifndef _WIN32
+extern int deliver_it_iov(Client *cptr, struct iovec *iov, int iovcnt);
+#endif
 extern int target_limit_exceeded(Client *client, void *target, const char *name);
 extern char *canonize(char *buffer);
 extern int check_registered(Client *);
@@ -424,6 +429,7 @@ extern char *inetntop(int af, const void *in, char *local_dummy, size_t the_size
 
 /* Internal command stuff - not for modules */
 extern MODVAR RealCommand *CommandHash[256];
+extern unsigned long commands_deleted;
 extern void init_CommandHash(void);
 
 /* CRULE */
@@ -550,6 +556,7 @@ extern char *our_strdup(const char *str);
 extern char *our_strldup(const char *str, size_t max);
 
 extern MODFUNC char  *tls_get_cipher(SSL *ssl);
+extern int tls_kernel_send(SSL *ssl);
 extern TLSOptions *get_tls_options_for_client(Client *acptr);
 extern int outdated_tls_client(Client *acptr);
 extern char *outdated_tls_client_build_string(char *pattern, Client *acptr);
@@ -661,6 +668,7 @@ extern void do_cmd(Client *client, MessageTag *mtags, char *cmd, int parc, char
 extern MODVAR char *me_hash;
 extern MODVAR int dontspread;
 extern MODVAR int labeled_response_inhibit;
+extern MODVAR dbufshared *packet_out_shared;
 extern MODVAR int labeled_response_inhibit_end;
 extern MODVAR int labeled_response_force;
 
@@ -806,6 +814,18 @@ extern MODVAR char serveropts[];
 extern MODVAR char *ISupportStrings[];
 extern void read_packet(int fd, int revents, void *data);
 extern int process_packet(Client *cptr, char *readbuf, int length, int killsafely);
+extern int process_recvq(Client *client, int killsafely);
+extern int read_packet_process(Client *client, char *readbuf, int length);
+extern int tls_worker_attach(Client *client);
+extern void tls_worker_detach(Client *client);
+extern void tls_worker_sendq_cleared(Client *client);
+extern void tls_worker_read_packet(Client *client);
+extern int tls_worker_send_queued(Client *client);
+extern int tls_worker_stats(int num, TLSWorkerStats *stats);
+extern int tls_worker_accept(Client *client);
+extern void tls_worker_quiesce(void);
+extern void handshake_release(Client *client);
+extern void handshake_admit(void);
 extern void sendto_realops_and_log(FORMAT_STRING(const char *fmt), ...) __attribute__((format(printf,1,2)));
 extern int parse_chanmode(ParseMode *pm, char *modebuf_in, char *parabuf_in);
 extern void config_report_ssl_error(void);
@@ -925,6 +945,7 @@ extern void generate_batch_id(char *str);
 extern MessageTag *find_mtag(MessageTag *mtags, const char *token);
 extern MessageTag *duplicate_mtag(MessageTag *mtag);
 extern void free_message_tags(MessageTag *m);
+extern void free_mtags_strcache(MessageTag *m);
 extern time_t server_time_to_unix_time(const char *tbuf);
 extern int history_set_limit(char *object, int max_lines, long max_t);
 extern int history_add(char *object, MessageTag *mtags, char *line);
@@ -948,7 +969,7 @@ extern NameList *find_name_list_match(NameList *list, char *name);
 extern int minimum_msec_since_last_run(struct timeval *tv_old, long minimum);
 extern int unrl_utf8_validate(const char *str, const char **end);
 extern char *unrl_utf8_make_valid(const char *str);
-extern void utf8_test(void);
+extern int utf8_test(void);
 extern MODVAR int non_utf8_nick_chars_in_use;
 extern void short_motd(Client *client);
 extern int should_show_connect_info(Client *client);
@@ -956,6 +977,10 @@ extern void send_invalid_channelname(Client *client, char *channelname);
 extern int is_extended_ban(const char *str);
 extern int valid_sid(char *name);
 extern void parse_client_queued(Client *client);
+extern void queue_client_input(Client *client, time_t when);
+extern void process_clients(void);
+extern void schedule_ping_check(Client *client, time_t when);
+extern void reschedule_ping_checks(void);
 extern char *sha256sum_file(const char *fname);
 extern char *filename_strip_suffix(const char *fname, const char *suffix);
 extern char *filename_add_suffix(const char *fname, const char *suffix);
@@ -973,4 +998,10 @@ extern void update_throttling_timer_settings(void);
 extern int hide_idle_time(Client *client, Client *target);
 extern void lost_server_link(Client *serv, FORMAT_STRING(const char *fmt), ...);
 extern char *sendtype_to_cmd(SendType sendtype);
+extern uint64_t profile_time_ns(void);
+extern void profile_add(ProfileStats *p, uint64_t ns);
+extern void profile_report(Client *client, char *name, ProfileStats *p);
+extern MODVAR LoopStats loopstats;
+extern void loop_blame(char *what, char *name, uint64_t ns);
+extern void reset_loop_stats(void);
 extern MODVAR MessageTagHandler *mtaghandlers;
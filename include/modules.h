@@ -521,6 +521,7 @@ struct Hook {
 		char *(*pcharfunc)();
 	} func;
 	Module *owner;
+	ProfileStats profile;	/**< Time spent in this hook (see ProfileHook) */
 };
 
 struct Callback {
@@ -652,6 +653,8 @@ struct Event {
 	struct timeval	last_run;	/**< Last time this event ran */
 	char		deleted;	/**< Set to 1 if this event is marked for deletion */
 	Module		*owner;		/**< To which module this event belongs */
+	long long	next_run;	/**< Timer wheel tick at which this event runs next (internal) */
+	struct list_head wheel_node;	/**< Slot in the timer wheel (internal) */
 };
 
 #define EMOD_EVERY 0x0001
@@ -672,6 +675,7 @@ struct EventInfo {
 
 
 extern MODVAR Hook		*Hooks[MAXHOOKTYPES];
+extern MODVAR Hook		**HookArrays[MAXHOOKTYPES];
 extern MODVAR Hooktype		Hooktypes[MAXCUSTOMHOOKS];
 extern MODVAR Callback *Callbacks[MAXCALLBACKS], *RCallbacks[MAXCALLBACKS];
 extern MODVAR ClientCapability *clicaps;
@@ -682,6 +686,7 @@ extern Event *EventMarkDel(Event *event);
 extern Event *EventFind(char *name);
 extern int EventMod(Event *event, EventInfo *mods);
 extern void DoEvents(void);
+extern long EventNextDelay(void);
 extern void EventStatus(Client *client);
 extern void SetupEvents(void);
 
@@ -758,98 +763,117 @@ extern Hook	*HookDel(Hook *hook);
 
 extern Hooktype *HooktypeAdd(Module *module, char *string, int *type);
 extern void HooktypeDel(Hooktype *hooktype, Module *module);
+extern char *hooktype_to_string(int hooktype);
+extern void free_retired_hook_arrays(void);
 
-#define RunHook0(hooktype) do { Hook *h; for (h = Hooks[hooktype]; h; h = h->next)(*(h->func.intfunc))(); } while(0)
-#define RunHook(hooktype,x) do { Hook *h; for (h = Hooks[hooktype]; h; h = h->next) (*(h->func.intfunc))(x); } while(0)
+/** Walk through the hooks of a type, in priority order.
+ * HookArrays[] holds the same hooks as the Hooks[] lists, but as a
+ * NULL terminated array (or NULL if there are none), so this is cheap
+ * for empty hook types and does not chase 'next' pointers.
+ */
+#define for_each_hook(hooktype, hook, hookp) \
+	for (hookp = HookArrays[hooktype]; hookp && (hook = *hookp); hookp++)
+
+/** Call a hook function, eg: ProfileHook(h, ret = (*(h->func.intfunc))(client)),
+ * and add the time it took to the hook's statistics (STATS hookprofile).
+ */
+#define ProfileHook(hook, call) do { \
+	uint64_t hook_start_ns = profile_time_ns(); \
+	call; \
+	profile_add(&(hook)->profile, profile_time_ns() - hook_start_ns); \
+} while(0)
+
+#define RunHook0(hooktype) do { Hook *h, **hp; for_each_hook(hooktype, h, hp) ProfileHook(h, (*(h->func.intfunc))()); } while(0)
+#define RunHook(hooktype,x) do { Hook *h, **hp; for_each_hook(hooktype, h, hp) ProfileHook(h, (*(h->func.intfunc))(x)); } while(0)
 #define RunHookReturn(hooktype,x,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ Hook *h, **hp; \
+ for_each_hook(hooktype, h, hp) \
  { \
-  retval = (*(h->func.intfunc))(x); \
+  ProfileHook(h, retval = (*(h->func.intfunc))(x)); \
   if (retval retchk) return; \
  } \
 }
 #define RunHookReturn2(hooktype,x,y,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ Hook *h, **hp; \
+ for_each_hook(hooktype, h, hp) \
  { \
-  retval = (*(h->func.intfunc))(x,y); \
+  ProfileHook(h, retval = (*(h->func.intfunc))(x,y)); \
   if (retval retchk) return; \
  } \
 }
 #define RunHookReturn3(hooktype,x,y,z,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ Hook *h, **hp; \
+ for_each_hook(hooktype, h, hp) \
  { \
-  retval = (*(h->func.intfunc))(x,y,z); \
+  ProfileHook(h, retval = (*(h->func.intfunc))(x,y,z)); \
   if (retval retchk) return; \
  } \
 }
 #define RunHookReturn4(hooktype,a,b,c,d,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ Hook *h, **hp; \
+ for_each_hook(hooktype, h, hp) \
  { \
-  retval = (*(h->func.intfunc))(a,b,c,d); \
+  ProfileHook(h, retval = (*(h->func.intfunc))(a,b,c,d)); \
   if (retval retchk) return; \
  } \
 }
 #define RunHookReturnInt(hooktype,x,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ Hook *h, **hp; \
+ for_each_hook(hooktype, h, hp) \
  { \
-  retval = (*(h->func.intfunc))(x); \
+  ProfileHook(h, retval = (*(h->func.intfunc))(x)); \
   if (retval retchk) return retval; \
  } \
 }
 #define RunHookReturnInt2(hooktype,x,y,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ Hook *h, **hp; \
+ for_each_hook(hooktype, h, hp) \
  { \
-  retval = (*(h->func.intfunc))(x,y); \
+  ProfileHook(h, retval = (*(h->func.intfunc))(x,y)); \
   if (retval retchk) return retval; \
  } \
 }
 #define RunHookReturnInt3(hooktype,x,y,z,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ Hook *h, **hp; \
+ for_each_hook(hooktype, h, hp) \
  { \
-  retval = (*(h->func.intfunc))(x,y,z); \
+  ProfileHook(h, retval = (*(h->func.intfunc))(x,y,z)); \
   if (retval retchk) return retval; \
  } \
 }
 #define RunHookReturnInt4(hooktype,a,b,c,d,retchk) \
 { \
  int retval; \
- Hook *h; \
- for (h = Hooks[hooktype]; h; h = h->next) \
+ Hook *h, **hp; \
+ for_each_hook(hooktype, h, hp) \
  { \
-  retval = (*(h->func.intfunc))(a,b,c,d); \
+  ProfileHook(h, retval = (*(h->func.intfunc))(a,b,c,d)); \
   if (retval retchk) return retval; \
  } \
 }
 
-#define RunHookReturnVoid(hooktype,x,ret) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) if((*(hook->func.intfunc))(x) ret) return; } while(0)
-#define RunHook2(hooktype,x,y) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(x,y); } while(0)
-#define RunHook3(hooktype,a,b,c) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c); } while(0)
-#define RunHook4(hooktype,a,b,c,d) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d); } while(0)
-#define RunHook5(hooktype,a,b,c,d,e) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e); } while(0)
-#define RunHook6(hooktype,a,b,c,d,e,f) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f); } while(0)
-#define RunHook7(hooktype,a,b,c,d,e,f,g) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f,g); } while(0)
-#define RunHook8(hooktype,a,b,c,d,e,f,g,h) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f,g,h); } while(0)
+#define RunHookReturnVoid(hooktype,x,ret) do { Hook *hook, **hookp; int retval; for_each_hook(hooktype, hook, hookp) { ProfileHook(hook, retval = (*(hook->func.intfunc))(x)); if (retval ret) return; } } while(0)
+#define RunHook2(hooktype,x,y) do { Hook *hook, **hookp; for_each_hook(hooktype, hook, hookp) ProfileHook(hook, (*(hook->func.intfunc))(x,y)); } while(0)
+#define RunHook3(hooktype,a,b,c) do { Hook *hook, **hookp; for_each_hook(hooktype, hook, hookp) ProfileHook(hook, (*(hook->func.intfunc))(a,b,c)); } while(0)
+#define RunHook4(hooktype,a,b,c,d) do { Hook *hook, **hookp; for_each_hook(hooktype, hook, hookp) ProfileHook(hook, (*(hook->func.intfunc))(a,b,c,d)); } while(0)
+#define RunHook5(hooktype,a,b,c,d,e) do { Hook *hook, **hookp; for_each_hook(hooktype, hook, hookp) ProfileHook(hook, (*(hook->func.intfunc))(a,b,c,d,e)); } while(0)
+#define RunHook6(hooktype,a,b,c,d,e,f) do { Hook *hook, **hookp; for_each_hook(hooktype, hook, hookp) ProfileHook(hook, (*(hook->func.intfunc))(a,b,c,d,e,f)); } while(0)
+#define RunHook7(hooktype,a,b,c,d,e,f,g) do { Hook *hook, **hookp; for_each_hook(hooktype, hook, hookp) ProfileHook(hook, (*(hook->func.intfunc))(a,b,c,d,e,f,g)); } while(0)
+#define RunHook8(hooktype,a,b,c,d,e,f,g,h) do { Hook *hook, **hookp; for_each_hook(hooktype, hook, hookp) ProfileHook(hook, (*(hook->func.intfunc))(a,b,c,d,e,f,g,h)); } while(0)
 
 #define CallbackAdd(cbtype, func) CallbackAddMain(NULL, cbtype, func, NULL, NULL)
 #define CallbackAddEx(module, cbtype, func) CallbackAddMain(module, cbtype, func, NULL, NULL)
@@ -1015,7 +1039,8 @@ extern void SavePersistentLongX(ModuleInfo *modinfo, char *varshortname, long va
  * 1) Add the #define HOOKTYPE_.... with a new number
  * 2) Add a hook prototype (see below)
  * 3) Add type checking (even more below)
- * 4) Document the hook at https://www.unrealircd.org/docs/Dev:Hook_API
+ * 4) Add it to the name table in hooktype_to_string() in src/modules.c
+ * 5) Document the hook at https://www.unrealircd.org/docs/Dev:Hook_API
  */
 
 /* Hook prototypes */
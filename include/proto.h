@@ -39,9 +39,10 @@ extern void sendto_realops(FORMAT_STRING(const char *pattern), ...) __attribute_
 extern EVENT(garbage_collect);
 extern EVENT(loop_event);
 extern EVENT(check_pings);
-extern EVENT(handshake_timeout);
 extern EVENT(check_deadsockets);
 extern EVENT(try_connections);
+/* tls.c */
+extern EVENT(tls_rotate_ticket_keys);
 /* support.c */
 extern char *my_itoa(int i);
 
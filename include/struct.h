@@ -118,6 +118,7 @@ typedef struct ListStructPrio ListStructPrio;
 typedef struct Watch Watch;
 typedef struct Client Client;
 typedef struct LocalClient LocalClient;
+typedef struct TLSWorkerConn TLSWorkerConn;
 typedef struct Channel Channel;
 typedef struct User ClientUser;
 typedef struct Server Server;
@@ -1009,6 +1010,43 @@ struct IRCCounts {
 /** The /LUSERS stats information */
 extern MODVAR IRCCounts irccounts;
 
+/** Number of buckets in a ProfileStats histogram.
+ * Bucket 0 counts calls that took less than 1 usec, bucket N those
+ * that took 2^(N-1) up to 2^N usec and the last bucket everything
+ * from there on (4 seconds or more).
+ */
+#define PROFILE_BUCKETS	24
+
+/** Timing statistics, eg: of a command handler. See profile_add(). */
+typedef struct ProfileStats {
+	unsigned long calls;		/**< Number of calls */
+	uint64_t total_ns;		/**< Total time of all calls (nsec) */
+	uint64_t max_ns;		/**< Slowest call (nsec) */
+	unsigned int histogram[PROFILE_BUCKETS]; /**< Calls by log2 of the time taken in usec */
+} ProfileStats;
+
+/** Main loop statistics, see SocketLoop() and STATS R */
+typedef struct LoopStats {
+	uint64_t since;			/**< When the statistics were (re)set (profile_time_ns()) */
+	uint64_t busy_ns;		/**< Total time not spent waiting for I/O */
+	unsigned long stalls;		/**< Iterations that took longer than set::main-loop-stall-threshold */
+	ProfileStats iteration;		/**< Whole iterations, without the time spent waiting for I/O */
+	ProfileStats events;		/**< DoEvents() */
+	ProfileStats flush;		/**< flush_marked_clients() */
+	ProfileStats io;		/**< fd_select() after waiting, and handshake_admit() */
+	ProfileStats process_clients;	/**< process_clients() */
+	ProfileStats rehash;		/**< Rehash from a signal */
+	unsigned int ready_fds[PROFILE_BUCKETS]; /**< Iterations by log2 of the number of ready fds */
+} LoopStats;
+
+/** Where a command came from, for the per-command profiling */
+typedef enum CommandSource {
+	COMMAND_SOURCE_LOCAL=0,		/**< Local client (user or unregistered) */
+	COMMAND_SOURCE_REMOTE=1,	/**< Remote user, via a server link */
+	COMMAND_SOURCE_SERVER=2,	/**< Server */
+} CommandSource;
+#define COMMAND_SOURCES	3
+
 #include "modules.h"
 
 /** A "real" command (internal interface, not for modules) */
@@ -1024,6 +1062,7 @@ struct RealCommand {
 	Module 			*owner;
 	RealCommand		*friend; /* cmd if token, token if cmd */
 	CommandOverride		*overriders;
+	ProfileStats		profile[COMMAND_SOURCES]; /* Time spent in the handler, per CommandSource */
 #ifdef DEBUGMODE
 	unsigned long 		lticks;
 	unsigned long 		rticks;
@@ -1082,6 +1121,8 @@ extern void unload_all_unused_moddata(void);
 #define TLSFLAG_FAILIFNOCERT 	0x1
 #define TLSFLAG_NOSTARTTLS	0x8
 #define TLSFLAG_DISABLECLIENTCERT 0x10
+#define TLSFLAG_KTLS		0x20
+#define TLSFLAG_NOSESSIONTICKETS	0x40
 
 /** This shows the Client struct (any client), the User struct (a user), Server (a server) that are commonly accessed both in the core and by 3rd party coders.
  * @defgroup CommonStructs Common structs
@@ -1094,6 +1135,10 @@ struct Client {
 	struct list_head client_node;		/**< For global client list (client_list) */
 	struct list_head lclient_node;		/**< For local client list (lclient_list) */
 	struct list_head special_node;		/**< For special lists (server || unknown || oper) */
+	struct list_head handshake_node;	/**< For the queue of TLS handshakes waiting to start (set::max-concurrent-handshakes) */
+	struct list_head input_node;		/**< For the queue of clients with delayed input, see queue_client_input() */
+	struct list_head ping_node;		/**< For the ping wheel, see schedule_ping_check() */
+	struct list_head send_node;		/**< For the list of clients with data to send, see mark_data_to_send() */
 	LocalClient *local;			/**< Additional information regarding locally connected clients */
 	ClientUser *user;			/**< Additional information, if this client is a user */
 	Server *serv;				/**< Additional information, if this is a server */
@@ -1121,7 +1166,11 @@ struct Client {
 struct LocalClient {
 	int fd;				/**< File descriptor, can be <0 if socket has been closed already. */
 	SSL *ssl;			/**< OpenSSL/LibreSSL struct for SSL/TLS connection */
+	TLSWorkerConn *tlsw;		/**< Set if encryption is done by a TLS worker thread, see src/tls_worker.c */
+	int handshake_slot;		/**< Set while the TLS handshake counts towards set::max-concurrent-handshakes */
 	time_t since;			/**< Time when user will next be allowed to send something (actually since<currenttime+10) */
+	time_t input_wake;		/**< Time when the delayed input in the recvQ can be processed, see queue_client_input() */
+	time_t ping_deadline;		/**< Time when check_pings() needs to look at this client again, see schedule_ping_check() */
 	time_t firsttime;		/**< Time user was created (connected on IRC) */
 	time_t lasttime;		/**< Last time any message was received */
 	dbuf sendQ;			/**< Outgoing send queue (data to be sent) */
@@ -1219,10 +1268,23 @@ struct Server {
 
 /* @} */
 
+/** A serialized message tag list, as sent to clients with certain
+ * capabilities. Cached by mtags_to_string(), see MessageTag.
+ */
+typedef struct MessageTagString MessageTagString;
+struct MessageTagString {
+	MessageTagString *next;
+	int all;		/**< All tags are included (for servers) */
+	long mask;		/**< Capabilities that matter for this tag list */
+	long caps;		/**< The recipient's capabilities, masked by 'mask' */
+	char *str;		/**< The serialized tags, or NULL if no tags are sent */
+};
+
 struct MessageTag {
 	MessageTag *prev, *next;
 	char *name;
 	char *value;
+	MessageTagString *strcache;	/**< Serialized forms of the list (only on the first item), see mtags_to_string() */
 };
 
 typedef struct NameValueList NameValueList;
@@ -1475,11 +1537,29 @@ struct TLSOptions {
 	long options;
 	int renegotiate_bytes;
 	int renegotiate_timeout;
+	int session_cache_size;
+	long session_timeout;
 	int sts_port;
 	long sts_duration;
 	int sts_preload;
 };
 
+/** Maximum value of set::tls-workers */
+#define TLS_WORKERS_MAX		64
+
+/** Statistics of a TLS worker thread, see tls_worker_stats() */
+typedef struct TLSWorkerStats TLSWorkerStats;
+struct TLSWorkerStats {
+	int connections;		/**< Number of connections handled by the thread */
+	int queued;			/**< Number of jobs waiting to be done by the thread */
+	int completed;			/**< Number of finished jobs waiting to be picked up by the main thread */
+	unsigned long long jobs;	/**< Total number of jobs done */
+	unsigned long long handshakes;	/**< Total number of handshakes done */
+	unsigned long long bytes_in;	/**< Total number of bytes decrypted (ciphertext) */
+	unsigned long long bytes_out;	/**< Total number of bytes encrypted (plaintext) */
+	long long cpu_usec;		/**< CPU time used by the thread, in microseconds (-1 if unknown) */
+};
+
 struct ConfigItem_mask {
 	ConfigItem_mask *prev, *next;
 	ConfigFlag flag;
@@ -1521,6 +1601,7 @@ struct ConfigItem_listen {
 	SSL_CTX *ssl_ctx;
 	TLSOptions *tls_options;
 	int websocket_options; /* should be in module, but lazy */
+	int websocket_deflate_memory; /* permessage-deflate memory limit per connection (same) */
 };
 
 struct ConfigItem_sni {
@@ -1755,6 +1836,12 @@ struct IRCStatistics {
 	unsigned int is_abad;	/* bad auth requests */
 	unsigned int is_udp;	/* packets recv'd on udp port */
 	unsigned int is_loc;	/* local connections made */
+	unsigned long is_bcrender;	/* channel broadcast lines rendered */
+	unsigned long is_bcdeliver;	/* channel broadcast lines delivered */
+	unsigned long is_sqcalls;	/* write calls made by send_queued() */
+	unsigned long long is_sqbytes;	/* bytes written by send_queued() */
+	unsigned long is_tlsfull;	/* TLS handshakes without session resumption */
+	unsigned long is_tlsresumed;	/* TLS handshakes that resumed a session */
 };
 
 typedef struct MemoryInfo {
@@ -2017,6 +2104,9 @@ extern int init_ssl();
 extern int ssl_handshake(Client *);   /* Handshake the accpeted con.*/
 extern int ssl_client_handshake(Client *, ConfigItem_link *); /* and the initiated con.*/
 extern int ircd_SSL_accept(Client *acptr, int fd);
+extern void ircd_SSL_accept_done(Client *acptr);
+extern int ircd_SSL_accept_failed(Client *acptr, int ssl_error, unsigned long additional_errno);
+extern int tls_check_plaintext(Client *acptr, char *buf, int n);
 extern int ircd_SSL_connect(Client *acptr, int fd);
 extern int SSL_smart_shutdown(SSL *ssl);
 extern void ircd_SSL_client_handshake(int, int, void *);
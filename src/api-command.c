@@ -25,6 +25,9 @@
 /* Forward declarations */
 static Command *CommandAddInternal(Module *module, char *cmd, CmdFunc func, AliasCmdFunc aliasfunc, unsigned char params, int flags);
 static RealCommand *add_Command_backend(char *cmd);
+static void command_table_add(RealCommand *c);
+static void command_table_rebuild(void);
+static RealCommand *command_table_find(char *cmd);
 
 /** @defgroup CommandAPI Command API
  * @{
@@ -34,15 +37,7 @@ static RealCommand *add_Command_backend(char *cmd);
  */
 int CommandExists(char *name)
 {
-	RealCommand *p;
-	
-	for (p = CommandHash[toupper(*name)]; p; p = p->next)
-	{
-		if (!strcasecmp(p->cmd, name))
-			return 1;
-	}
-
-	return 0;
+	return command_table_find(name) ? 1 : 0;
 }
 
 /** Register a new command.
@@ -135,6 +130,8 @@ void CommandDelX(Command *command, RealCommand *cmd)
 	CommandOverride *ovr, *ovrnext;
 
 	DelListItem(cmd, CommandHash[toupper(*cmd->cmd)]);
+	command_table_rebuild();
+	commands_deleted++;
 	if (command && cmd->owner)
 	{
 		ModuleObject *cmdobj;
@@ -215,12 +212,115 @@ void do_cmd(Client *client, MessageTag *mtags, char *cmd, int parc, char *parv[]
 
 RealCommand *CommandHash[256]; /* one per letter */
 
+/** Number of commands deleted so far. parse2() uses this to see if
+ * the command it just ran may have been freed (eg: by a REHASH).
+ */
+unsigned long commands_deleted = 0;
+
+/** Lookup table for commands by name.
+ * CommandHash[] above holds all commands (and is what you walk to list
+ * them), but looking up a command there means a strcasecmp() for each
+ * command with the same first letter, and there are plenty that start
+ * with a P. This is an open addressing hash table on top of it, so a
+ * lookup normally ends after a single strcasecmp(), or none at all for
+ * an unknown command. The size is a power of two and is adjusted to the
+ * number of commands whenever commands are added or deleted, that is:
+ * on boot, module load/unload and on rehash.
+ */
+typedef struct CommandTableEntry {
+	unsigned int hash;
+	RealCommand *command;
+} CommandTableEntry;
+
+static CommandTableEntry *command_table = NULL;
+static unsigned int command_table_size = 0;
+static unsigned int command_table_count = 0;
+
+#define COMMAND_TABLE_MIN_SIZE	256
+
+/** Case insensitive FNV-1a hash of a command name */
+static inline unsigned int hash_command_name(char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *name; name++)
+		hash = (hash ^ toupper(*name)) * 16777619U;
+	return hash;
+}
+
+static void command_table_insert(RealCommand *c)
+{
+	unsigned int hash = hash_command_name(c->cmd);
+	unsigned int mask = command_table_size - 1;
+	unsigned int i;
+
+	for (i = hash & mask; command_table[i].command; i = (i + 1) & mask)
+		;
+	command_table[i].hash = hash;
+	command_table[i].command = c;
+	command_table_count++;
+}
+
+/** (Re)build the lookup table from CommandHash[], sized to the
+ * number of commands so it is never more than 1/4th full.
+ */
+static void command_table_rebuild(void)
+{
+	RealCommand *c;
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < 256; i++)
+		for (c = CommandHash[i]; c; c = c->next)
+			count++;
+
+	command_table_size = COMMAND_TABLE_MIN_SIZE;
+	while (command_table_size < count * 4)
+		command_table_size *= 2;
+
+	safe_free(command_table);
+	command_table = safe_alloc(sizeof(CommandTableEntry) * command_table_size);
+	command_table_count = 0;
+
+	for (i = 0; i < 256; i++)
+		for (c = CommandHash[i]; c; c = c->next)
+			command_table_insert(c);
+}
+
+/** Add a command to the lookup table, growing it if needed. */
+static void command_table_add(RealCommand *c)
+{
+	if ((command_table_count + 1) * 4 > command_table_size)
+		command_table_rebuild(); /* includes the new command */
+	else
+		command_table_insert(c);
+}
+
+/** Look up a command by name (case insensitive) */
+static RealCommand *command_table_find(char *cmd)
+{
+	unsigned int hash, mask, i;
+
+	if (!command_table)
+		return NULL;
+
+	hash = hash_command_name(cmd);
+	mask = command_table_size - 1;
+	for (i = hash & mask; command_table[i].command; i = (i + 1) & mask)
+	{
+		if ((command_table[i].hash == hash) && !strcasecmp(command_table[i].command->cmd, cmd))
+			return command_table[i].command;
+	}
+	return NULL;
+}
+
 /** Initialize the command API - executed on startup.
  * This also registers some core functions.
  */
 void init_CommandHash(void)
 {
 	memset(CommandHash, 0, sizeof(CommandHash));
+	command_table_rebuild();
 	CommandAdd(NULL, MSG_ERROR, cmd_error, MAXPARA, CMD_UNREGISTERED|CMD_SERVER);
 	CommandAdd(NULL, MSG_VERSION, cmd_version, MAXPARA, CMD_UNREGISTERED|CMD_USER|CMD_SERVER);
 	CommandAdd(NULL, MSG_INFO, cmd_info, MAXPARA, CMD_USER);
@@ -241,6 +341,7 @@ static RealCommand *add_Command_backend(char *cmd)
 
 	/* Add in hash with hash value = first byte */
 	AddListItem(c, CommandHash[toupper(*cmd)]);
+	command_table_add(c);
 
 	return c;
 }
@@ -252,34 +353,25 @@ static RealCommand *add_Command_backend(char *cmd)
 /** Find a command by name and flags */
 RealCommand *find_command(char *cmd, int flags)
 {
-	RealCommand *p;
-	for (p = CommandHash[toupper(*cmd)]; p; p = p->next) {
-		if ((flags & CMD_UNREGISTERED) && !(p->flags & CMD_UNREGISTERED))
-			continue;
-		if ((flags & CMD_SHUN) && !(p->flags & CMD_SHUN))
-			continue;
-		if ((flags & CMD_VIRUS) && !(p->flags & CMD_VIRUS))
-			continue;
-		if ((flags & CMD_ALIAS) && !(p->flags & CMD_ALIAS))
-			continue;
-		if (!strcasecmp(p->cmd, cmd))
-			return p;
-	}
-	return NULL;
+	RealCommand *p = command_table_find(cmd);
+
+	if (!p)
+		return NULL;
+	if ((flags & CMD_UNREGISTERED) && !(p->flags & CMD_UNREGISTERED))
+		return NULL;
+	if ((flags & CMD_SHUN) && !(p->flags & CMD_SHUN))
+		return NULL;
+	if ((flags & CMD_VIRUS) && !(p->flags & CMD_VIRUS))
+		return NULL;
+	if ((flags & CMD_ALIAS) && !(p->flags & CMD_ALIAS))
+		return NULL;
+	return p;
 }
 
 /** Find a command by name (no access rights check) */
 RealCommand *find_command_simple(char *cmd)
 {
-	RealCommand *c;
-
-	for (c = CommandHash[toupper(*cmd)]; c; c = c->next)
-	{
-		if (!strcasecmp(c->cmd, cmd))
-				return c;
-	}
-
-	return NULL;
+	return command_table_find(cmd);
 }
 
 /** @} */
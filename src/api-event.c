@@ -29,6 +29,117 @@ MODVAR Event *events = NULL;
 
 extern EVENT(unrealdns_removeoldrecords);
 
+/* Events are scheduled in a hierarchical timer wheel, so adding an
+ * event and finding the ones that are due does not depend on the
+ * number of events. Level 0 has one slot per tick, each slot of
+ * level 1 covers a full round of level 0, and so on. Events in the
+ * higher levels are moved ("cascaded") down a level each time the
+ * level below wraps around. The 'events' list is still kept for
+ * EventFind() and the like.
+ */
+#define EVENT_WHEEL_TICK	10	/**< Milliseconds per tick */
+#define EVENT_WHEEL_BITS	6
+#define EVENT_WHEEL_SIZE	(1 << EVENT_WHEEL_BITS)
+#define EVENT_WHEEL_MASK	(EVENT_WHEEL_SIZE - 1)
+#define EVENT_WHEEL_LEVELS	4
+/** Maximum number of ticks ahead an event can be scheduled (~46 hours).
+ * Events that are further away are put in the last slot and will be
+ * rescheduled when it comes along.
+ */
+#define EVENT_WHEEL_MAX		((1LL << (EVENT_WHEEL_BITS * EVENT_WHEEL_LEVELS)) - 1)
+
+static struct list_head event_wheel[EVENT_WHEEL_LEVELS][EVENT_WHEEL_SIZE];
+static long long event_wheel_tick;	/**< Next tick to be processed */
+static long long event_clock;		/**< Microseconds elapsed, never goes backwards */
+static struct timeval event_clock_tv;	/**< timeofday_tv when event_clock was last updated */
+static int events_deleted;		/**< Set if CleanupEvents() has work to do */
+
+/** Initialize the timer wheel, called once on boot */
+static void event_wheel_init(void)
+{
+	static int done = 0;
+	int level, i;
+
+	if (done)
+		return;
+	for (level = 0; level < EVENT_WHEEL_LEVELS; level++)
+		for (i = 0; i < EVENT_WHEEL_SIZE; i++)
+			INIT_LIST_HEAD(&event_wheel[level][i]);
+	done = 1;
+}
+
+/** Get the current time in ticks.
+ * This is based on timeofday_tv, but if the clock is set backwards
+ * it simply stands still instead of delaying all events.
+ */
+static long long event_wheel_now(void)
+{
+	long long elapsed;
+
+	if (event_clock_tv.tv_sec)
+	{
+		elapsed = ((long long)(timeofday_tv.tv_sec - event_clock_tv.tv_sec) * 1000000) +
+		          (timeofday_tv.tv_usec - event_clock_tv.tv_usec);
+		if (elapsed > 0)
+			event_clock += elapsed;
+	}
+	event_clock_tv = timeofday_tv;
+	return event_clock / (EVENT_WHEEL_TICK * 1000);
+}
+
+/** Put the event in the wheel slot for e->next_run */
+static void event_wheel_insert(Event *e)
+{
+	long long expires = e->next_run;
+	long long delta = expires - event_wheel_tick;
+	int level;
+
+	if (delta < 0)
+	{
+		/* Already due, run it on the next tick */
+		list_add_tail(&e->wheel_node, &event_wheel[0][event_wheel_tick & EVENT_WHEEL_MASK]);
+		return;
+	}
+
+	if (delta > EVENT_WHEEL_MAX)
+	{
+		delta = EVENT_WHEEL_MAX;
+		expires = event_wheel_tick + delta;
+	}
+
+	for (level = 0; level < EVENT_WHEEL_LEVELS - 1; level++)
+		if (delta < (1LL << (EVENT_WHEEL_BITS * (level + 1))))
+			break;
+
+	list_add_tail(&e->wheel_node, &event_wheel[level][(expires >> (EVENT_WHEEL_BITS * level)) & EVENT_WHEEL_MASK]);
+}
+
+/** Schedule the event to run 'every_msec' from now */
+static void event_schedule(Event *e)
+{
+	list_del_init(&e->wheel_node);
+	e->next_run = event_wheel_now() + (e->every_msec / EVENT_WHEEL_TICK);
+	event_wheel_insert(e);
+}
+
+/** Move all events of a slot in 'level' down to the lower levels.
+ * @returns the slot index, so the caller knows whether this level wrapped too.
+ */
+static int event_wheel_cascade(int level)
+{
+	int idx = (event_wheel_tick >> (EVENT_WHEEL_BITS * level)) & EVENT_WHEEL_MASK;
+	Event *e, *e_next;
+	LIST_HEAD(work);
+
+	list_splice_init(&event_wheel[level][idx], &work);
+	list_for_each_entry_safe(e, e_next, &work, wheel_node)
+	{
+		list_del_init(&e->wheel_node);
+		event_wheel_insert(e);
+	}
+	return idx;
+}
+
 /** Add an event, a function that will run at regular intervals.
  * @param module	Module that this event belongs to
  * @param name		Name of the event
@@ -38,8 +149,8 @@ extern EVENT(unrealdns_removeoldrecords);
  * @param count		After how many times we should stop calling this even (0 = infinite times)
  * @returns an Event struct
  * @note  UnrealIRCd will try to call the event every 'every_msec' milliseconds.
- *        However, in case of low traffic the minimum time is at least SOCKETLOOP_MAX_DELAY
- *        which is 250ms at the time of writing. Also, we reject any value below 100 msecs.
+ *        The socket loop wakes up when the next event is due, so this is accurate
+ *        to about 10ms in normal circumstances. We reject any value below 100 msecs.
  *        The actual calling time will not be quicker than the specified every_msec but
  *        can be later, in case of high load, in very extreme cases even up to 1000 or 2000
  *        msec later but that would be very unusual. Just saying, it's not a guarantee..
@@ -75,6 +186,9 @@ Event *EventAdd(Module *module, char *name, vFP event, void *data, long every_ms
 	newevent->last_run.tv_usec = timeofday_tv.tv_usec;
 	newevent->owner = module;
 	AddListItem(newevent,events);
+	event_wheel_init();
+	INIT_LIST_HEAD(&newevent->wheel_node);
+	event_schedule(newevent);
 	if (module)
 	{
 		ModuleObject *eventobj = safe_alloc(sizeof(ModuleObject));
@@ -97,6 +211,10 @@ void EventDel(Event *e)
 
 	/* Mark for deletion */
 	e->deleted = 1;
+	events_deleted = 1;
+
+	/* Unschedule, so it will never be called again */
+	list_del_init(&e->wheel_node);
 
 	/* Replace the name so deleted events are clearly labeled */
 	if (e->name)
@@ -144,6 +262,11 @@ static void EventDelReal(Event *e)
 static void CleanupEvents(void)
 {
 	Event *e, *e_next;
+
+	if (!events_deleted)
+		return;
+	events_deleted = 0;
+
 	for (e = events; e; e = e_next)
 	{
 		e_next = e->next;
@@ -184,9 +307,15 @@ int EventMod(Event *event, EventInfo *mods)
 		}
 
 		event->every_msec = mods->every_msec;
+		if (!event->deleted)
+			event_schedule(event);
 	}
 	if (mods->flags & EMOD_HOWMANY)
+	{
 		event->count = mods->count;
+		if ((event->count == -1) && !event->deleted)
+			EventDel(event);
+	}
 	if (mods->flags & EMOD_NAME)
 		safe_strdup(event->name, mods->name);
 	if (mods->flags & EMOD_EVENT)
@@ -198,30 +327,62 @@ int EventMod(Event *event, EventInfo *mods)
 	return 0;
 }
 
+/** Run all events that are due.
+ * This is called from the main loop on every iteration.
+ */
 void DoEvents(void)
 {
+	long long now = event_wheel_now();
 	Event *e;
+	LIST_HEAD(work);
+	int idx;
+	uint64_t start;
+
+	event_wheel_init();
 
-	for (e = events; e; e = e->next)
+	while (event_wheel_tick <= now)
 	{
-		if (e->deleted)
-			continue;
-		if (e->count == -1)
+		idx = event_wheel_tick & EVENT_WHEEL_MASK;
+		if (idx == 0)
 		{
-			EventDel(e);
-			continue;
+			int level;
+			for (level = 1; level < EVENT_WHEEL_LEVELS; level++)
+				if (event_wheel_cascade(level) != 0)
+					break;
 		}
-		if ((e->every_msec == 0) || minimum_msec_since_last_run(&e->last_run, e->every_msec))
+		event_wheel_tick++;
+
+		/* Events may add, modify or delete other events while we
+		 * are running them, so take them off the list one by one.
+		 */
+		list_splice_init(&event_wheel[0][idx], &work);
+		while (!list_empty(&work))
 		{
+			e = list_first_entry(&work, Event, wheel_node);
+			list_del_init(&e->wheel_node);
+			if (e->next_run > now)
+			{
+				/* Beyond the range of the wheel when it was added */
+				event_wheel_insert(e);
+				continue;
+			}
+			if (e->count == -1)
+			{
+				EventDel(e);
+				continue;
+			}
+			/* Reschedule first, the event may EventMod() or EventDel() itself */
+			e->next_run = now + MAX(e->every_msec / EVENT_WHEEL_TICK, 1);
+			event_wheel_insert(e);
+			e->last_run = timeofday_tv;
+			start = profile_time_ns();
 			(*e->event)(e->data);
+			loop_blame("event", e->name ? e->name : "(unnamed)", profile_time_ns() - start);
 			if (e->count > 0)
 			{
 				e->count--;
-				if (e->count == 0)
-				{
+				if ((e->count == 0) && !e->deleted)
 					EventDel(e);
-					continue;
-				}
 			}
 		}
 	}
@@ -229,6 +390,35 @@ void DoEvents(void)
 	CleanupEvents();
 }
 
+/** Milliseconds until the next event is due.
+ * This is used by the main loop to decide how long it may sleep.
+ * @returns the delay in msec. If nothing is due in level 0 of the
+ *          wheel, this is the time until the next cascade.
+ */
+long EventNextDelay(void)
+{
+	long long due;
+	int i;
+
+	event_wheel_init();
+
+	for (i = 0; i < EVENT_WHEEL_SIZE; i++)
+	{
+		long long tick = event_wheel_tick + i;
+
+		/* Events in the higher levels move down when level 0 wraps */
+		if ((i > 0) && ((tick & EVENT_WHEEL_MASK) == 0))
+			break;
+		if (!list_empty(&event_wheel[0][tick & EVENT_WHEEL_MASK]))
+			break;
+	}
+	/* This is either the first tick with an event or the next cascade */
+	due = (event_wheel_tick + i) * EVENT_WHEEL_TICK * 1000;
+	if (due <= event_clock)
+		return 0;
+	return (long)((due - event_clock + 999) / 1000);
+}
+
 void SetupEvents(void)
 {
 	/* Start events */
@@ -238,6 +428,6 @@ void SetupEvents(void)
 	EventAdd(NULL, "unrealdns_removeoldrecords", unrealdns_removeoldrecords, NULL, 15000, 0);
 	EventAdd(NULL, "check_pings", check_pings, NULL, 1000, 0);
 	EventAdd(NULL, "check_deadsockets", check_deadsockets, NULL, 1000, 0);
-	EventAdd(NULL, "handshake_timeout", handshake_timeout, NULL, 1000, 0);
 	EventAdd(NULL, "try_connections", try_connections, NULL, 2000, 0);
+	EventAdd(NULL, "tls_rotate_ticket_keys", tls_rotate_ticket_keys, NULL, 60000, 0);
 }
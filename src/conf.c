@@ -170,7 +170,9 @@ static NameValue _LogFlags[] = {
 /* This MUST be alphabetized */
 static NameValue _TLSFlags[] = {
 	{ TLSFLAG_FAILIFNOCERT, "fail-if-no-clientcert" },
+	{ TLSFLAG_KTLS, "kernel-tls" },
 	{ TLSFLAG_DISABLECLIENTCERT, "no-client-certificate" },
+	{ TLSFLAG_NOSESSIONTICKETS, "no-session-tickets" },
 	{ TLSFLAG_NOSTARTTLS, "no-starttls" },
 };
 
@@ -1695,6 +1697,8 @@ void config_setdefaultsettings(Configuration *i)
 	safe_strdup(i->network.x_prefix_quit, "Quit");
 	i->max_unknown_connections_per_ip = 3;
 	i->handshake_timeout = 30;
+	i->sendq_block_size = DBUF_BLOCK_SIZE_MAX;
+	i->main_loop_stall_threshold = 1000;
 	i->sasl_timeout = 15;
 	i->handshake_delay = -1;
 	i->broadcast_channel_messages = BROADCAST_CHANNEL_MESSAGES_AUTO;
@@ -1710,6 +1714,8 @@ void config_setdefaultsettings(Configuration *i)
 	safe_strdup(i->tls_options->ciphers, UNREALIRCD_DEFAULT_CIPHERS);
 	safe_strdup(i->tls_options->ciphersuites, UNREALIRCD_DEFAULT_CIPHERSUITES);
 	i->tls_options->protocols = TLS_PROTOCOL_ALL;
+	i->tls_options->session_cache_size = 20480;
+	i->tls_options->session_timeout = 3600;
 #ifdef HAS_SSL_CTX_SET1_CURVES_LIST
 	safe_strdup(i->tls_options->ecdh_curves, UNREALIRCD_DEFAULT_ECDH_CURVES);
 #endif
@@ -2132,6 +2138,7 @@ int	init_conf(char *rootconf, int rehash)
 	{
 		module_loadall();
 		RunHook0(HOOKTYPE_REHASH_COMPLETE);
+		reschedule_ping_checks();
 	}
 	postconf();
 	config_status("Configuration loaded.");
@@ -2356,6 +2363,9 @@ void	config_rehash()
 	ListStruct 	*next, *next2;
 	SpamExcept *spamex_ptr;
 
+	/* TLS handshakes in worker threads may be looking at sni { } blocks */
+	tls_worker_quiesce();
+
 	USE_BAN_VERSION = 0;
 
 	for (admin_ptr = conf_admin; admin_ptr; admin_ptr = (ConfigItem_admin *)next)
@@ -6915,6 +6925,28 @@ void test_tlsblock(ConfigFile *conf, ConfigEntry *cep, int *totalerrors)
 		else if (!strcmp(cepp->ce_varname, "renegotiate-bytes"))
 		{
 		}
+		else if (!strcmp(cepp->ce_varname, "session-cache-size"))
+		{
+			CheckNull(cepp);
+			if (atoi(cepp->ce_vardata) < 0)
+			{
+				config_error("%s:%i: %s: value should be 0 (disabled) or higher",
+					cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum,
+					config_var(cepp));
+				errors++;
+			}
+		}
+		else if (!strcmp(cepp->ce_varname, "session-timeout"))
+		{
+			CheckNull(cepp);
+			if (config_checkval(cepp->ce_vardata, CFG_TIME) < 60)
+			{
+				config_error("%s:%i: %s: value should be at least 60 seconds",
+					cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum,
+					config_var(cepp));
+				errors++;
+			}
+		}
 		else if (!strcmp(cepp->ce_varname, "ciphers") || !strcmp(cepp->ce_varname, "server-cipher-list"))
 		{
 			CheckNull(cepp);
@@ -7054,6 +7086,7 @@ void test_tlsblock(ConfigFile *conf, ConfigEntry *cep, int *totalerrors)
 		else if (!strcmp(cepp->ce_varname, "options"))
 		{
 			for (ceppp = cepp->ce_entries; ceppp; ceppp = ceppp->ce_next)
+			{
 				if (!config_binary_flags_search(_TLSFlags, ceppp->ce_varname, ARRAY_SIZEOF(_TLSFlags)))
 				{
 					config_error("%s:%i: unknown SSL/TLS option '%s'",
@@ -7061,6 +7094,15 @@ void test_tlsblock(ConfigFile *conf, ConfigEntry *cep, int *totalerrors)
 							 ceppp->ce_varlinenum, ceppp->ce_varname);
 					errors ++;
 				}
+#ifndef SSL_OP_ENABLE_KTLS
+				else if (!strcmp(ceppp->ce_varname, "kernel-tls"))
+				{
+					config_warn("%s:%i: SSL/TLS option 'kernel-tls' is not supported by your "
+					            "OpenSSL version (3.0.0 or later is needed), option is ignored.",
+					            ceppp->ce_fileptr->cf_filename, ceppp->ce_varlinenum);
+				}
+#endif
+			}
 		}
 		else if (!strcmp(cepp->ce_varname, "sts-policy"))
 		{
@@ -7164,6 +7206,8 @@ void conf_tlsblock(ConfigFile *conf, ConfigEntry *cep, TLSOptions *tlsoptions)
 		tlsoptions->options = tempiConf.tls_options->options;
 		tlsoptions->renegotiate_bytes = tempiConf.tls_options->renegotiate_bytes;
 		tlsoptions->renegotiate_timeout = tempiConf.tls_options->renegotiate_timeout;
+		tlsoptions->session_cache_size = tempiConf.tls_options->session_cache_size;
+		tlsoptions->session_timeout = tempiConf.tls_options->session_timeout;
 		tlsoptions->sts_port = tempiConf.tls_options->sts_port;
 		tlsoptions->sts_duration = tempiConf.tls_options->sts_duration;
 		tlsoptions->sts_preload = tempiConf.tls_options->sts_preload;
@@ -7260,6 +7304,14 @@ void conf_tlsblock(ConfigFile *conf, ConfigEntry *cep, TLSOptions *tlsoptions)
 		{
 			tlsoptions->renegotiate_timeout = config_checkval(cepp->ce_vardata, CFG_TIME);
 		}
+		else if (!strcmp(cepp->ce_varname, "session-cache-size"))
+		{
+			tlsoptions->session_cache_size = atoi(cepp->ce_vardata);
+		}
+		else if (!strcmp(cepp->ce_varname, "session-timeout"))
+		{
+			tlsoptions->session_timeout = config_checkval(cepp->ce_vardata, CFG_TIME);
+		}
 		else if (!strcmp(cepp->ce_varname, "options"))
 		{
 			tlsoptions->options = 0;
@@ -7764,6 +7816,22 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 		{
 			tempiConf.handshake_delay = config_checkval(cep->ce_vardata, CFG_TIME);
 		}
+		else if (!strcmp(cep->ce_varname, "sendq-block-size"))
+		{
+			tempiConf.sendq_block_size = config_checkval(cep->ce_vardata, CFG_SIZE);
+		}
+		else if (!strcmp(cep->ce_varname, "tls-workers"))
+		{
+			tempiConf.tls_workers = atoi(cep->ce_vardata);
+		}
+		else if (!strcmp(cep->ce_varname, "max-concurrent-handshakes"))
+		{
+			tempiConf.max_concurrent_handshakes = atoi(cep->ce_vardata);
+		}
+		else if (!strcmp(cep->ce_varname, "main-loop-stall-threshold"))
+		{
+			tempiConf.main_loop_stall_threshold = atoi(cep->ce_vardata);
+		}
 		else if (!strcmp(cep->ce_varname, "automatic-ban-target"))
 		{
 			tempiConf.automatic_ban_target = ban_target_strtoval(cep->ce_vardata);
@@ -8922,6 +8990,57 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 				errors++;
 			}
 		}
+		else if (!strcmp(cep->ce_varname, "sendq-block-size")) {
+			int v;
+			CheckNull(cep);
+			v = config_checkval(cep->ce_vardata, CFG_SIZE);
+			if ((v < DBUF_BLOCK_SIZE) || (v > DBUF_BLOCK_SIZE_MAX))
+			{
+				config_error("%s:%i: set::sendq-block-size: value should be between %d and %d bytes.",
+					cep->ce_fileptr->cf_filename, cep->ce_varlinenum,
+					DBUF_BLOCK_SIZE, DBUF_BLOCK_SIZE_MAX);
+				errors++;
+			}
+		}
+		else if (!strcmp(cep->ce_varname, "tls-workers")) {
+			int v;
+			CheckNull(cep);
+			v = atoi(cep->ce_vardata);
+#ifdef _WIN32
+			if (v != 0)
+			{
+				config_error("%s:%i: set::tls-workers is not supported on Windows.",
+					cep->ce_fileptr->cf_filename, cep->ce_varlinenum);
+				errors++;
+			}
+#else
+			if ((v < 0) || (v > TLS_WORKERS_MAX))
+			{
+				config_error("%s:%i: set::tls-workers: value should be between 0 and %d.",
+					cep->ce_fileptr->cf_filename, cep->ce_varlinenum,
+					TLS_WORKERS_MAX);
+				errors++;
+			}
+#endif
+		}
+		else if (!strcmp(cep->ce_varname, "max-concurrent-handshakes")) {
+			CheckNull(cep);
+			if (atoi(cep->ce_vardata) < 0)
+			{
+				config_error("%s:%i: set::max-concurrent-handshakes: value should be 0 (unlimited) or higher.",
+					cep->ce_fileptr->cf_filename, cep->ce_varlinenum);
+				errors++;
+			}
+		}
+		else if (!strcmp(cep->ce_varname, "main-loop-stall-threshold")) {
+			CheckNull(cep);
+			if (atoi(cep->ce_vardata) < 0)
+			{
+				config_error("%s:%i: set::main-loop-stall-threshold: value should be 0 (disabled) or a number of milliseconds.",
+					cep->ce_fileptr->cf_filename, cep->ce_varlinenum);
+				errors++;
+			}
+		}
 		else if (!strcmp(cep->ce_varname, "handshake-delay"))
 		{
 			int v;
@@ -18,26 +18,89 @@
  */
 
 #include "unrealircd.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
-static mp_pool_t *dbuf_bufpool = NULL;
+/* Private blocks come in a few sizes, each with their own pool */
+#define DBUF_POOLS	3
+static size_t dbuf_pool_size[DBUF_POOLS] = { DBUF_BLOCK_SIZE, DBUF_BLOCK_SIZE_MEDIUM, DBUF_BLOCK_SIZE_MAX };
+static mp_pool_t *dbuf_bufpool[DBUF_POOLS];
+static mp_pool_t *dbuf_refpool = NULL;
+
+/* Size of a dbufbuf that only references a shared payload (no 'buf') */
+#define DBUF_REF_SIZE	offsetof(struct dbufbuf, buf)
 
 void dbuf_init(void)
 {
-	dbuf_bufpool = mp_pool_new(sizeof(struct dbufbuf), 512 * 1024);
+	int i;
+
+	for (i = 0; i < DBUF_POOLS; i++)
+		dbuf_bufpool[i] = mp_pool_new(DBUF_REF_SIZE + dbuf_pool_size[i], 512 * 1024);
+	dbuf_refpool = mp_pool_new(DBUF_REF_SIZE, 512 * 1024);
+}
+
+/*
+** dbuf_alloc_unlinked - allocates a block that is not on any dbuf yet,
+** either from freelist or a new one.
+** The block size is chosen based on how much data will be in the
+** buffer: idle clients get small blocks, while for busy connections
+** (with lots of data queued) we use bigger blocks, up to
+** set::sendq-block-size. This means fewer blocks to allocate, link
+** and write for the sockets that move the most data.
+*/
+static dbufbuf *dbuf_alloc_unlinked(size_t want)
+{
+	dbufbuf *ptr;
+	int i;
+	size_t max = iConf.sendq_block_size ? iConf.sendq_block_size : DBUF_BLOCK_SIZE_MAX;
+
+	for (i = 0; i < DBUF_POOLS - 1; i++)
+		if ((dbuf_pool_size[i] >= want) || (dbuf_pool_size[i+1] > max))
+			break;
+
+	ptr = mp_pool_get(dbuf_bufpool[i]);
+	memset(ptr, 0, DBUF_REF_SIZE);
+	ptr->bufsize = dbuf_pool_size[i];
+	ptr->data = ptr->buf;
+
+	INIT_LIST_HEAD(&ptr->dbuf_node);
+
+	return ptr;
+}
+
+/*
+** dbuf_alloc - allocates a dbufbuf structure (see dbuf_alloc_unlinked()
+** for the size) and adds it to the end of the dbuf.
+*/
+static dbufbuf *dbuf_alloc(dbuf *dbuf_p, size_t want)
+{
+	dbufbuf *ptr;
+
+	assert(dbuf_p != NULL);
+
+	ptr = dbuf_alloc_unlinked(want);
+	list_add_tail(&ptr->dbuf_node, &dbuf_p->dbuf_list);
+
+	return ptr;
 }
 
 /*
-** dbuf_alloc - allocates a dbufbuf structure either from freelist or
-** creates a new one.
+** dbuf_alloc_ref - allocates a dbufbuf structure that references
+** a shared payload, rather than holding the data itself.
 */
-static dbufbuf *dbuf_alloc(dbuf *dbuf_p)
+static dbufbuf *dbuf_alloc_ref(dbuf *dbuf_p, dbufshared *shared)
 {
 	dbufbuf *ptr;
 
 	assert(dbuf_p != NULL);
 
-	ptr = mp_pool_get(dbuf_bufpool);
-	memset(ptr, 0, sizeof(dbufbuf));
+	ptr = mp_pool_get(dbuf_refpool);
+	memset(ptr, 0, DBUF_REF_SIZE);
+	ptr->shared = shared;
+	ptr->data = shared->data;
+	ptr->size = shared->size;
+	shared->refcount++;
 
 	INIT_LIST_HEAD(&ptr->dbuf_node);
 	list_add_tail(&ptr->dbuf_node, &dbuf_p->dbuf_list);
@@ -52,10 +115,39 @@ static void dbuf_free(dbufbuf *ptr)
 {
 	assert(ptr != NULL);
 
+	if (ptr->shared)
+		dbuf_shared_release(ptr->shared);
 	list_del(&ptr->dbuf_node);
 	mp_pool_release(ptr);
 }
 
+/*
+** dbuf_shared_new - create a shared payload, the caller holds
+** the first reference.
+*/
+dbufshared *dbuf_shared_new(char *buf, size_t length)
+{
+	dbufshared *shared = safe_alloc(sizeof(dbufshared) + length);
+
+	shared->refcount = 1;
+	shared->size = length;
+	memcpy(shared->data, buf, length);
+
+	return shared;
+}
+
+/*
+** dbuf_shared_release - drop a reference to a shared payload
+** and free it if this was the last one.
+*/
+void dbuf_shared_release(dbufshared *shared)
+{
+	assert(shared->refcount > 0);
+
+	if (--shared->refcount == 0)
+		safe_free(shared);
+}
+
 void dbuf_queue_init(dbuf *dyn)
 {
 	INIT_LIST_HEAD(&dyn->dbuf_list);
@@ -67,18 +159,23 @@ void dbuf_put(dbuf *dyn, char *buf, size_t length)
 	size_t amount;
 
 	assert(length > 0);
-	if (list_empty(&dyn->dbuf_list))
-		dbuf_alloc(dyn);
 
 	while (length > 0)
 	{
-		block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
-
-		amount = DBUF_BLOCK_SIZE - block->size;
+		/* Room left at the end of the last block, if any.
+		 * Never append to a shared payload, it is read-only.
+		 */
+		amount = 0;
+		if (!list_empty(&dyn->dbuf_list))
+		{
+			block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
+			if (!block->shared)
+				amount = block->buf + block->bufsize - (block->data + block->size);
+		}
 		if (!amount)
 		{
-			block = dbuf_alloc(dyn);
-			amount = DBUF_BLOCK_SIZE;
+			block = dbuf_alloc(dyn, dyn->length + length);
+			amount = block->bufsize;
 		}
 		if (amount > length)
 			amount = length;
@@ -92,6 +189,65 @@ void dbuf_put(dbuf *dyn, char *buf, size_t length)
 	}
 }
 
+void dbuf_put_shared(dbuf *dyn, dbufshared *shared)
+{
+	assert(shared->size > 0);
+
+	dbuf_alloc_ref(dyn, shared);
+	dyn->length += shared->size;
+}
+
+char *dbuf_reserve(dbuf *dyn, dbufbuf **reserved, size_t *room)
+{
+	dbufbuf *block;
+
+	/* Use the room at the end of the last block, if it is worth it */
+	if (!list_empty(&dyn->dbuf_list))
+	{
+		block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
+		if (!block->shared)
+		{
+			*room = block->buf + block->bufsize - (block->data + block->size);
+			if (*room >= DBUF_RESERVE_MIN)
+			{
+				*reserved = NULL;
+				return block->data + block->size;
+			}
+		}
+	}
+
+	/* Otherwise a new block, which is only added by dbuf_commit() */
+	block = dbuf_alloc_unlinked(dyn->length + DBUF_BLOCK_SIZE_MEDIUM);
+	*reserved = block;
+	*room = block->bufsize;
+	return block->data;
+}
+
+void dbuf_commit(dbuf *dyn, dbufbuf *reserved, size_t length)
+{
+	dbufbuf *block;
+
+	if (!reserved)
+	{
+		/* Data was stored at the end of the last block */
+		if (length == 0)
+			return;
+		block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
+		block->size += length;
+		dyn->length += length;
+		return;
+	}
+
+	if (length == 0)
+	{
+		dbuf_free(reserved);
+		return;
+	}
+	reserved->size = length;
+	list_add_tail(&reserved->dbuf_node, &dyn->dbuf_list);
+	dyn->length += length;
+}
+
 void dbuf_delete(dbuf *dyn, size_t length)
 {
 	struct dbufbuf *block;
@@ -114,9 +270,207 @@ void dbuf_delete(dbuf *dyn, size_t length)
 		dbuf_free(block);
 	}
 
+	/* Partially consumed block: just move the start forward */
 	block->size -= length;
 	dyn->length -= length;
-	memmove(block->data, &block->data[length], block->size);
+	block->data += length;
+}
+
+size_t dbuf_map(dbuf *dyn, char *tmp, size_t want, char **ptr)
+{
+	dbufbuf *block;
+	size_t len = 0, amount;
+
+	*ptr = NULL;
+	if (list_empty(&dyn->dbuf_list))
+		return 0;
+
+	/* The common case: it's all in the first block */
+	block = container_of(dyn->dbuf_list.next, struct dbufbuf, dbuf_node);
+	if ((block->size >= want) || (block->size == dyn->length))
+	{
+		*ptr = block->data;
+		return MIN(block->size, want);
+	}
+
+	/* Otherwise, gather the data from multiple blocks */
+	list_for_each_entry2(block, dbufbuf, &dyn->dbuf_list, dbuf_node)
+	{
+		amount = MIN(block->size, want - len);
+		memcpy(tmp + len, block->data, amount);
+		len += amount;
+		if (len == want)
+			break;
+	}
+	*ptr = tmp;
+	return len;
+}
+
+#ifndef _WIN32
+int dbuf_map_iovec(dbuf *dyn, struct iovec *iov, int max, size_t *len)
+{
+	dbufbuf *block;
+	int cnt = 0;
+
+	*len = 0;
+	list_for_each_entry2(block, dbufbuf, &dyn->dbuf_list, dbuf_node)
+	{
+		if (cnt == max)
+			break;
+		iov[cnt].iov_base = block->data;
+		iov[cnt].iov_len = block->size;
+		*len += block->size;
+		cnt++;
+	}
+	return cnt;
+}
+#endif
+
+/* Find the first CR or LF in [p, end), or 'end' if there is none.
+ * Lines are looked at 32 (AVX2), 16 (SSE2) or 8 bytes at a time.
+ */
+#define HASZERO(v)	(((v) - 0x0101010101010101ULL) & ~(v) & 0x8080808080808080ULL)
+static inline char *dbuf_find_eol(char *p, char *end)
+{
+	uint64_t v;
+
+#ifdef __AVX2__
+	const __m256i cr32 = _mm256_set1_epi8('\r'), lf32 = _mm256_set1_epi8('\n');
+	while (end - p >= 32)
+	{
+		__m256i d = _mm256_loadu_si256((const __m256i *)p);
+		int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(d, cr32), _mm256_cmpeq_epi8(d, lf32)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+#ifdef __SSE2__
+	const __m128i cr16 = _mm_set1_epi8('\r'), lf16 = _mm_set1_epi8('\n');
+	while (end - p >= 16)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)p);
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(d, cr16), _mm_cmpeq_epi8(d, lf16)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (end - p >= 8)
+	{
+		memcpy(&v, p, 8);
+		if (HASZERO(v ^ 0x0d0d0d0d0d0d0d0dULL) | HASZERO(v ^ 0x0a0a0a0a0a0a0a0aULL))
+			break;
+		p += 8;
+	}
+	while ((p < end) && (*p != '\r') && (*p != '\n'))
+		p++;
+	return p;
+}
+
+/* Get the next complete line from a private block, in place.
+ * On success the line is terminated, the block is advanced past it
+ * (and past any CR/LF/spaces after it) and the length is returned.
+ * Otherwise the block is not touched and 0 is returned.
+ */
+static int dbuf_block_getmsg(dbufbuf *block, char **line)
+{
+	char *p, *start, *end;
+	int len;
+
+	start = block->data;
+	end = block->data + block->size;
+	while ((start < end) && ((*start == '\r') || (*start == '\n') || (*start == ' ')))
+		start++;
+	p = dbuf_find_eol(start, end);
+	len = p - start;
+	if ((p == end) || (len == 0) || (len > READBUFSIZE - 2))
+		return 0; /* not in this block, or needs truncating */
+
+	*p++ = '\0';
+	while ((p < end) && ((*p == '\r') || (*p == '\n') || (*p == ' ')))
+		p++;
+
+	block->size = end - p;
+	block->data = p;
+	*line = start;
+	return len;
+}
+
+/*
+** dbuf_getmsg_inplace
+**
+** Like dbuf_getmsg(), but if the line is in the first block then the line
+** is not copied. Instead, it is terminated in place and 'line' points to it.
+** The block is taken off the buffer (with the rest of its data) so that the
+** line stays valid, even if the buffer is cleared while it is being parsed.
+** The block is returned via 'pinned' and must be handed back through
+** dbuf_getmsg_done(). If the line is not in the first block, then this is
+** the same as dbuf_getmsg() with 'line' pointing to 'buf' and 'pinned' NULL.
+*/
+int dbuf_getmsg_inplace(dbuf *dyn, char *buf, char **line, dbufbuf **pinned)
+{
+	dbufbuf *block;
+	size_t size;
+	int len;
+
+	*pinned = NULL;
+	*line = buf;
+
+	if (list_empty(&dyn->dbuf_list))
+	{
+		*buf = '\0';
+		return 0;
+	}
+
+	block = container_of(dyn->dbuf_list.next, struct dbufbuf, dbuf_node);
+	if (block->shared)
+		return dbuf_getmsg(dyn, buf);
+
+	size = block->size;
+	len = dbuf_block_getmsg(block, line);
+	if (len == 0)
+	{
+		*line = buf;
+		return dbuf_getmsg(dyn, buf);
+	}
+
+	list_del_init(&block->dbuf_node);
+	dyn->length -= size;
+	*pinned = block;
+	return len;
+}
+
+/*
+** dbuf_getmsg_next
+**
+** Get the next line from a block returned by dbuf_getmsg_inplace(),
+** so all complete lines in a block can be parsed in one go, without
+** putting the block back in between. Returns 0 if the rest of the block
+** does not hold a complete line, the block must then be handed back
+** through dbuf_getmsg_done() as usual.
+*/
+int dbuf_getmsg_next(dbufbuf *pinned, char **line)
+{
+	return dbuf_block_getmsg(pinned, line);
+}
+
+/*
+** dbuf_getmsg_done
+**
+** Hand back a block from dbuf_getmsg_inplace(). If 'keep' is set, the
+** rest of the data in the block is put back at the start of the buffer,
+** otherwise it is thrown away (eg: because the client is being killed).
+*/
+void dbuf_getmsg_done(dbuf *dyn, dbufbuf *pinned, int keep)
+{
+	if (keep && pinned->size)
+	{
+		list_add(&pinned->dbuf_node, &dyn->dbuf_list);
+		dyn->length += pinned->size;
+		return;
+	}
+	dbuf_free(pinned);
 }
 
 /*
@@ -132,8 +486,8 @@ int  dbuf_getmsg(dbuf *dyn, char *buf)
 {
 	dbufbuf *block;
 	int line_bytes = 0, empty_bytes = 0, phase = 0;
-	unsigned int idx;
-	char c;
+	int n, amount;
+	char *s, *e, *eol;
 	char *p = buf;
 
 	/*
@@ -150,25 +504,39 @@ int  dbuf_getmsg(dbuf *dyn, char *buf)
 	 */
 	list_for_each_entry2(block, dbufbuf, &dyn->dbuf_list, dbuf_node)
 	{
-		for (idx = 0; idx < block->size; idx++)
+		s = block->data;
+		e = block->data + block->size;
+		while (s < e)
 		{
-			c = block->data[idx];
-			if (c == '\r' || c == '\n' || (c == ' ' && phase != 1))
+			if (phase != 1)
 			{
-				empty_bytes++;
-				if (phase == 1)
-					phase = 2;
-			}
-			else switch (phase)
-			{
-				case 0: phase = 1; /* FALLTHROUGH */
-				case 1: if (line_bytes++ < READBUFSIZE - 2)
-						*p++ = c;
-					break;
-				case 2: *p = '\0';
+				if ((*s == '\r') || (*s == '\n') || (*s == ' '))
+				{
+					empty_bytes++;
+					s++;
+					continue;
+				}
+				if (phase == 2)
+				{
+					*p = '\0';
 					dbuf_delete(dyn, line_bytes + empty_bytes);
 					return MIN(line_bytes, READBUFSIZE - 2);
+				}
+				phase = 1;
+			}
+			/* Phase 1: copy up to the CR or LF (if it is in this block) */
+			eol = dbuf_find_eol(s, e);
+			n = eol - s;
+			if (line_bytes < READBUFSIZE - 2)
+			{
+				amount = MIN(n, READBUFSIZE - 2 - line_bytes);
+				memcpy(p, s, amount);
+				p += amount;
 			}
+			line_bytes += n;
+			s = eol;
+			if (s < e)
+				phase = 2;
 		}
 	}
 
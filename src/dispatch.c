@@ -42,6 +42,10 @@
 /***************************************************************************************
  * Backend-independent functions.  fd_setselect() and friends                          *
  ***************************************************************************************/
+
+/** When the last fd_select() was done waiting (profile_time_ns()), see SocketLoop() */
+uint64_t fd_select_woke = 0;
+
 void fd_setselect(int fd, int flags, IOCallbackFunc iocb, void *data)
 {
 	FDEntry *fde;
@@ -87,6 +91,34 @@ void fd_setselect(int fd, int flags, IOCallbackFunc iocb, void *data)
 		fd_refresh(fd);
 }
 
+/** Allow the I/O engine to use edge-triggered notification for this fd.
+ * Only call this if ALL code that reads from or writes to the fd calls
+ * fd_wouldblock() when the socket returns EWOULDBLOCK (or the SSL/TLS
+ * equivalent), otherwise the I/O engine will keep calling the callbacks.
+ * Backends that don't support edge-triggered mode ignore this.
+ */
+void fd_setedge(int fd)
+{
+	if ((fd < 0) || (fd >= MAXCONNECTIONS))
+		return;
+
+	fd_table[fd].edge_triggered = 1;
+}
+
+/** Tell the I/O engine that reading and/or writing would block.
+ * @param fd		The file descriptor
+ * @param flags		FD_SELECT_READ and/or FD_SELECT_WRITE
+ * @note  For edge-triggered fds the callbacks will not be called again
+ *        until the kernel reports the fd being ready again.
+ */
+void fd_wouldblock(int fd, int flags)
+{
+	if ((fd < 0) || (fd >= MAXCONNECTIONS))
+		return;
+
+	fd_table[fd].ready_flags &= ~flags;
+}
+
 /***************************************************************************************
  * select() backend.                                                                   *
  ***************************************************************************************/
@@ -147,10 +179,10 @@ void fd_debug(fd_set *f, int highest, char *name)
 		}
 	}
 }
-void fd_select(time_t delay)
+int fd_select(time_t delay)
 {
 	struct timeval to;
-	int num, fd;
+	int num, fd, ready;
 	fd_set work_read_fds;
 	fd_set work_write_fds;
 #ifdef _WIN32
@@ -177,6 +209,7 @@ void fd_select(time_t delay)
 #else
 	num = select(highest_fd + 1, &work_read_fds, &work_write_fds, NULL, &to);
 #endif
+	fd_select_woke = profile_time_ns();
 	if (num < 0)
 	{
 		extern void report_baderror(char *text, Client *client);
@@ -192,7 +225,8 @@ void fd_select(time_t delay)
 	}
 
 	if (num <= 0)
-		return;
+		return 0;
+	ready = num;
 
 	for (fd = 0; fd <= highest_fd && num > 0; fd++)
 	{
@@ -245,6 +279,7 @@ void fd_select(time_t delay)
 
 		num--;
 	}
+	return ready;
 }
 
 void fd_fork()
@@ -346,7 +381,7 @@ void fd_refresh(int fd)
 	}
 }
 
-void fd_select(time_t delay)
+int fd_select(time_t delay)
 {
 	struct timespec ts;
 	int num, p, revents, fd;
@@ -363,8 +398,9 @@ void fd_select(time_t delay)
 	ts.tv_nsec = delay % 1000 * 1000000;
 
 	num = kevent(kqueue_fd, NULL, 0, kqueue_events, MAXCONNECTIONS * 2, &ts);
+	fd_select_woke = profile_time_ns();
 	if (num <= 0)
-		return;
+		return 0;
 
 	for (p = 0; p < num; p++)
 	{
@@ -393,6 +429,7 @@ void fd_select(time_t delay)
 				iocb(fd, FD_SELECT_WRITE, fde->data);
 		}
 	}
+	return num;
 }
 #endif
 
@@ -403,18 +440,53 @@ void fd_select(time_t delay)
 
 #include <sys/epoll.h>
 
+#ifdef BACKEND_IO_URING
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+/* Multishot poll and waiting with a timeout need Linux 5.13 headers */
+# if !defined(IORING_POLL_ADD_MULTI) || !defined(IORING_FEAT_RSRC_TAGS) || !defined(__NR_io_uring_setup)
+#  undef BACKEND_IO_URING
+# endif
+#endif
+
 static int epoll_fd = -1;
 static struct epoll_event epfds[MAXCONNECTIONS + 1];
 
-void fd_refresh(int fd)
+/* fd_refresh() only queues the fd in 'changed_fds'. The actual epoll_ctl()
+ * calls are done by fd_apply_changes() right before we wait for events,
+ * so flipping a callback back and forth within one loop iteration does not
+ * cost any syscalls.
+ */
+static int changed_fds[MAXCONNECTIONS + 1];
+static int num_changed_fds = 0;
+
+/* Edge-triggered fds that are ready and have a callback for it.
+ * These are processed by fd_select() without waiting for a new event.
+ */
+static int ready_fds[MAXCONNECTIONS + 1];
+static int num_ready_fds = 0;
+
+/* Whether the fd is in changed_fds and/or ready_fds. Not part of the
+ * FDEntry since that one is wiped on fd_open() and fd_unmap().
+ */
+static unsigned char fd_queued[MAXCONNECTIONS + 1];
+#define FD_QUEUED_CHANGE	0x1
+#define FD_QUEUED_READY		0x2
+
+/** Returns the FD_SELECT_* flags for which the fd has a callback */
+static inline int fd_interest(FDEntry *fde)
 {
-	struct epoll_event ep_event;
-	FDEntry *fde = &fd_table[fd];
-	unsigned int pflags = 0;
-	int op = -1;
+	return (fde->read_callback ? FD_SELECT_READ : 0) |
+	       (fde->write_callback ? FD_SELECT_WRITE : 0);
+}
 
-	if (epoll_fd == -1)
-		epoll_fd = epoll_create(MAXCONNECTIONS);
+/** Returns the events the kernel should report for this fd:
+ * EPOLLIN and/or EPOLLOUT, plus EPOLLET for edge-triggered fds.
+ */
+static unsigned int fd_wanted_events(FDEntry *fde)
+{
+	unsigned int pflags = 0;
 
 	if (fde->read_callback)
 		pflags |= EPOLLIN;
@@ -422,6 +494,394 @@ void fd_refresh(int fd)
 	if (fde->write_callback)
 		pflags |= EPOLLOUT;
 
+#ifdef EPOLL_EDGE_TRIGGERED
+	/* Edge-triggered fds are registered once for everything,
+	 * we only stop listening to them when they are closed.
+	 */
+	if (pflags && fde->edge_triggered && fde->is_open)
+		pflags = EPOLLIN | EPOLLOUT | EPOLLET;
+#endif
+
+	return pflags;
+}
+
+/** Queue an fd for fd_apply_changes() */
+static void fd_queue_change(int fd)
+{
+	if (fd_queued[fd] & FD_QUEUED_CHANGE)
+		return;
+	fd_queued[fd] |= FD_QUEUED_CHANGE;
+	changed_fds[num_changed_fds++] = fd;
+}
+
+#ifdef EPOLL_EDGE_TRIGGERED
+/** Queue an edge-triggered fd for processing by fd_select() */
+static void fd_queue_ready(int fd)
+{
+	if (fd_queued[fd] & FD_QUEUED_READY)
+		return;
+	fd_queued[fd] |= FD_QUEUED_READY;
+	ready_fds[num_ready_fds++] = fd;
+}
+#endif
+
+#ifdef BACKEND_IO_URING
+/***************************************************************************************
+ * io_uring() backend. This uses the same bookkeeping as the epoll backend, but        *
+ * instead of epoll_ctl() calls we put poll requests in the submission ring, which     *
+ * are handed to the kernel in the same syscall that waits for events. The kernel      *
+ * must be Linux 5.13 or later, otherwise we fall back to epoll.                       *
+ * Note that the poll(2) event bits are the same as the EPOLL* ones.                   *
+ ***************************************************************************************/
+
+#define URING_ENTRIES		1024
+#define URING_CANCEL		((__u64)-1)	/* user_data of cancel requests */
+
+#define URING_UNTRIED		0
+#define URING_ACTIVE		1
+#define URING_UNAVAILABLE	2
+
+static int uring_state = URING_UNTRIED;
+
+static struct {
+	int fd;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;
+	unsigned sqe_tail;
+} uring;
+
+/* The events of the poll request that is active for each fd, and a
+ * generation number that is part of the user_data of the request so
+ * completions of cancelled requests can be recognized and ignored.
+ */
+static unsigned int uring_armed[MAXCONNECTIONS + 1];
+static unsigned int uring_gen[MAXCONNECTIONS + 1];
+
+static void uring_free(void)
+{
+	if (uring.sqes)
+		munmap(uring.sqes, uring.sqes_size);
+	if (uring.cq_ring && (uring.cq_ring != uring.sq_ring))
+		munmap(uring.cq_ring, uring.cq_ring_size);
+	if (uring.sq_ring)
+		munmap(uring.sq_ring, uring.sq_ring_size);
+	if (uring.fd >= 0)
+		close(uring.fd);
+	memset(&uring, 0, sizeof(uring));
+	uring.fd = -1;
+}
+
+/** Set up the rings.
+ * @returns 1 on success, 0 if io_uring cannot be used (errno is set).
+ */
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	int single_mmap;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	p.cq_entries = MAXCONNECTIONS * 2;
+	uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (uring.fd < 0)
+		return 0;
+
+	/* We need timeouts in io_uring_enter() (EXT_ARG), not losing
+	 * any completions (NODROP) and multishot poll, for which
+	 * RSRC_TAGS is the feature flag of the same kernel release.
+	 */
+	if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_RSRC_TAGS))
+	{
+		uring_free();
+		SET_ERRNO(ENOSYS);
+		return 0;
+	}
+
+	single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+	uring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (single_mmap && (uring.cq_ring_size > uring.sq_ring_size))
+		uring.sq_ring_size = uring.cq_ring_size;
+
+	uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ|PROT_WRITE,
+	                     MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (uring.sq_ring == MAP_FAILED)
+	{
+		uring.sq_ring = NULL;
+		uring_free();
+		return 0;
+	}
+
+	if (single_mmap)
+	{
+		uring.cq_ring = uring.sq_ring;
+	} else {
+		uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ|PROT_WRITE,
+		                     MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+		if (uring.cq_ring == MAP_FAILED)
+		{
+			uring.cq_ring = NULL;
+			uring_free();
+			return 0;
+		}
+	}
+
+	uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ|PROT_WRITE,
+	                  MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED)
+	{
+		uring.sqes = NULL;
+		uring_free();
+		return 0;
+	}
+
+	uring.sq_head = (unsigned *)((char *)uring.sq_ring + p.sq_off.head);
+	uring.sq_tail = (unsigned *)((char *)uring.sq_ring + p.sq_off.tail);
+	uring.sq_mask = (unsigned *)((char *)uring.sq_ring + p.sq_off.ring_mask);
+	uring.sq_flags = (unsigned *)((char *)uring.sq_ring + p.sq_off.flags);
+	uring.sq_array = (unsigned *)((char *)uring.sq_ring + p.sq_off.array);
+	uring.cq_head = (unsigned *)((char *)uring.cq_ring + p.cq_off.head);
+	uring.cq_tail = (unsigned *)((char *)uring.cq_ring + p.cq_off.tail);
+	uring.cq_mask = (unsigned *)((char *)uring.cq_ring + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)((char *)uring.cq_ring + p.cq_off.cqes);
+	uring.sq_entries = p.sq_entries;
+	uring.sqe_tail = *uring.sq_tail;
+
+	return 1;
+}
+
+/** Submit the queued requests and optionally wait for completions.
+ * @param delay		Wait this many msecs for a completion, 0 = don't wait.
+ */
+static void uring_enter(time_t delay)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit;
+
+	__atomic_store_n(uring.sq_tail, uring.sqe_tail, __ATOMIC_RELEASE);
+	to_submit = uring.sqe_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	memset(&ts, 0, sizeof(ts));
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000;
+	arg.ts = (__u64)(uintptr_t)&ts;
+
+	/* Errors like ETIME and EINTR are fine, we simply return */
+	(void)syscall(__NR_io_uring_enter, uring.fd, to_submit, delay ? 1 : 0,
+	              IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+/** Get a zeroed submission queue entry */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (uring.sqe_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries)
+		uring_enter(0); /* full, submit what we have so far */
+
+	idx = uring.sqe_tail & *uring.sq_mask;
+	sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring.sq_array[idx] = idx;
+	uring.sqe_tail++;
+	return sqe;
+}
+
+/** Queue the cancellation of the poll request of this fd */
+static void uring_cancel(int fd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = ((__u64)uring_gen[fd] << 32) | fd;
+	sqe->user_data = URING_CANCEL;
+	uring_gen[fd]++;
+	uring_armed[fd] = 0;
+}
+
+/** Called for an fd that is about to be closed. The poll request holds
+ * a reference to the socket, so if we would not cancel it right away
+ * the socket would stay open even after the close().
+ */
+static void uring_cancel_now(int fd)
+{
+	if (!uring_armed[fd])
+		return;
+	uring_cancel(fd);
+	uring_enter(0);
+}
+
+/** Synchronize the kernel's view of a changed fd (io_uring) */
+static void uring_apply_change(int fd)
+{
+	FDEntry *fde = &fd_table[fd];
+	unsigned int pflags = fd_wanted_events(fde);
+	unsigned int mask;
+	struct io_uring_sqe *sqe;
+
+	if (pflags == uring_armed[fd])
+		return;
+
+	if (uring_armed[fd])
+		uring_cancel(fd);
+
+	if (pflags)
+	{
+		mask = pflags & (EPOLLIN|EPOLLOUT);
+#if __BYTE_ORDER == __BIG_ENDIAN
+		mask = (mask << 16) | (mask >> 16);
+#endif
+		sqe = uring_get_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = mask;
+		/* Edge-triggered fds get a multishot request, which
+		 * stays active and posts a completion on every change.
+		 */
+		if (pflags & EPOLLET)
+			sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = ((__u64)uring_gen[fd] << 32) | fd;
+		uring_armed[fd] = pflags;
+	}
+
+	fde->backend_flags = uring_armed[fd];
+}
+
+static void fd_apply_changes(void);
+
+/** Submit changes, wait for events and put them in 'events' like epoll_wait() does */
+static int uring_wait(struct epoll_event *events, int maxevents, time_t delay)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	int num = 0, fd;
+
+	fd_apply_changes();
+	uring_enter(delay);
+
+	head = *uring.cq_head;
+	tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; (head != tail) && (num < maxevents); head++)
+	{
+		cqe = &uring.cqes[head & *uring.cq_mask];
+		if (cqe->user_data == URING_CANCEL)
+			continue;
+
+		fd = (int)(cqe->user_data & 0xffffffff);
+		if ((fd < 0) || (fd >= MAXCONNECTIONS) || ((cqe->user_data >> 32) != uring_gen[fd]))
+			continue; /* cancelled request */
+
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+		{
+			/* One-shot request, or the kernel ended a multishot one.
+			 * Either way, submit a new one if we are still interested.
+			 */
+			uring_armed[fd] = 0;
+			fd_table[fd].backend_flags = 0;
+			if (cqe->res >= 0)
+				fd_queue_change(fd);
+		}
+
+		if (cqe->res < 0)
+		{
+			ircd_log(LOG_ERROR, "[BUG] fd_select(): io_uring poll returned error %d (%s) for fd %d (%s)",
+				-cqe->res, STRERROR(-cqe->res), fd, fd_table[fd].desc);
+			continue;
+		}
+
+		events[num].events = cqe->res;
+		events[num].data.ptr = &fd_table[fd];
+		num++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+	return num;
+}
+
+/** Decide on io_uring or epoll */
+static void uring_start(void)
+{
+	if (uring_init())
+	{
+		uring_state = URING_ACTIVE;
+		return;
+	}
+	ircd_log(LOG_ERROR, "io_uring is not available (%s), using epoll instead",
+		STRERROR(ERRNO));
+	uring_state = URING_UNAVAILABLE;
+}
+
+/** The ring is not usable in the child process. Start over. */
+static void uring_fork(void)
+{
+	int fd;
+
+	if (uring_state != URING_ACTIVE)
+		return;
+
+	uring_free();
+	uring_state = URING_UNTRIED;
+	for (fd = 0; fd < MAXCONNECTIONS; fd++)
+	{
+		if (uring_armed[fd])
+		{
+			uring_armed[fd] = 0;
+			fd_table[fd].backend_flags = 0;
+			fd_queue_change(fd);
+		}
+	}
+}
+#endif
+
+void fd_refresh(int fd)
+{
+	FDEntry *fde = &fd_table[fd];
+
+#ifdef BACKEND_IO_URING
+	if (!fde->is_open && (uring_state == URING_ACTIVE))
+	{
+		uring_cancel_now(fd);
+		return;
+	}
+#endif
+#ifdef EPOLL_EDGE_TRIGGERED
+	if (fde->backend_flags & EPOLLET)
+	{
+		/* Registered for all events already, but if we
+		 * now have a callback for something that we know
+		 * is ready then make sure it is called.
+		 */
+		if (fde->ready_flags & fd_interest(fde))
+			fd_queue_ready(fd);
+		return;
+	}
+#endif
+	fd_queue_change(fd);
+}
+
+/** Synchronize the kernel's view of a changed fd (epoll) */
+static void epoll_apply_change(int fd)
+{
+	struct epoll_event ep_event;
+	FDEntry *fde = &fd_table[fd];
+	unsigned int pflags = fd_wanted_events(fde);
+	int op = -1;
+
 	if (pflags == 0 && fde->backend_flags == 0)
 		return;
 	else if (pflags == 0)
@@ -451,21 +911,61 @@ void fd_refresh(int fd)
 	fde->backend_flags = pflags;
 }
 
-void fd_select(time_t delay)
+/** Do all the epoll_ctl() calls that were queued by fd_refresh() */
+static void fd_apply_changes(void)
 {
-	int num, p, revents, fd;
+	int i, fd;
+
+	for (i = 0; i < num_changed_fds; i++)
+	{
+		fd = changed_fds[i];
+		fd_queued[fd] &= ~FD_QUEUED_CHANGE;
+#ifdef BACKEND_IO_URING
+		if (uring_state == URING_ACTIVE)
+		{
+			uring_apply_change(fd);
+			continue;
+		}
+#endif
+		epoll_apply_change(fd);
+	}
+	num_changed_fds = 0;
+}
+
+int fd_select(time_t delay)
+{
+	int num, p, revents, fd, ready;
 	struct epoll_event *epfd;
 #ifdef DEBUG_IOENGINE
 	int read_callbacks = 0, write_callbacks = 0;
 	struct timeval oldt, t;
 	long long tdiff;
 #endif
-	if (epoll_fd == -1)
-		epoll_fd = epoll_create(MAXCONNECTIONS);
+	/* Don't sleep if there is work left on edge-triggered fds */
+	if (num_ready_fds)
+		delay = 0;
 
-	num = epoll_wait(epoll_fd, epfds, MAXCONNECTIONS, delay);
-	if (num <= 0)
-		return;
+#ifdef BACKEND_IO_URING
+	if (uring_state == URING_UNTRIED)
+		uring_start();
+
+	if (uring_state == URING_ACTIVE)
+	{
+		num = uring_wait(epfds, MAXCONNECTIONS, delay);
+	} else
+#endif
+	{
+		if (epoll_fd == -1)
+			epoll_fd = epoll_create(MAXCONNECTIONS);
+		fd_apply_changes();
+		num = epoll_wait(epoll_fd, epfds, MAXCONNECTIONS, delay);
+	}
+	fd_select_woke = profile_time_ns();
+	if (num < 0)
+		num = 0;
+	ready = num + num_ready_fds;
+	if (ready == 0)
+		return 0;
 
 #ifdef DEBUG_IOENGINE
 	gettimeofday(&oldt, NULL);
@@ -492,6 +992,16 @@ void fd_select(time_t delay)
 		if (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR))
 			evflags |= FD_SELECT_WRITE;
 
+#ifdef EPOLL_EDGE_TRIGGERED
+		if (fde->backend_flags & EPOLLET)
+		{
+			/* Remember, the callbacks are called below */
+			fde->ready_flags |= evflags;
+			fd_queue_ready(fd);
+			continue;
+		}
+#endif
+
 		if (evflags & FD_SELECT_READ)
 		{
 			iocb = fde->read_callback;
@@ -524,6 +1034,73 @@ void fd_select(time_t delay)
 #endif
 	}
 
+#ifdef EPOLL_EDGE_TRIGGERED
+	/* Now call the callbacks of edge-triggered fds that are ready.
+	 * The callbacks may add fds to the list while we are walking it,
+	 * those are handled in the next round.
+	 */
+	num = num_ready_fds;
+	for (p = 0; p < num; p++)
+	{
+		FDEntry *fde;
+		IOCallbackFunc iocb;
+		int evflags;
+
+		fd = ready_fds[p];
+		fde = &fd_table[fd];
+		if (!fde->is_open || !(fde->backend_flags & EPOLLET))
+			continue;
+
+		evflags = fde->ready_flags & fd_interest(fde);
+
+		if (evflags & FD_SELECT_READ)
+		{
+			iocb = fde->read_callback;
+
+			if (iocb != NULL)
+				iocb(fd, evflags, fde->data);
+
+#ifdef DEBUG_IOENGINE
+			read_callbacks++;
+#endif
+		}
+
+		/* The read callback may have changed things */
+		if ((evflags & FD_SELECT_WRITE) && (fde->ready_flags & FD_SELECT_WRITE))
+		{
+			iocb = fde->write_callback;
+
+			if (iocb != NULL)
+				iocb(fd, evflags, fde->data);
+
+#ifdef DEBUG_IOENGINE
+			write_callbacks++;
+#endif
+		}
+	}
+
+	/* Keep only the fds that still have work left. If the callbacks
+	 * did not run into EWOULDBLOCK then the fd is still ready and we
+	 * need to call them again, since the kernel won't tell us.
+	 */
+	num = 0;
+	for (p = 0; p < num_ready_fds; p++)
+	{
+		FDEntry *fde;
+
+		fd = ready_fds[p];
+		fde = &fd_table[fd];
+		if (fde->is_open && (fde->backend_flags & EPOLLET) &&
+		    (fde->ready_flags & fd_interest(fde)))
+		{
+			ready_fds[num++] = fd;
+		} else {
+			fd_queued[fd] &= ~FD_QUEUED_READY;
+		}
+	}
+	num_ready_fds = num;
+#endif
+
 #ifdef DEBUG_IOENGINE
 	gettimeofday(&t, NULL);
 	tdiff = ((t.tv_sec - oldt.tv_sec) * 1000000) + (t.tv_usec - oldt.tv_usec);
@@ -534,11 +1111,15 @@ void fd_select(time_t delay)
 			tdiff / 1000, read_callbacks, write_callbacks);
 	}
 #endif
+	return ready;
 }
 
 
 void fd_fork()
 {
+#ifdef BACKEND_IO_URING
+	uring_fork();
+#endif
 }
 
 #endif
@@ -583,14 +1164,15 @@ void fd_refresh(int fd)
 	fde->backend_flags = pflags;
 }
 
-void fd_select(time_t delay)
+int fd_select(time_t delay)
 {
 	int num, p, revents, fd;
 	struct pollfd *pfd;
 
 	num = poll(pollfds, nfds + 1, delay);
+	fd_select_woke = profile_time_ns();
 	if (num <= 0)
-		return;
+		return 0;
 
 	for (p = 0; p < (nfds + 1); p++)
 	{
@@ -628,6 +1210,7 @@ void fd_select(time_t delay)
 				iocb(fd, evflags, fde->data);
 		}
 	}
+	return num;
 }
 
 
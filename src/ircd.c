@@ -59,7 +59,6 @@ void restart(char *);
 static void open_debugfile(), setup_signals();
 extern void init_glines(void);
 extern void tkl_init(void);
-extern void process_clients(void);
 
 #ifndef _WIN32
 MODVAR char **myargv;
@@ -380,26 +379,100 @@ int match_tkls(Client *client)
 	return 0;
 }
 
-/** Time out connections that are still in handshake.
+/* Instead of looking at every client each second, each local client
+ * is on the "ping wheel" in the slot of the second at which it needs
+ * to be looked at again (its ping_deadline): when it may need to be
+ * sent a PING, when it will ping timeout, or when its handshake times
+ * out. The wheel is hashed, deadlines more than PING_WHEEL_SIZE seconds
+ * away simply stay in their slot for another round.
+ * The deadline is not moved each time a client sends something, instead
+ * it is recalculated from 'lasttime' once it expires.
  */
-EVENT(handshake_timeout)
+#define PING_WHEEL_SIZE		1024	/* Must be a power of 2 */
+#define PING_WHEEL_MASK		(PING_WHEEL_SIZE - 1)
+
+static struct list_head ping_wheel[PING_WHEEL_SIZE];
+static time_t ping_wheel_time = 0;	/**< Last second that has been processed */
+
+static void ping_wheel_init(void)
 {
-	Client *client, *next;
+	int i;
 
-	list_for_each_entry_safe(client, next, &unknown_list, lclient_node)
+	if (ping_wheel_time)
+		return;
+	for (i = 0; i < PING_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&ping_wheel[i]);
+	ping_wheel_time = TStime();
+}
+
+/** Schedule the next check_ping() or handshake timeout check for a local client.
+ * @param client	The client
+ * @param when		The time at which the client should be looked at
+ */
+void schedule_ping_check(Client *client, time_t when)
+{
+	ping_wheel_init();
+	if (when <= ping_wheel_time)
+		when = ping_wheel_time + 1;
+	client->local->ping_deadline = when;
+	list_del(&client->ping_node);
+	list_add_tail(&client->ping_node, &ping_wheel[when & PING_WHEEL_MASK]);
+}
+
+/** Calculate when the client needs to be looked at next.
+ * This mirrors the conditions in check_ping() and handshake_timeout().
+ */
+static time_t ping_next_check(Client *client)
+{
+	int ping;
+	time_t t;
+
+	if (!IsRegistered(client))
+		return (client->local->firsttime ? client->local->firsttime : TStime()) + iConf.handshake_timeout + 1;
+
+	ping = client->local->class ? client->local->class->pingfreq : iConf.handshake_timeout;
+	t = client->local->lasttime + ping;
+	if (t > TStime())
+		return t; /* time to send a PING */
+
+	if (IsPingSent(client))
 	{
-		if (client->local->firsttime && ((TStime() - client->local->firsttime) > iConf.handshake_timeout))
-		{
-			if (client->serv && *client->serv->by)
-			{
-				/* If this is a handshake timeout to an outgoing server then notify ops & log it */
-				sendto_ops_and_log("Connection handshake timeout while trying to link to server '%s' (%s)",
-					client->name, client->ip?client->ip:"<unknown ip>");
-			}
+		t = client->local->lasttime + 2 * ping; /* ping timeout */
+		if (!IsPingWarning(client) && PINGWARNING > 0 && !IsUser(client))
+			t = MIN(t, client->local->lasttime + ping + PINGWARNING);
+		if (t > TStime())
+			return t;
+	}
 
-			exit_client(client, NULL, "Registration Timeout");
-			continue;
+	return TStime() + 1;
+}
+
+/** Recalculate the ping deadline of all local clients, eg: after a
+ * REHASH which may have changed class::pingfreq.
+ */
+void reschedule_ping_checks(void)
+{
+	Client *client;
+
+	list_for_each_entry(client, &lclient_list, lclient_node)
+		schedule_ping_check(client, ping_next_check(client));
+	list_for_each_entry(client, &unknown_list, lclient_node)
+		schedule_ping_check(client, ping_next_check(client));
+}
+
+/** Time out a connection that is still in handshake. */
+static void handshake_timeout(Client *client)
+{
+	if (client->local->firsttime && ((TStime() - client->local->firsttime) > iConf.handshake_timeout))
+	{
+		if (client->serv && *client->serv->by)
+		{
+			/* If this is a handshake timeout to an outgoing server then notify ops & log it */
+			sendto_ops_and_log("Connection handshake timeout while trying to link to server '%s' (%s)",
+				client->name, client->ip?client->ip:"<unknown ip>");
 		}
+
+		exit_client(client, NULL, "Registration Timeout");
 	}
 }
 
@@ -474,23 +547,57 @@ void check_ping(Client *client)
 EVENT(check_pings)
 {
 	Client *client, *next;
+	LIST_HEAD(work);
+	time_t now = TStime();
+	time_t t;
 
-	list_for_each_entry_safe(client, next, &lclient_list, lclient_node)
+	/* Check TKLs for all users, eg: after a new *LINE was added */
+	if (loop.do_bancheck)
 	{
-		/* Check TKLs for this user */
-		if (loop.do_bancheck && match_tkls(client))
-			continue;
-		check_ping(client);
-		/* don't touch 'client' after this as it may have been killed */
+		list_for_each_entry_safe(client, next, &lclient_list, lclient_node)
+			match_tkls(client);
 	}
+	loop.do_bancheck = loop.do_bancheck_spamf_user = loop.do_bancheck_spamf_away = 0;
 
-	list_for_each_entry_safe(client, next, &server_list, special_node)
+	ping_wheel_init();
+
+	if (now < ping_wheel_time)
+		ping_wheel_time = now; /* clock went backwards, see also fix_timers() */
+
+	/* Move the clients of all expired slots to the work list.
+	 * If we are behind by more than a round we only need to do every slot once.
+	 */
+	t = ping_wheel_time + 1;
+	if (now - ping_wheel_time > PING_WHEEL_SIZE)
+		t = now - PING_WHEEL_SIZE + 1;
+	for (; t <= now; t++)
+		list_splice_tail_init(&ping_wheel[t & PING_WHEEL_MASK], &work);
+	ping_wheel_time = now;
+
+	while (!list_empty(&work))
 	{
-		check_ping(client);
-	}
+		client = list_first_entry(&work, Client, ping_node);
+		list_del_init(&client->ping_node);
 
-	loop.do_bancheck = loop.do_bancheck_spamf_user = loop.do_bancheck_spamf_away = 0;
-	/* done */
+		if (IsDead(client))
+			continue;
+
+		if (client->local->ping_deadline > now)
+		{
+			/* Not in this round of the wheel */
+			list_add_tail(&client->ping_node, &ping_wheel[client->local->ping_deadline & PING_WHEEL_MASK]);
+			continue;
+		}
+
+		if (IsRegistered(client))
+			check_ping(client);
+		else
+			handshake_timeout(client);
+
+		/* The client may have been killed */
+		if (!IsDead(client))
+			schedule_ping_check(client, ping_next_check(client));
+	}
 }
 
 EVENT(check_deadsockets)
@@ -671,8 +778,6 @@ static void do_version_check()
 
 extern void applymeblock(void);
 
-extern MODVAR Event *events;
-
 /** This functions resets a couple of timers and does other things that
  * are absolutely cruicial when the clock is adjusted - particularly
  * when the clock goes backwards. -- Syzop
@@ -681,10 +786,16 @@ void fix_timers(void)
 {
 	int i, cnt;
 	Client *client;
-	Event *e;
 	struct ThrottlingBucket *thr;
 	ConfigItem_link *lnk;
 
+	/* All local clients are put back on the ping wheel below, relative
+	 * to the current time. The wheel must be at the current time too,
+	 * otherwise schedule_ping_check() pushes them beyond the old time.
+	 */
+	ping_wheel_init();
+	ping_wheel_time = TStime();
+
 	list_for_each_entry(client, &lclient_list, lclient_node)
 	{
 		if (client->local->since > TStime())
@@ -693,6 +804,13 @@ void fix_timers(void)
 				client->name, client->local->since, TStime()));
 			client->local->since = TStime();
 		}
+		if (client->local->input_wake > TStime())
+		{
+			Debug((DEBUG_DEBUG, "fix_timers(): %s: client->local->input_wake %ld -> %ld",
+				client->name, client->local->input_wake, TStime()));
+			client->local->input_wake = TStime();
+		}
+		schedule_ping_check(client, TStime() + 1);
 		if (client->local->lasttime > TStime())
 		{
 			Debug((DEBUG_DEBUG, "fix_timers(): %s: client->local->lasttime %ld -> %ld",
@@ -725,16 +843,28 @@ void fix_timers(void)
 		}
 	}
 
-	/* Reset all event timers */
-	for (e = events; e; e = e->next)
+	/* Connections that are still in the handshake */
+	list_for_each_entry(client, &unknown_list, lclient_node)
 	{
-		if (e->last_run.tv_sec > TStime())
+		if (client->local->firsttime > TStime())
 		{
-			e->last_run.tv_sec = TStime()-1;
-			e->last_run.tv_usec = 0;
+			Debug((DEBUG_DEBUG, "fix_timers(): %s: client->local->firsttime %ld -> %ld",
+				client->name, client->local->firsttime, TStime()));
+			client->local->firsttime = TStime();
 		}
+		if (client->local->since > TStime())
+			client->local->since = TStime();
+		if (client->local->input_wake > TStime())
+			client->local->input_wake = TStime();
+		if (client->local->lasttime > TStime())
+			client->local->lasttime = TStime();
+		schedule_ping_check(client, TStime() + 1);
 	}
 
+	/* Event timers need no fixing: the event scheduler ignores
+	 * the clock going backwards (see event_wheel_now()).
+	 */
+
 	/* For throttling we only have to deal with time jumping backward, which
 	 * is a real problem as if the jump was, say, 900 seconds, then it would
 	 * (potentially) throttle for 900 seconds.
@@ -1155,8 +1285,7 @@ int InitUnrealIRCd(int argc, char *argv[])
 		      exit(0);
 #endif
 		  case '8':
-		      utf8_test();
-		      exit(0);
+		      exit(utf8_test() ? 1 : 0);
 		  case 'L':
 		      loop.boot_function = link_generator;
 		      break;
@@ -1379,26 +1508,105 @@ int InitUnrealIRCd(int argc, char *argv[])
 	return 1;
 }
 
+/** Main loop statistics (STATS R) */
+LoopStats loopstats;
+
+/** The slowest event or command in the current main loop iteration */
+static uint64_t loop_slowest_ns;
+static char loop_slowest[128];
+
+/** Reset the main loop statistics */
+void reset_loop_stats(void)
+{
+	memset(&loopstats, 0, sizeof(loopstats));
+	loopstats.since = profile_time_ns();
+}
+
+/** Tell the main loop that 'what' (eg: "event" or "command") with
+ * the name 'name' took 'ns' nanoseconds. The slowest one of an
+ * iteration is named in the log if the iteration stalls.
+ */
+void loop_blame(char *what, char *name, uint64_t ns)
+{
+	if (ns > loop_slowest_ns)
+	{
+		loop_slowest_ns = ns;
+		snprintf(loop_slowest, sizeof(loop_slowest), "%s %s", what, name);
+	}
+}
+
+/** Add the time since *t to 'p', set *t to the current time and return the time. */
+static uint64_t loop_phase(ProfileStats *p, uint64_t *t)
+{
+	uint64_t now = profile_time_ns();
+	uint64_t ns = now - *t;
+
+	profile_add(p, ns);
+	*t = now;
+	return ns;
+}
+
+#define NS_TO_MS(x)	((long long)((x) / 1000000))
+
+/** Called when a main loop iteration took longer than set::main-loop-stall-threshold.
+ * Reported at most once every 5 seconds, so an overloaded server
+ * does not flood the log.
+ */
+static void loop_stall(uint64_t busy_ns, uint64_t events_ns, uint64_t flush_ns, uint64_t io_ns,
+                       uint64_t process_clients_ns, uint64_t rehash_ns, int ready)
+{
+	static time_t last_report = 0;
+	static unsigned long suppressed = 0;
+
+	loopstats.stalls++;
+	if (timeofday - last_report < 5)
+	{
+		suppressed++;
+		return;
+	}
+	last_report = timeofday;
+
+	sendto_realops_and_log("Main loop stall: iteration took %lld ms "
+	                       "(events %lld ms, flush %lld ms, I/O %lld ms with %d ready fds, "
+	                       "process_clients %lld ms, rehash %lld ms). "
+	                       "Slowest: %s (%lld ms). %lu more stall(s) since the last report.",
+	                       NS_TO_MS(busy_ns), NS_TO_MS(events_ns), NS_TO_MS(flush_ns), NS_TO_MS(io_ns), ready,
+	                       NS_TO_MS(process_clients_ns), NS_TO_MS(rehash_ns),
+	                       loop_slowest_ns ? loop_slowest : "unknown", NS_TO_MS(loop_slowest_ns),
+	                       suppressed);
+	suppressed = 0;
+}
+
 /** The main loop that the server will run all the time.
  * On Windows this is a thread, on *NIX we simply jump here from main()
  * when the server is ready.
  */
 void SocketLoop(void *dummy)
 {
-	struct timeval doevents_tv, process_clients_tv;
+	struct timeval process_clients_tv;
+	long delay;
+	uint64_t start, t, wait_ns, busy_ns;
+	uint64_t events_ns, flush_ns, io_ns, process_clients_ns, rehash_ns;
+	int ready, bucket;
 
-	memset(&doevents_tv, 0, sizeof(doevents_tv));
 	memset(&process_clients_tv, 0, sizeof(process_clients_tv));
+	reset_loop_stats();
 
 	while (1)
 	{
 		gettimeofday(&timeofday_tv, NULL);
 		timeofday = timeofday_tv.tv_sec;
 
+		start = t = profile_time_ns();
+		loop_slowest_ns = 0;
+		process_clients_ns = rehash_ns = 0;
+
 		detect_timeshift_and_warn();
 
-		if (minimum_msec_since_last_run(&doevents_tv, 250))
-			DoEvents();
+		free_retired_hook_arrays();
+
+		DoEvents();
+		events_ns = loop_phase(&loopstats.events, &t);
 
 		/* Update statistics */
 		if (irccounts.clients > irccounts.global_max)
@@ -1406,11 +1614,29 @@ void SocketLoop(void *dummy)
 		if (irccounts.me_clients > irccounts.me_max)
 			irccounts.me_max = irccounts.me_clients;
 
-		/* Process I/O */
-		fd_select(SOCKETLOOP_MAX_DELAY);
+		/* Write out everything that was queued since the last round */
+		flush_marked_clients();
+		flush_ns = loop_phase(&loopstats.flush, &t);
+
+		/* Process I/O, but wake up in time for the next event */
+		delay = EventNextDelay();
+		if (delay > SOCKETLOOP_MAX_DELAY)
+			delay = SOCKETLOOP_MAX_DELAY;
+		ready = fd_select(delay);
+
+		/* The time spent waiting for I/O is not counted */
+		wait_ns = (fd_select_woke > t) ? fd_select_woke - t : 0;
+		t += wait_ns;
+
+		/* Start TLS handshakes that had to wait for set::max-concurrent-handshakes */
+		handshake_admit();
+		io_ns = loop_phase(&loopstats.io, &t);
 
 		if (minimum_msec_since_last_run(&process_clients_tv, 200))
+		{
 			process_clients();
+			process_clients_ns = loop_phase(&loopstats.process_clients, &t);
+		}
 
 		/* Check if there are pending "actions".
 		 * These are actions that should be done outside of
@@ -1421,6 +1647,7 @@ void SocketLoop(void *dummy)
 		{
 			(void)rehash(&me, 1);
 			dorehash = 0;
+			rehash_ns = loop_phase(&loopstats.rehash, &t);
 		}
 		if (dorestart)
 		{
@@ -1431,6 +1658,19 @@ void SocketLoop(void *dummy)
 			reinit_ssl(NULL);
 			doreloadcert = 0;
 		}
+
+		busy_ns = profile_time_ns() - start - wait_ns;
+		profile_add(&loopstats.iteration, busy_ns);
+		loopstats.busy_ns += busy_ns;
+		for (bucket = 0; (ready >> bucket) && (bucket < PROFILE_BUCKETS - 1); bucket++)
+			;
+		loopstats.ready_fds[bucket]++;
+
+		if (iConf.main_loop_stall_threshold &&
+		    (busy_ns >= (uint64_t)iConf.main_loop_stall_threshold * 1000000))
+		{
+			loop_stall(busy_ns, events_ns, flush_ns, io_ns, process_clients_ns, rehash_ns, ready);
+		}
 	}
 }
 
@@ -110,6 +110,10 @@ Client *make_client(Client *from, Client *servr)
 	INIT_LIST_HEAD(&client->client_node);
 	INIT_LIST_HEAD(&client->client_hash);
 	INIT_LIST_HEAD(&client->id_hash);
+	INIT_LIST_HEAD(&client->handshake_node);
+	INIT_LIST_HEAD(&client->input_node);
+	INIT_LIST_HEAD(&client->ping_node);
+	INIT_LIST_HEAD(&client->send_node);
 
 	strcpy(client->ident, "unknown");
 	if (!from)
@@ -154,6 +158,12 @@ void free_client(Client *client)
 			list_del(&client->lclient_node);
 		if (!list_empty(&client->special_node))
 			list_del(&client->special_node);
+		if (!list_empty(&client->input_node))
+			list_del(&client->input_node);
+		if (!list_empty(&client->ping_node))
+			list_del(&client->ping_node);
+		if (!list_empty(&client->send_node))
+			list_del(&client->send_node);
 
 		RunHook(HOOKTYPE_FREE_CLIENT, client);
 		if (client->local)
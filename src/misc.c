@@ -1408,6 +1408,25 @@ MessageTag *find_mtag(MessageTag *mtags, const char *token)
 	return NULL;
 }
 
+/** Forget the serialized forms of the message tag list 'm'
+ * (see mtags_to_string()). Do this when the list is changed.
+ */
+void free_mtags_strcache(MessageTag *m)
+{
+	MessageTagString *c, *c_next;
+
+	if (!m)
+		return;
+
+	for (c = m->strcache; c; c = c_next)
+	{
+		c_next = c->next;
+		safe_free(c->str);
+		safe_free(c);
+	}
+	m->strcache = NULL;
+}
+
 /** Free all message tags in the list 'm' */
 void free_message_tags(MessageTag *m)
 {
@@ -1416,6 +1435,7 @@ void free_message_tags(MessageTag *m)
 	for (; m; m = m_next)
 	{
 		m_next = m->next;
+		free_mtags_strcache(m);
 		safe_free(m->name);
 		safe_free(m->value);
 		safe_free(m);
@@ -1924,3 +1944,77 @@ char *sendtype_to_cmd(SendType sendtype)
 		return "TAGMSG";
 	return NULL;
 }
+
+/** Monotonic clock in nanoseconds, for measuring how long something took.
+ * This is cheap enough to call around every command: on Linux and
+ * the BSDs clock_gettime(CLOCK_MONOTONIC) does not enter the kernel.
+ */
+uint64_t profile_time_ns(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+#else
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((double)now.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+#endif
+}
+
+/** Record a call that took 'ns' nanoseconds in the timing statistics 'p' */
+void profile_add(ProfileStats *p, uint64_t ns)
+{
+	uint64_t usec = ns / 1000;
+	int bucket = 0;
+
+	while (usec && (bucket < PROFILE_BUCKETS - 1))
+	{
+		usec >>= 1;
+		bucket++;
+	}
+	p->calls++;
+	p->total_ns += ns;
+	if (ns > p->max_ns)
+		p->max_ns = ns;
+	p->histogram[bucket]++;
+}
+
+/** Send the timing statistics 'p' to 'client' as a RPL_STATSDEBUG line,
+ * with a list of the non-empty histogram buckets (by upper bound).
+ */
+void profile_report(Client *client, char *name, ProfileStats *p)
+{
+	char buf[512];
+	char *b = buf;
+	int i;
+
+	*buf = '\0';
+	for (i = 0; i < PROFILE_BUCKETS; i++)
+	{
+		if (!p->histogram[i])
+			continue;
+		if (i == PROFILE_BUCKETS - 1)
+			snprintf(b, sizeof(buf) - (b - buf), " >=%lus:%u", (1UL << (i - 1)) / 1000000, p->histogram[i]);
+		else if (i >= 20)
+			snprintf(b, sizeof(buf) - (b - buf), " <%lus:%u", (1UL << i) / 1000000, p->histogram[i]);
+		else if (i >= 10)
+			snprintf(b, sizeof(buf) - (b - buf), " <%lums:%u", (1UL << i) / 1000, p->histogram[i]);
+		else
+			snprintf(b, sizeof(buf) - (b - buf), " <%luus:%u", 1UL << i, p->histogram[i]);
+		b += strlen(b);
+	}
+
+	sendnumericfmt(client, RPL_STATSDEBUG,
+		"%s: calls %lu, total %llu.%03llums, avg %lluus, max %lluus, histogram%s",
+		name, p->calls,
+		(unsigned long long)(p->total_ns / 1000000), (unsigned long long)((p->total_ns / 1000) % 1000),
+		(unsigned long long)(p->calls ? p->total_ns / p->calls / 1000 : 0),
+		(unsigned long long)(p->max_ns / 1000),
+		buf);
+}
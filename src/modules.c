@@ -39,6 +39,7 @@
 #include "modversion.h"
 
 Hook	   	*Hooks[MAXHOOKTYPES];
+Hook		**HookArrays[MAXHOOKTYPES];	/* Same as Hooks[], as arrays, see for_each_hook() */
 Hooktype	Hooktypes[MAXCUSTOMHOOKS];
 Callback	*Callbacks[MAXCALLBACKS];	/* Callback objects for modules, used for rehashing etc (can be multiple) */
 Callback	*RCallbacks[MAXCALLBACKS];	/* 'Real' callback function, used for callback function calls */
@@ -987,6 +988,176 @@ void VersionflagDel(Versionflag *vflag, Module *module)
 	}
 }
 
+/** Old hook arrays, see rebuild_hook_array() */
+typedef struct RetiredHookArray RetiredHookArray;
+struct RetiredHookArray {
+	RetiredHookArray *prev, *next;
+	Hook **array;
+};
+static RetiredHookArray *retired_hook_arrays = NULL;
+
+/** Rebuild HookArrays[hooktype] from the (priority sorted) Hooks[hooktype] list.
+ * Hooks may be added or deleted while the old array is being walked,
+ * eg: a module that is unloaded from a REHASH, so the old array is not
+ * freed right away but by free_retired_hook_arrays() from the main loop.
+ */
+static void rebuild_hook_array(int hooktype)
+{
+	Hook *h, **array = NULL;
+	int count = 0;
+
+	for (h = Hooks[hooktype]; h; h = h->next)
+		count++;
+
+	if (count)
+	{
+		array = safe_alloc(sizeof(Hook *) * (count + 1));
+		count = 0;
+		for (h = Hooks[hooktype]; h; h = h->next)
+			array[count++] = h;
+	}
+
+	if (HookArrays[hooktype])
+	{
+		RetiredHookArray *r = safe_alloc(sizeof(RetiredHookArray));
+		r->array = HookArrays[hooktype];
+		AddListItem(r, retired_hook_arrays);
+	}
+	HookArrays[hooktype] = array;
+}
+
+/** Free hook arrays that were replaced by rebuild_hook_array().
+ * Called from the main loop, where no hooks are being run.
+ */
+void free_retired_hook_arrays(void)
+{
+	RetiredHookArray *r, *r_next;
+
+	for (r = retired_hook_arrays; r; r = r_next)
+	{
+		r_next = r->next;
+		safe_free(r->array);
+		safe_free(r);
+	}
+	retired_hook_arrays = NULL;
+}
+
+/** Return the name of a hook type, eg "local_connect" for HOOKTYPE_LOCAL_CONNECT,
+ * or NULL if it is unknown.
+ */
+char *hooktype_to_string(int hooktype)
+{
+	static char *names[MAXHOOKTYPES] = {
+		[HOOKTYPE_LOCAL_QUIT] = "local_quit",
+		[HOOKTYPE_LOCAL_NICKCHANGE] = "local_nickchange",
+		[HOOKTYPE_LOCAL_CONNECT] = "local_connect",
+		[HOOKTYPE_REHASHFLAG] = "rehashflag",
+		[HOOKTYPE_PRE_LOCAL_PART] = "pre_local_part",
+		[HOOKTYPE_CONFIGPOSTTEST] = "configposttest",
+		[HOOKTYPE_REHASH] = "rehash",
+		[HOOKTYPE_PRE_LOCAL_CONNECT] = "pre_local_connect",
+		[HOOKTYPE_PRE_LOCAL_QUIT] = "pre_local_quit",
+		[HOOKTYPE_SERVER_CONNECT] = "server_connect",
+		[HOOKTYPE_SERVER_QUIT] = "server_quit",
+		[HOOKTYPE_STATS] = "stats",
+		[HOOKTYPE_LOCAL_JOIN] = "local_join",
+		[HOOKTYPE_CONFIGTEST] = "configtest",
+		[HOOKTYPE_CONFIGRUN] = "configrun",
+		[HOOKTYPE_USERMSG] = "usermsg",
+		[HOOKTYPE_CHANMSG] = "chanmsg",
+		[HOOKTYPE_LOCAL_PART] = "local_part",
+		[HOOKTYPE_LOCAL_KICK] = "local_kick",
+		[HOOKTYPE_LOCAL_CHANMODE] = "local_chanmode",
+		[HOOKTYPE_LOCAL_TOPIC] = "local_topic",
+		[HOOKTYPE_LOCAL_OPER] = "local_oper",
+		[HOOKTYPE_UNKUSER_QUIT] = "unkuser_quit",
+		[HOOKTYPE_LOCAL_PASS] = "local_pass",
+		[HOOKTYPE_REMOTE_CONNECT] = "remote_connect",
+		[HOOKTYPE_REMOTE_QUIT] = "remote_quit",
+		[HOOKTYPE_PRE_LOCAL_JOIN] = "pre_local_join",
+		[HOOKTYPE_PRE_LOCAL_KICK] = "pre_local_kick",
+		[HOOKTYPE_PRE_LOCAL_TOPIC] = "pre_local_topic",
+		[HOOKTYPE_REMOTE_NICKCHANGE] = "remote_nickchange",
+		[HOOKTYPE_CHANNEL_CREATE] = "channel_create",
+		[HOOKTYPE_CHANNEL_DESTROY] = "channel_destroy",
+		[HOOKTYPE_REMOTE_CHANMODE] = "remote_chanmode",
+		[HOOKTYPE_TKL_EXCEPT] = "tkl_except",
+		[HOOKTYPE_UMODE_CHANGE] = "umode_change",
+		[HOOKTYPE_TOPIC] = "topic",
+		[HOOKTYPE_REHASH_COMPLETE] = "rehash_complete",
+		[HOOKTYPE_TKL_ADD] = "tkl_add",
+		[HOOKTYPE_TKL_DEL] = "tkl_del",
+		[HOOKTYPE_LOCAL_KILL] = "local_kill",
+		[HOOKTYPE_LOG] = "log",
+		[HOOKTYPE_REMOTE_JOIN] = "remote_join",
+		[HOOKTYPE_REMOTE_PART] = "remote_part",
+		[HOOKTYPE_REMOTE_KICK] = "remote_kick",
+		[HOOKTYPE_LOCAL_SPAMFILTER] = "local_spamfilter",
+		[HOOKTYPE_SILENCED] = "silenced",
+		[HOOKTYPE_POST_SERVER_CONNECT] = "post_server_connect",
+		[HOOKTYPE_RAWPACKET_IN] = "rawpacket_in",
+		[HOOKTYPE_PACKET] = "packet",
+		[HOOKTYPE_HANDSHAKE] = "handshake",
+		[HOOKTYPE_AWAY] = "away",
+		[HOOKTYPE_INVITE] = "invite",
+		[HOOKTYPE_CAN_JOIN] = "can_join",
+		[HOOKTYPE_CAN_SEND_TO_CHANNEL] = "can_send_to_channel",
+		[HOOKTYPE_CAN_KICK] = "can_kick",
+		[HOOKTYPE_FREE_CLIENT] = "free_client",
+		[HOOKTYPE_FREE_USER] = "free_user",
+		[HOOKTYPE_PRE_CHANMSG] = "pre_chanmsg",
+		[HOOKTYPE_KNOCK] = "knock",
+		[HOOKTYPE_MODECHAR_ADD] = "modechar_add",
+		[HOOKTYPE_MODECHAR_DEL] = "modechar_del",
+		[HOOKTYPE_CAN_JOIN_LIMITEXCEEDED] = "can_join_limitexceeded",
+		[HOOKTYPE_VISIBLE_IN_CHANNEL] = "visible_in_channel",
+		[HOOKTYPE_PRE_LOCAL_CHANMODE] = "pre_local_chanmode",
+		[HOOKTYPE_PRE_REMOTE_CHANMODE] = "pre_remote_chanmode",
+		[HOOKTYPE_JOIN_DATA] = "join_data",
+		[HOOKTYPE_PRE_KNOCK] = "pre_knock",
+		[HOOKTYPE_PRE_INVITE] = "pre_invite",
+		[HOOKTYPE_OPER_INVITE_BAN] = "oper_invite_ban",
+		[HOOKTYPE_VIEW_TOPIC_OUTSIDE_CHANNEL] = "view_topic_outside_channel",
+		[HOOKTYPE_CHAN_PERMIT_NICK_CHANGE] = "chan_permit_nick_change",
+		[HOOKTYPE_IS_CHANNEL_SECURE] = "is_channel_secure",
+		[HOOKTYPE_SEND_CHANNEL] = "send_channel",
+		[HOOKTYPE_CHANNEL_SYNCED] = "channel_synced",
+		[HOOKTYPE_CAN_SAJOIN] = "can_sajoin",
+		[HOOKTYPE_WHOIS] = "whois",
+		[HOOKTYPE_CHECK_INIT] = "check_init",
+		[HOOKTYPE_WHO_STATUS] = "who_status",
+		[HOOKTYPE_MODE_DEOP] = "mode_deop",
+		[HOOKTYPE_PRE_KILL] = "pre_kill",
+		[HOOKTYPE_SEE_CHANNEL_IN_WHOIS] = "see_channel_in_whois",
+		[HOOKTYPE_DCC_DENIED] = "dcc_denied",
+		[HOOKTYPE_SERVER_HANDSHAKE_OUT] = "server_handshake_out",
+		[HOOKTYPE_SERVER_SYNCED] = "server_synced",
+		[HOOKTYPE_SECURE_CONNECT] = "secure_connect",
+		[HOOKTYPE_CAN_BYPASS_CHANNEL_MESSAGE_RESTRICTION] = "can_bypass_channel_message_restriction",
+		[HOOKTYPE_REQUIRE_SASL] = "require_sasl",
+		[HOOKTYPE_SASL_CONTINUATION] = "sasl_continuation",
+		[HOOKTYPE_SASL_RESULT] = "sasl_result",
+		[HOOKTYPE_PLACE_HOST_BAN] = "place_host_ban",
+		[HOOKTYPE_FIND_TKLINE_MATCH] = "find_tkline_match",
+		[HOOKTYPE_WELCOME] = "welcome",
+		[HOOKTYPE_PRE_COMMAND] = "pre_command",
+		[HOOKTYPE_POST_COMMAND] = "post_command",
+		[HOOKTYPE_NEW_MESSAGE] = "new_message",
+		[HOOKTYPE_IS_HANDSHAKE_FINISHED] = "is_handshake_finished",
+		[HOOKTYPE_PRE_LOCAL_QUIT_CHAN] = "pre_local_quit_chan",
+		[HOOKTYPE_IDENT_LOOKUP] = "ident_lookup",
+		[HOOKTYPE_CONFIGRUN_EX] = "configrun_ex",
+		[HOOKTYPE_CAN_SEND_TO_USER] = "can_send_to_user",
+		[HOOKTYPE_SERVER_SYNC] = "server_sync",
+		[HOOKTYPE_ACCOUNT_LOGIN] = "account_login",
+		[HOOKTYPE_CLOSE_CONNECTION] = "close_connection",
+	};
+
+	if ((hooktype < 0) || (hooktype >= MAXHOOKTYPES))
+		return NULL;
+	return names[hooktype];
+}
+
 Hook *HookAddMain(Module *module, int hooktype, int priority, int (*func)(), void (*vfunc)(), char *(*cfunc)())
 {
 	Hook *p;
@@ -1011,6 +1182,7 @@ Hook *HookAddMain(Module *module, int hooktype, int priority, int (*func)(), voi
 	}
 	
 	AddListItemPrio(p, Hooks[hooktype], p->priority);
+	rebuild_hook_array(hooktype);
 
 	return p;
 }
@@ -1022,6 +1194,7 @@ Hook *HookDel(Hook *hook)
 		if (p == hook) {
 			q = p->next;
 			DelListItem(p, Hooks[hook->type]);
+			rebuild_hook_array(hook->type);
 			if (p->owner) {
 				ModuleObject *hookobj;
 				for (hookobj = p->owner->objects; hookobj; hookobj = hookobj->next) {
@@ -90,7 +90,7 @@ CMD_FUNC(cmd_batch)
 	/* If the recipient does not support message tags or
 	 * does not support batch, then don't do anything.
 	 */
-	if (MyConnect(target) && !IsServer(target) && !HasCapability(target, "batch"))
+	if (MyConnect(target) && !IsServer(target) && !HasCapabilityFast(target, CAP_BATCH))
 		return;
 
 	if (MyUser(target))
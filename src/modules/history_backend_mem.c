@@ -281,9 +281,12 @@ void hbm_send_line(Client *client, HistoryLogLine *l, char *batchid)
 			MessageTag *m = safe_alloc(sizeof(MessageTag));
 			m->name = "batch";
 			m->value = batchid;
+			/* The serialized tags are cached on the head of the list */
+			free_mtags_strcache(l->mtags);
 			AddListItem(m, l->mtags);
 			sendto_one(client, l->mtags, "%s", l->line);
 			DelListItem(m, l->mtags);
+			free_mtags_strcache(m);
 			safe_free(m);
 		}
 	} else {
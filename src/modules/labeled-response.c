@@ -52,12 +52,13 @@ void _labeled_response_set_context(void *ctx);
 void _labeled_response_force_end(void);
 
 /* Our special version of SupportBatch() assumes that remote servers always handle it */
-#define SupportBatch(x)		(MyConnect(x) ? HasCapability((x), "batch") : 1)
+#define SupportBatch(x)		(MyConnect(x) ? HasCapabilityFast((x), CAP_BATCH) : 1)
 #define SupportLabel(x)		(HasCapabilityFast((x), CAP_LABELED_RESPONSE))
 
 /* Variables */
 static LabeledResponseContext currentcmd;
 static long CAP_LABELED_RESPONSE = 0L;
+static long CAP_BATCH = 0L;
 
 static char packet[8192];
 
@@ -103,6 +104,8 @@ MOD_INIT()
 
 MOD_LOAD()
 {
+	CAP_BATCH = ClientCapabilityBit("batch");
+
 	return MOD_SUCCESS;
 }
 
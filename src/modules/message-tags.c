@@ -209,20 +209,15 @@ void _parse_message_tags(Client *client, char **str, MessageTag **mtag_list)
 	*str = remainder + 1;
 }
 
-/** Outgoing filter for tags */
-int client_accepts_tag(const char *token, Client *client)
-{
-	MessageTagHandler *m;
-
-	/* Send all tags to remote links, without checking here.
-	 * Note that mtags_to_string() already prevents sending messages
-	 * with message tags to links without PROTOCTL MTAGS, so we can
-	 * simply always return 1 here, regardless of checking (again).
-	 */
-	if (IsServer(client) || !MyConnect(client))
-		return 1;
+/** Maximum number of serialized versions of one tag list that we cache */
+#define MTAGS_CACHE_MAX		8
 
-	m = MessageTagHandlerFind(token);
+/** Outgoing filter for tags.
+ * @param m		The message tag handler of the tag (can be NULL)
+ * @param client	The local client that the tag would be sent to
+ */
+static int client_accepts_tag(MessageTagHandler *m, Client *client)
+{
 	if (!m)
 		return 0;
 
@@ -233,7 +228,7 @@ int client_accepts_tag(const char *token, Client *client)
 	/* If the client has indicated 'message-tags' support then we can
 	 * send any message tag, regardless of other CAP's.
 	 */
-	if (HasCapability(client, "message-tags"))
+	if (HasCapabilityFast(client, CAP_MESSAGE_TAGS))
 		return 1;
 
 	/* We continue here if the client did not indicate 'message-tags' support... */
@@ -255,12 +250,21 @@ int client_accepts_tag(const char *token, Client *client)
 
 /** Return the message tag string (without @) of the message tag linked list.
  * Taking into account the restrictions that 'client' may have.
- * @returns A string (static buffer) or NULL if no tags at all (!)
+ * The same message is usually sent to many clients, eg: to a channel.
+ * Which tags a client gets only depends on a few of its capabilities,
+ * so the result is cached in the list (in the first item) and clients
+ * with the same relevant capabilities get the same string.
+ * @returns A string or NULL if no tags at all (!)
  */
 char *_mtags_to_string(MessageTag *m, Client *client)
 {
 	static char buf[4096], name[8192], value[8192];
 	char tbuf[512];
+	MessageTag *head = m;
+	MessageTagString *c;
+	MessageTagHandler *h;
+	int all, cacheable = 1, cached = 0;
+	long mask = 0;
 
 	if (!m)
 		return NULL;
@@ -269,11 +273,36 @@ char *_mtags_to_string(MessageTag *m, Client *client)
 	if (client->direction && IsServer(client->direction) && !SupportMTAGS(client->direction))
 		return NULL;
 
+	/* Send all tags to remote links, without checking here.
+	 * Note that we already prevented sending messages with
+	 * message tags to links without PROTOCTL MTAGS above.
+	 */
+	all = IsServer(client) || !MyConnect(client);
+
+	for (c = head->strcache; c; c = c->next)
+	{
+		if (all ? c->all : (!c->all && ((client->local->caps & c->mask) == c->caps)))
+			return c->str;
+		cached++;
+	}
+
 	*buf = '\0';
 	for (; m; m = m->next)
 	{
-		if (!client_accepts_tag(m->name, client))
-			continue;
+		if (!all)
+		{
+			h = MessageTagHandlerFind(m->name);
+			if (h)
+			{
+				mask |= CAP_MESSAGE_TAGS;
+				if (h->clicap_handler)
+					mask |= h->clicap_handler->cap;
+				if (h->can_send)
+					cacheable = 0; /* depends on more than the capabilities */
+			}
+			if (!client_accepts_tag(h, client))
+				continue;
+		}
 		if (m->value)
 		{
 			message_tag_escape(m->name, name);
@@ -286,11 +315,24 @@ char *_mtags_to_string(MessageTag *m, Client *client)
 		strlcat(buf, tbuf, sizeof(buf));
 	}
 
-	if (!*buf)
-		return NULL;
-
 	/* Strip off the final semicolon */
-	buf[strlen(buf)-1] = '\0';
+	if (*buf)
+		buf[strlen(buf)-1] = '\0';
+
+	if (!cacheable || (cached >= MTAGS_CACHE_MAX))
+		return *buf ? buf : NULL;
+
+	c = safe_alloc(sizeof(MessageTagString));
+	c->all = all;
+	if (!all)
+	{
+		c->mask = mask;
+		c->caps = client->local->caps & mask;
+	}
+	if (*buf)
+		safe_strdup(c->str, buf);
+	c->next = head->strcache;
+	head->strcache = c;
 
-	return buf;
+	return c->str;
 }
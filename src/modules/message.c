@@ -88,7 +88,7 @@ MOD_UNLOAD()
 int can_send_to_user(Client *client, Client *target, char **msgtext, char **errmsg, SendType sendtype)
 {
 	int ret;
-	Hook *h;
+	Hook *h, **hp;
 	int n;
 	static char errbuf[256];
 
@@ -121,9 +121,9 @@ int can_send_to_user(Client *client, Client *target, char **msgtext, char **errm
 		return 0;
 
 	n = HOOK_CONTINUE;
-	for (h = Hooks[HOOKTYPE_CAN_SEND_TO_USER]; h; h = h->next)
+	for_each_hook(HOOKTYPE_CAN_SEND_TO_USER, h, hp)
 	{
-		n = (*(h->func.intfunc))(client, target, msgtext, errmsg, sendtype);
+		ProfileHook(h, n = (*(h->func.intfunc))(client, target, msgtext, errmsg, sendtype));
 		if (n == HOOK_DENY)
 		{
 			if (!*errmsg)
@@ -488,7 +488,7 @@ void cmd_message(Client *client, MessageTag *recv_mtags, int parc, char *parv[],
 					/* Deliver to end-user */
 					if (sendtype == SEND_TYPE_TAGMSG)
 					{
-						if (HasCapability(target, "message-tags"))
+						if (HasCapabilityFast(target, CAP_MESSAGE_TAGS))
 						{
 							sendto_prefix_one(target, client, mtags, ":%s %s %s",
 									  client->name, cmd, target->name);
@@ -773,7 +773,7 @@ int _can_send_to_channel(Client *client, Channel *channel, char **msgtext, char
 {
 	Membership *lp;
 	int  member, i = 0;
-	Hook *h;
+	Hook *h, **hp;
 
 	if (!MyUser(client))
 		return 1;
@@ -787,9 +787,9 @@ int _can_send_to_channel(Client *client, Channel *channel, char **msgtext, char
 		/* Channel does not accept external messages (+n).
 		 * Reject, unless HOOKTYPE_CAN_BYPASS_NO_EXTERNAL_MSGS tells otherwise.
 		 */
-		for (h = Hooks[HOOKTYPE_CAN_BYPASS_CHANNEL_MESSAGE_RESTRICTION]; h; h = h->next)
+		for_each_hook(HOOKTYPE_CAN_BYPASS_CHANNEL_MESSAGE_RESTRICTION, h, hp)
 		{
-			i = (*(h->func.intfunc))(client, channel, BYPASS_CHANMSG_EXTERNAL);
+			ProfileHook(h, i = (*(h->func.intfunc))(client, channel, BYPASS_CHANMSG_EXTERNAL));
 			if (i != HOOK_CONTINUE)
 				break;
 		}
@@ -809,9 +809,9 @@ int _can_send_to_channel(Client *client, Channel *channel, char **msgtext, char
 		/* Channel is moderated (+m).
 		 * Reject, unless HOOKTYPE_CAN_BYPASS_MODERATED tells otherwise.
 		 */
-		for (h = Hooks[HOOKTYPE_CAN_BYPASS_CHANNEL_MESSAGE_RESTRICTION]; h; h = h->next)
+		for_each_hook(HOOKTYPE_CAN_BYPASS_CHANNEL_MESSAGE_RESTRICTION, h, hp)
 		{
-			i = (*(h->func.intfunc))(client, channel, BYPASS_CHANMSG_MODERATED);
+			ProfileHook(h, i = (*(h->func.intfunc))(client, channel, BYPASS_CHANMSG_MODERATED));
 			if (i != HOOK_CONTINUE)
 				break;
 		}
@@ -823,9 +823,9 @@ int _can_send_to_channel(Client *client, Channel *channel, char **msgtext, char
 	}
 
 	/* Modules can plug in as well */
-	for (h = Hooks[HOOKTYPE_CAN_SEND_TO_CHANNEL]; h; h = h->next)
+	for_each_hook(HOOKTYPE_CAN_SEND_TO_CHANNEL, h, hp)
 	{
-		i = (*(h->func.intfunc))(client, channel, lp, msgtext, errmsg, sendtype);
+		ProfileHook(h, i = (*(h->func.intfunc))(client, channel, lp, msgtext, errmsg, sendtype));
 		if (i != HOOK_CONTINUE)
 		{
 			if (!*errmsg)
@@ -86,6 +86,10 @@ int stats_class(Client *, char *);
 int stats_officialchannels(Client *, char *);
 int stats_spamfilter(Client *, char *);
 int stats_fdtable(Client *, char *);
+int stats_tlsworkers(Client *, char *);
+int stats_cmdprofile(Client *, char *);
+int stats_hookprofile(Client *, char *);
+int stats_loop(Client *, char *);
 
 #define SERVER_AS_PARA 0x1
 #define FLAGS_AS_PARA 0x2
@@ -100,9 +104,11 @@ struct statstab {
 /* Must be listed lexicographically */
 /* Long flags must be lowercase */
 struct statstab StatsTable[] = {
+	{ 'A', "hookprofile",	stats_hookprofile,	FLAGS_AS_PARA	},
 	{ 'B', "banversion",	stats_banversion,	0		},
 	{ 'C', "link", 		stats_links,		0 		},
 	{ 'D', "denylinkall",	stats_denylinkall,	0		},
+	{ 'E', "tlsworkers",	stats_tlsworkers,	0		},
 	{ 'G', "gline",		stats_gline,		FLAGS_AS_PARA	},
 	{ 'H', "link",	 	stats_links,		0 		},
 	{ 'I', "allow",		stats_allow,		0 		},
@@ -112,6 +118,7 @@ struct statstab StatsTable[] = {
 	{ 'O', "oper",		stats_oper,		0 		},
 	{ 'P', "port",		stats_port,		0 		},
 	{ 'Q', "sqline",	stats_sqline,		FLAGS_AS_PARA 	},
+	{ 'R', "loop",		stats_loop,		FLAGS_AS_PARA	},
 	{ 'S', "set",		stats_set,		0		},
 	{ 'T', "traffic",	stats_traffic,		0 		},
 	{ 'U', "uline",		stats_uline,		0 		},
@@ -131,6 +138,7 @@ struct statstab StatsTable[] = {
 	{ 'm', "command",	stats_command,		0 		},
 	{ 'n', "banrealname",	stats_banrealname,	0 		},
 	{ 'o', "oper",		stats_oper,		0 		},
+	{ 'p', "cmdprofile",	stats_cmdprofile,	FLAGS_AS_PARA	},
 	{ 'q', "bannick",	stats_bannick,		FLAGS_AS_PARA	},
 	{ 'r', "chanrestrict",	stats_chanrestrict,	0 		},
 	{ 's', "shun",		stats_shun,		FLAGS_AS_PARA	},
@@ -189,12 +197,14 @@ static inline char *stats_combine_parv(char *p1, char *p2)
 static inline void stats_help(Client *client)
 {
 	sendnumeric(client, RPL_STATSHELP, "/Stats flags:");
+	sendnumeric(client, RPL_STATSHELP, "A - hookprofile - Send time spent per hook and module (use -reset to clear)");
 	sendnumeric(client, RPL_STATSHELP, "B - banversion - Send the ban version list");
 	sendnumeric(client, RPL_STATSHELP, "b - badword - Send the badwords list");
 	sendnumeric(client, RPL_STATSHELP, "C - link - Send the link block list");
 	sendnumeric(client, RPL_STATSHELP, "d - denylinkauto - Send the deny link (auto) block list");
 	sendnumeric(client, RPL_STATSHELP, "D - denylinkall - Send the deny link (all) block list");
 	sendnumeric(client, RPL_STATSHELP, "e - except - Send the ban exception list (ELINEs and in config))");
+	sendnumeric(client, RPL_STATSHELP, "E - tlsworkers - Send CPU usage and queue depth of the TLS worker threads");
 	sendnumeric(client, RPL_STATSHELP, "f - spamfilter - Send the spamfilter list");
 	sendnumeric(client, RPL_STATSHELP, "F - denydcc - Send the deny dcc and allow dcc block lists");
 	sendnumeric(client, RPL_STATSHELP, "G - gline - Send the gline and gzline list");
@@ -210,10 +220,12 @@ static inline void stats_help(Client *client)
 	sendnumeric(client, RPL_STATSHELP, "M - command - Send list of how many times each command was used");
 	sendnumeric(client, RPL_STATSHELP, "n - banrealname - Send the ban realname block list");
 	sendnumeric(client, RPL_STATSHELP, "O - oper - Send the oper block list");
+	sendnumeric(client, RPL_STATSHELP, "p - cmdprofile - Send time spent per command (use -reset to clear)");
 	sendnumeric(client, RPL_STATSHELP, "P - port - Send information about ports");
 	sendnumeric(client, RPL_STATSHELP, "q - bannick - Send the ban nick block list");
 	sendnumeric(client, RPL_STATSHELP, "Q - sqline - Send the global qline list");
 	sendnumeric(client, RPL_STATSHELP, "r - chanrestrict - Send the channel deny/allow block list");
+	sendnumeric(client, RPL_STATSHELP, "R - loop - Send main loop timing and load (use -reset to clear)");
 	sendnumeric(client, RPL_STATSHELP, "S - set - Send the set block list");
 	sendnumeric(client, RPL_STATSHELP, "s - shun - Send the shun list");
 	sendnumeric(client, RPL_STATSHELP, "  Extended flags: [+/-mrs] [mask] [reason] [setby]");
@@ -630,6 +642,17 @@ int stats_traffic(Client *client, char *para)
 	sendnumericfmt(client, RPL_STATSDEBUG, "numerics seen %u mode fakes %u", sp->is_num, sp->is_fake);
 	sendnumericfmt(client, RPL_STATSDEBUG, "auth successes %u fails %u", sp->is_asuc, sp->is_abad);
 	sendnumericfmt(client, RPL_STATSDEBUG, "local connections %u udp packets %u", sp->is_loc, sp->is_udp);
+	sendnumericfmt(client, RPL_STATSDEBUG, "channel broadcast renders %lu deliveries %lu", sp->is_bcrender, sp->is_bcdeliver);
+	sendnumericfmt(client, RPL_STATSDEBUG, "sendq write calls %lu bytes %llu (%llu bytes/call)",
+		sp->is_sqcalls, sp->is_sqbytes, sp->is_sqcalls ? sp->is_sqbytes / sp->is_sqcalls : 0);
+	sendnumericfmt(client, RPL_STATSDEBUG, "tls handshakes full %lu resumed %lu",
+		sp->is_tlsfull, sp->is_tlsresumed);
+	if (ctx_server)
+	{
+		sendnumericfmt(client, RPL_STATSDEBUG, "tls session cache entries %ld hits %ld misses %ld timeouts %ld",
+			SSL_CTX_sess_number(ctx_server), SSL_CTX_sess_hits(ctx_server),
+			SSL_CTX_sess_misses(ctx_server), SSL_CTX_sess_timeouts(ctx_server));
+	}
 	sendnumericfmt(client, RPL_STATSDEBUG, "Client Server");
 	sendnumericfmt(client, RPL_STATSDEBUG, "connected %u %u", sp->is_cl, sp->is_sv);
 	sendnumericfmt(client, RPL_STATSDEBUG, "bytes sent %ld.%huK %ld.%huK",
@@ -661,6 +684,161 @@ int stats_fdtable(Client *client, char *para)
 	return 0;
 }
 
+int stats_tlsworkers(Client *client, char *para)
+{
+	TLSWorkerStats stats;
+	int i;
+#ifndef _WIN32
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+	{
+		sendnumericfmt(client, RPL_STATSDEBUG, "main thread: cpu %lld.%03lds",
+			(long long)ts.tv_sec, ts.tv_nsec / 1000000);
+	}
+#endif
+
+	for (i = 0; tls_worker_stats(i, &stats); i++)
+	{
+		sendnumericfmt(client, RPL_STATSDEBUG,
+			"tls worker %d: cpu %lld.%03llds, connections %d, queued %d, completed %d, "
+			"jobs %llu, handshakes %llu, decrypted %lluK, encrypted %lluK",
+			i, stats.cpu_usec / 1000000, (stats.cpu_usec % 1000000) / 1000,
+			stats.connections, stats.queued, stats.completed,
+			stats.jobs, stats.handshakes, stats.bytes_in / 1024, stats.bytes_out / 1024);
+	}
+
+	if (i == 0)
+		sendnumericfmt(client, RPL_STATSDEBUG, "No TLS worker threads are running (set::tls-workers)");
+
+	return 0;
+}
+
+int stats_cmdprofile(Client *client, char *para)
+{
+	static char *source_name[COMMAND_SOURCES] = { "local", "remote", "server" };
+	char name[64];
+	RealCommand *mptr;
+	int i, n;
+
+	if (para && !strcasecmp(para, "-reset"))
+	{
+		if (!ValidatePermissionsForPath("server:info:stats",client,NULL,NULL,NULL))
+		{
+			sendnumeric(client, ERR_NOPRIVILEGES);
+			return 0;
+		}
+		for (i = 0; i < 256; i++)
+			for (mptr = CommandHash[i]; mptr; mptr = mptr->next)
+				memset(mptr->profile, 0, sizeof(mptr->profile));
+		sendnumericfmt(client, RPL_STATSDEBUG, "Command profile has been reset");
+		return 0;
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		for (mptr = CommandHash[i]; mptr; mptr = mptr->next)
+		{
+			for (n = 0; n < COMMAND_SOURCES; n++)
+			{
+				if (!mptr->profile[n].calls)
+					continue;
+				snprintf(name, sizeof(name), "%s (%s)", mptr->cmd, source_name[n]);
+				profile_report(client, name, &mptr->profile[n]);
+			}
+		}
+	}
+	return 0;
+}
+
+int stats_hookprofile(Client *client, char *para)
+{
+	char name[128], *hookname;
+	Hook *h;
+	int i;
+
+	if (para && !strcasecmp(para, "-reset"))
+	{
+		if (!ValidatePermissionsForPath("server:info:stats",client,NULL,NULL,NULL))
+		{
+			sendnumeric(client, ERR_NOPRIVILEGES);
+			return 0;
+		}
+		for (i = 0; i < MAXHOOKTYPES; i++)
+			for (h = Hooks[i]; h; h = h->next)
+				memset(&h->profile, 0, sizeof(h->profile));
+		sendnumericfmt(client, RPL_STATSDEBUG, "Hook profile has been reset");
+		return 0;
+	}
+
+	for (i = 0; i < MAXHOOKTYPES; i++)
+	{
+		for (h = Hooks[i]; h; h = h->next)
+		{
+			if (!h->profile.calls)
+				continue;
+			hookname = hooktype_to_string(i);
+			if (hookname)
+				snprintf(name, sizeof(name), "%s (%s)", hookname, h->owner ? h->owner->header->name : "core");
+			else
+				snprintf(name, sizeof(name), "hook %d (%s)", i, h->owner ? h->owner->header->name : "core");
+			profile_report(client, name, &h->profile);
+		}
+	}
+	return 0;
+}
+
+int stats_loop(Client *client, char *para)
+{
+	char buf[512];
+	char *b = buf;
+	uint64_t elapsed;
+	int i;
+
+	if (para && !strcasecmp(para, "-reset"))
+	{
+		if (!ValidatePermissionsForPath("server:info:stats",client,NULL,NULL,NULL))
+		{
+			sendnumeric(client, ERR_NOPRIVILEGES);
+			return 0;
+		}
+		reset_loop_stats();
+		sendnumericfmt(client, RPL_STATSDEBUG, "Main loop statistics have been reset");
+		return 0;
+	}
+
+	elapsed = profile_time_ns() - loopstats.since;
+	if (!elapsed)
+		elapsed = 1;
+	sendnumericfmt(client, RPL_STATSDEBUG,
+		"main loop: running %llds, busy %.2f%%, stalls %lu (set::main-loop-stall-threshold %d ms)",
+		(long long)(elapsed / 1000000000),
+		(double)loopstats.busy_ns * 100.0 / (double)elapsed,
+		loopstats.stalls, iConf.main_loop_stall_threshold);
+
+	profile_report(client, "iteration", &loopstats.iteration);
+	profile_report(client, "events", &loopstats.events);
+	profile_report(client, "flush", &loopstats.flush);
+	profile_report(client, "io", &loopstats.io);
+	profile_report(client, "process_clients", &loopstats.process_clients);
+	profile_report(client, "rehash", &loopstats.rehash);
+
+	*buf = '\0';
+	for (i = 0; i < PROFILE_BUCKETS; i++)
+	{
+		if (!loopstats.ready_fds[i])
+			continue;
+		if (i == 0)
+			snprintf(b, sizeof(buf) - (b - buf), " 0:%u", loopstats.ready_fds[i]);
+		else
+			snprintf(b, sizeof(buf) - (b - buf), " <%lu:%u", 1UL << i, loopstats.ready_fds[i]);
+		b += strlen(b);
+	}
+	sendnumericfmt(client, RPL_STATSDEBUG, "ready fds per iteration: histogram%s", buf);
+
+	return 0;
+}
+
 int stats_uline(Client *client, char *para)
 {
 	ConfigItem_ulines *ulines;
@@ -835,6 +1013,8 @@ int stats_set(Client *client, char *para)
 	sendtxtnumeric(client, "tls::key: %s", SafePrint(iConf.tls_options->key_file));
 	sendtxtnumeric(client, "tls::trusted-ca-file: %s", SafePrint(iConf.tls_options->trusted_ca_file));
 	sendtxtnumeric(client, "tls::options: %s", iConf.tls_options->options & TLSFLAG_FAILIFNOCERT ? "FAILIFNOCERT" : "");
+	sendtxtnumeric(client, "tls::session-cache-size: %d", iConf.tls_options->session_cache_size);
+	sendtxtnumeric(client, "tls::session-timeout: %s", pretty_time_val(iConf.tls_options->session_timeout));
 	sendtxtnumeric(client, "options::show-opermotd: %d", SHOWOPERMOTD);
 	sendtxtnumeric(client, "options::hide-ulines: %d", HIDE_ULINES);
 	sendtxtnumeric(client, "options::identd-check: %d", IDENT_CHECK);
@@ -868,6 +1048,9 @@ int stats_set(Client *client, char *para)
 	sendtxtnumeric(client, "anti-flood::nick-flood: %d per %s", NICK_COUNT, pretty_time_val(NICK_PERIOD));
 	sendtxtnumeric(client, "handshake-timeout: %s", pretty_time_val(iConf.handshake_timeout));
 	sendtxtnumeric(client, "sasl-timeout: %s", pretty_time_val(iConf.sasl_timeout));
+	sendtxtnumeric(client, "sendq-block-size: %d", iConf.sendq_block_size);
+	sendtxtnumeric(client, "tls-workers: %d", iConf.tls_workers);
+	sendtxtnumeric(client, "max-concurrent-handshakes: %d", iConf.max_concurrent_handshakes);
 	sendtxtnumeric(client, "ident::connect-timeout: %s", pretty_time_val(IDENT_CONNECT_TIMEOUT));
 	sendtxtnumeric(client, "ident::read-timeout: %s", pretty_time_val(IDENT_READ_TIMEOUT));
 	sendtxtnumeric(client, "spamfilter::ban-time: %s", pretty_time_val(SPAMFILTER_BAN_TIME));
@@ -7,6 +7,12 @@
    
 #include "unrealircd.h"
 #include <limits.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define WEBSOCKET_VERSION "1.0.0"
 
@@ -30,14 +36,34 @@ struct WebSocketUser {
 	char *handshake_key; /**< Handshake key (used during handshake) */
 	char *lefttoparse; /**< Leftover buffer to parse */
 	int lefttoparselen; /**< Length of lefttoparse buffer */
+#ifdef HAVE_ZLIB
+	int deflate_bits; /**< permessage-deflate: window bits of our messages (0 = not negotiated) */
+	int inflate_bits; /**< permessage-deflate: window bits of the client's messages */
+	char deflate_reset; /**< Our messages are compressed on their own (no context takeover) */
+	char inflate_reset; /**< The client's messages are compressed on their own */
+	char inflating; /**< Busy with a compressed message (that may span multiple frames) */
+	char inflate_lastbyte; /**< Last byte of decompressed data */
+	int inflated; /**< Number of bytes decompressed for the current message */
+	z_stream *deflate; /**< Compression state (with context takeover only) */
+	z_stream *inflate; /**< Decompression state */
+#endif
 };
 
 #define WEBSOCKET_TYPE_BINARY	0x1
 #define WEBSOCKET_TYPE_TEXT	0x2
+#define WEBSOCKET_TYPE_MASK	0x3
+#define WEBSOCKET_DEFLATE	0x10 /**< permessage-deflate is enabled on this listener */
+#define WEBSOCKET_DEFLATE_NO_CONTEXT_TAKEOVER	0x20 /**< ..but without context takeover */
 
 #define WSU(client)	((WebSocketUser *)moddata_client(client, websocket_md).ptr)
 
-#define WEBSOCKET_TYPE(client)	((client->local && client->local->listener) ? client->local->listener->websocket_options : 0)
+#define WEBSOCKET_OPTIONS(client)	((client->local && client->local->listener) ? client->local->listener->websocket_options : 0)
+#define WEBSOCKET_TYPE(client)	(WEBSOCKET_OPTIONS(client) & WEBSOCKET_TYPE_MASK)
+#ifdef HAVE_ZLIB
+ #define WEBSOCKET_COMPRESSION(client)	(WSU(client)->deflate_bits)
+#else
+ #define WEBSOCKET_COMPRESSION(client)	0
+#endif
 
 #define WEBSOCKET_MAGIC_KEY "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" /* see RFC6455 */
 
@@ -48,22 +74,73 @@ struct WebSocketUser {
 #define WSOP_PING         0x09
 #define WSOP_PONG         0x0a
 
+#define WSFRAME_FIN	0x80
+#define WSFRAME_RSV1	0x40 /**< Compressed message (RFC7692) */
+#define WSFRAME_RSV	0x70 /**< All reserved bits */
+
+#ifdef HAVE_ZLIB
+/** Compression level for outgoing messages */
+#define WEBSOCKET_DEFLATE_LEVEL	Z_DEFAULT_COMPRESSION
+
+/** Default for listen::options::websocket::compression::max-memory */
+#define WEBSOCKET_DEFLATE_MEMORY_DEFAULT	65536
+
+/** Maximum size of one decompressed message (IRC lines are much shorter) */
+#define WEBSOCKET_INFLATE_MAX	16384
+
+/** zlib memLevel that goes with a window size, 8 (the default) for a 32K window */
+#define DEFLATE_MEMLEVEL(bits)	((bits) - 7)
+
+/** Approximate memory used by zlib for compression and decompression
+ * with the given window bits (see zconf.h), including the state itself.
+ */
+#define DEFLATE_MEMORY(bits)	((1 << ((bits) + 2)) + (1 << (DEFLATE_MEMLEVEL(bits) + 9)) + 6144)
+#define INFLATE_MEMORY(bits)	((1 << (bits)) + 7168)
+#endif
+
+/** Number of recently built frames to keep around, see websocket_frame_get() */
+#define WEBSOCKET_FRAME_CACHE	4
+
+/** An outgoing data frame, queued by reference in the sendQ's */
+typedef struct WebSocketFrame WebSocketFrame;
+struct WebSocketFrame {
+	int opcode; /**< WSOP_TEXT or WSOP_BINARY */
+	int deflate_bits; /**< Window bits if compressed on its own, 0 if not compressed */
+	int srclen; /**< Length of src */
+	char src[1024]; /**< The line the frame was built from (lines are always shorter) */
+	dbufshared *frame; /**< The frame, or NULL if this slot is not used */
+};
+
 /* Forward declarations */
 int websocket_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
 int websocket_config_run_ex(ConfigFile *cf, ConfigEntry *ce, int type, void *ptr);
 int websocket_packet_out(Client *from, Client *to, Client *intended_to, char **msg, int *length);
 int websocket_packet_in(Client *client, char *readbuf, int *length);
 void websocket_mdata_free(ModData *m);
-int websocket_handle_packet(Client *client, char *readbuf, int length);
+int websocket_handle_packet(Client *client, char *readbuf, int length, char **compact);
 int websocket_handle_handshake(Client *client, char *readbuf, int *length);
 int websocket_complete_handshake(Client *client);
 int websocket_handle_packet_ping(Client *client, char *buf, int len);
 int websocket_handle_packet_pong(Client *client, char *buf, int len);
 int websocket_create_frame(int opcode, char **buf, int *len);
+int websocket_build_frame(int firstbyte, char **buf, int *len);
 int websocket_send_frame(Client *client, int opcode, char *buf, int len);
+int websocket_stats(Client *client, char *flag);
 
 /* Global variables */
 ModDataInfo *websocket_md;
+static WebSocketFrame frame_cache[WEBSOCKET_FRAME_CACHE];
+static int frame_cache_next = 0;
+static unsigned long websocket_frames_built = 0; /**< Frames built (cache misses) */
+static unsigned long websocket_frames_sent = 0; /**< Frames queued to websocket users */
+#ifdef HAVE_ZLIB
+static z_stream *deflate_shared[16]; /**< Compression state per window size, for messages without context takeover */
+static z_stream *inflate_shared = NULL; /**< Decompression state for single-frame messages without context takeover */
+static unsigned long websocket_deflate_in = 0; /**< Bytes given to compression */
+static unsigned long websocket_deflate_out = 0; /**< Bytes after compression */
+static unsigned long websocket_inflate_in = 0; /**< Compressed bytes received */
+static unsigned long websocket_inflate_out = 0; /**< Bytes after decompression */
+#endif
 
 MOD_TEST()
 {
@@ -80,6 +157,7 @@ MOD_INIT()
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN_EX, 0, websocket_config_run_ex);
 	HookAdd(modinfo->handle, HOOKTYPE_PACKET, INT_MAX, websocket_packet_out);
 	HookAdd(modinfo->handle, HOOKTYPE_RAWPACKET_IN, INT_MIN, websocket_packet_in);
+	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, websocket_stats);
 
 	memset(&mreq, 0, sizeof(mreq));
 	mreq.name = "websocket";
@@ -100,6 +178,31 @@ MOD_LOAD()
 
 MOD_UNLOAD()
 {
+	int i;
+
+	for (i = 0; i < WEBSOCKET_FRAME_CACHE; i++)
+	{
+		if (frame_cache[i].frame)
+		{
+			dbuf_shared_release(frame_cache[i].frame);
+			frame_cache[i].frame = NULL;
+		}
+	}
+#ifdef HAVE_ZLIB
+	for (i = 0; i < ARRAY_SIZEOF(deflate_shared); i++)
+	{
+		if (deflate_shared[i])
+		{
+			deflateEnd(deflate_shared[i]);
+			safe_free(deflate_shared[i]);
+		}
+	}
+	if (inflate_shared)
+	{
+		inflateEnd(inflate_shared);
+		safe_free(inflate_shared);
+	}
+#endif
 	return MOD_SUCCESS;
 }
 
@@ -152,6 +255,37 @@ int websocket_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 				errors++;
 			}
 		} else
+		if (!strcmp(cep->ce_varname, "compression"))
+		{
+			ConfigEntry *cepp;
+#ifndef HAVE_ZLIB
+			config_warn("%s:%i: listen::options::websocket::compression is ignored, "
+			            "UnrealIRCd was compiled without zlib",
+			            cep->ce_fileptr->cf_filename, cep->ce_varlinenum);
+#endif
+			for (cepp = cep->ce_entries; cepp; cepp = cepp->ce_next)
+			{
+				CheckNull(cepp);
+				if (!strcmp(cepp->ce_varname, "context-takeover"))
+				{
+				} else
+				if (!strcmp(cepp->ce_varname, "max-memory"))
+				{
+					long v = config_checkval(cepp->ce_vardata, CFG_SIZE);
+					if ((v < 16384) || (v > 4194304))
+					{
+						config_error("%s:%i: listen::options::websocket::compression::max-memory must be between 16k and 4m",
+							cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum);
+						errors++;
+					}
+				} else
+				{
+					config_error("%s:%i: unknown directive listen::options::websocket::compression::%s",
+						cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum, cepp->ce_varname);
+					errors++;
+				}
+			}
+		} else
 		{
 			config_error("%s:%i: unknown directive listen::options::websocket::%s",
 				cep->ce_fileptr->cf_filename, cep->ce_varlinenum, cep->ce_varname);
@@ -185,16 +319,18 @@ int websocket_config_run_ex(ConfigFile *cf, ConfigEntry *ce, int type, void *ptr
 		return 0;
 
 	l = (ConfigItem_listen *)ptr;
+	l->websocket_options = 0;
+	l->websocket_deflate_memory = 0;
 
 	for (cep = ce->ce_entries; cep; cep = cep->ce_next)
 	{
 		if (!strcmp(cep->ce_varname, "type"))
 		{
 			if (!strcmp(cep->ce_vardata, "binary"))
-				l->websocket_options = WEBSOCKET_TYPE_BINARY;
+				l->websocket_options |= WEBSOCKET_TYPE_BINARY;
 			else if (!strcmp(cep->ce_vardata, "text"))
 			{
-				l->websocket_options = WEBSOCKET_TYPE_TEXT;
+				l->websocket_options |= WEBSOCKET_TYPE_TEXT;
 				if ((tempiConf.allowed_channelchars == ALLOWED_CHANNELCHARS_ANY) && !warned_once_channel)
 				{
 					/* This one is a warning, since the consequences are less grave than with nicks */
@@ -207,6 +343,23 @@ int websocket_config_run_ex(ConfigFile *cf, ConfigEntry *ce, int type, void *ptr
 				}
 			}
 		}
+#ifdef HAVE_ZLIB
+		else if (!strcmp(cep->ce_varname, "compression"))
+		{
+			l->websocket_options |= WEBSOCKET_DEFLATE;
+			l->websocket_deflate_memory = WEBSOCKET_DEFLATE_MEMORY_DEFAULT;
+			for (cepp = cep->ce_entries; cepp; cepp = cepp->ce_next)
+			{
+				if (!strcmp(cepp->ce_varname, "context-takeover"))
+				{
+					if (!config_checkval(cepp->ce_vardata, CFG_YESNO))
+						l->websocket_options |= WEBSOCKET_DEFLATE_NO_CONTEXT_TAKEOVER;
+				}
+				else if (!strcmp(cepp->ce_varname, "max-memory"))
+					l->websocket_deflate_memory = config_checkval(cepp->ce_vardata, CFG_SIZE);
+			}
+		}
+#endif
 	}
 	return 1;
 }
@@ -219,10 +372,215 @@ void websocket_mdata_free(ModData *m)
 	{
 		safe_free(wsu->handshake_key);
 		safe_free(wsu->lefttoparse);
+#ifdef HAVE_ZLIB
+		if (wsu->deflate)
+		{
+			deflateEnd(wsu->deflate);
+			safe_free(wsu->deflate);
+		}
+		if (wsu->inflate)
+		{
+			inflateEnd(wsu->inflate);
+			safe_free(wsu->inflate);
+		}
+#endif
 		safe_free(m->ptr);
 	}
 }
 
+#ifdef HAVE_ZLIB
+/** Create a new compression state for raw deflate data (RFC7692).
+ * @param bits	Window bits (9-15)
+ * @returns The new state, or NULL on failure.
+ */
+static z_stream *websocket_deflate_new(int bits)
+{
+	z_stream *z = safe_alloc(sizeof(z_stream));
+
+	/* Negative window bits means: no zlib header and trailer */
+	if (deflateInit2(z, WEBSOCKET_DEFLATE_LEVEL, Z_DEFLATED, -bits, DEFLATE_MEMLEVEL(bits), Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		safe_free(z);
+		return NULL;
+	}
+	return z;
+}
+
+/** Create a new decompression state for raw deflate data (RFC7692).
+ * @param bits	Window bits (9-15)
+ * @returns The new state, or NULL on failure.
+ */
+static z_stream *websocket_inflate_new(int bits)
+{
+	z_stream *z = safe_alloc(sizeof(z_stream));
+
+	if (inflateInit2(z, -bits) != Z_OK)
+	{
+		safe_free(z);
+		return NULL;
+	}
+	return z;
+}
+
+/** Compress an outgoing message.
+ * @param z		The compression state
+ * @param reset		Compress the message on its own (no context takeover)
+ * @param buf		The message, without CR/LF. On success this is
+ *			changed to point to the compressed data.
+ * @param len		The length of the message, updated on success.
+ * @returns 1 on success, 0 if the compressed message is not smaller
+ *          (only when 'reset' is set), -1 on failure.
+ */
+static int websocket_deflate(z_stream *z, int reset, char **buf, int *len)
+{
+	static char zbuf[16384];
+	int n;
+
+	if (reset)
+		deflateReset(z);
+
+	z->next_in = (Bytef *)*buf;
+	z->avail_in = *len;
+	z->next_out = (Bytef *)zbuf;
+	z->avail_out = sizeof(zbuf);
+	if ((deflate(z, Z_SYNC_FLUSH) != Z_OK) || z->avail_in || !z->avail_out)
+		return -1;
+
+	/* Strip the 00 00 FF FF of the sync flush, see RFC7692 section 7.2.1 */
+	n = sizeof(zbuf) - z->avail_out;
+	if ((n >= 4) && !memcmp(zbuf + n - 4, "\0\0\xff\xff", 4))
+		n -= 4;
+
+	websocket_deflate_in += *len;
+	if (reset && (n >= *len))
+		return 0; /* Then we send it uncompressed, which is permitted */
+	websocket_deflate_out += n;
+
+	*buf = zbuf;
+	*len = n;
+	return 1;
+}
+
+/** Get the (shared) compression state for messages without context takeover.
+ * Such messages do not depend on any earlier message, so they are the same
+ * for all clients with the same window size.
+ */
+static z_stream *websocket_deflate_shared(int bits)
+{
+	if (!deflate_shared[bits])
+		deflate_shared[bits] = websocket_deflate_new(bits);
+	return deflate_shared[bits];
+}
+#endif
+
+/** Strip the trailing LF and CR from an outgoing line */
+static void websocket_strip_crlf(char *buf, int *len)
+{
+	/* strip LF */
+	if (*len > 0)
+	{
+		if (buf[*len - 1] == '\n')
+			*len = *len - 1;
+	}
+	/* strip CR */
+	if (*len > 0)
+	{
+		if (buf[*len - 1] == '\r')
+			*len = *len - 1;
+	}
+}
+
+/** Build the data frame for an outgoing line.
+ * @param client	The client, or NULL if the frame is shared by
+ *			several clients (only allowed when 'deflate_bits'
+ *			is set or compression is not used at all).
+ * @param opcode	WSOP_TEXT or WSOP_BINARY
+ * @param deflate_bits	Compress the message on its own with this
+ *			window size, or 0 for no (or per-client) compression.
+ * @param buf		The line, changed to point to the frame.
+ * @param len		The length, changed to the length of the frame.
+ * @returns 0 on success, -1 on failure.
+ */
+static int websocket_data_frame(Client *client, int opcode, int deflate_bits, char **buf, int *len)
+{
+	int firstbyte = opcode | WSFRAME_FIN;
+
+	if (opcode == WSOP_TEXT)
+	{
+		/* Some more conversions are needed */
+		*buf = unrl_utf8_make_valid(*buf);
+		*len = *buf ? strlen(*buf) : 0;
+	}
+	websocket_strip_crlf(*buf, len);
+
+#ifdef HAVE_ZLIB
+	if ((*len > 0) && (deflate_bits || (client && WSU(client)->deflate)))
+	{
+		z_stream *z = deflate_bits ? websocket_deflate_shared(deflate_bits) : WSU(client)->deflate;
+		int n;
+
+		if (!z)
+			return -1;
+		n = websocket_deflate(z, deflate_bits ? 1 : 0, buf, len);
+		if (n < 0)
+			return -1;
+		if (n > 0)
+			firstbyte |= WSFRAME_RSV1;
+	}
+#endif
+
+	return websocket_build_frame(firstbyte, buf, len);
+}
+
+/** Get the frame for an outgoing line.
+ * The same line is usually sent to many websocket users at once
+ * (eg: a channel message), so the frames of the last few lines are
+ * kept and reused, rather than building the same frame each time.
+ * @param opcode	WSOP_TEXT or WSOP_BINARY
+ * @param deflate_bits	Window bits if the message is to be compressed
+ *			on its own (see websocket_data_frame()), otherwise 0.
+ * @param msg		The line
+ * @param length	The length of the line
+ * @returns The frame, or NULL if it cannot be cached.
+ */
+static dbufshared *websocket_frame_get(int opcode, int deflate_bits, char *msg, int length)
+{
+	WebSocketFrame *f;
+	char *buf = msg;
+	int len = length;
+	int i;
+
+	if (length >= sizeof(f->src))
+		return NULL;
+
+	for (i = 0; i < WEBSOCKET_FRAME_CACHE; i++)
+	{
+		f = &frame_cache[i];
+		if (f->frame && (f->opcode == opcode) && (f->deflate_bits == deflate_bits) &&
+		    (f->srclen == length) && !memcmp(f->src, msg, length))
+		{
+			return f->frame;
+		}
+	}
+
+	if (websocket_data_frame(NULL, opcode, deflate_bits, &buf, &len) < 0)
+		return NULL;
+
+	/* (Re)use the next slot */
+	f = &frame_cache[frame_cache_next];
+	frame_cache_next = (frame_cache_next + 1) % WEBSOCKET_FRAME_CACHE;
+	if (f->frame)
+		dbuf_shared_release(f->frame);
+	f->opcode = opcode;
+	f->deflate_bits = deflate_bits;
+	f->srclen = length;
+	memcpy(f->src, msg, length);
+	f->frame = dbuf_shared_new(buf, len);
+	websocket_frames_built++;
+
+	return f->frame;
+}
+
 /** Outgoing packet hook.
  * This transforms the output to be Websocket-compliant, if necessary.
  */
@@ -230,35 +588,132 @@ int websocket_packet_out(Client *from, Client *to, Client *intended_to, char **m
 {
 	if (MyConnect(to) && WSU(to) && WSU(to)->handshake_completed)
 	{
+		int opcode;
+		int deflate_bits = 0;
+		dbufshared *frame = NULL;
+
 		if (WEBSOCKET_TYPE(to) == WEBSOCKET_TYPE_BINARY)
-			websocket_create_frame(WSOP_BINARY, msg, length);
+			opcode = WSOP_BINARY;
 		else if (WEBSOCKET_TYPE(to) == WEBSOCKET_TYPE_TEXT)
+			opcode = WSOP_TEXT;
+		else
+			return 0;
+
+#ifdef HAVE_ZLIB
+		/* Messages that are compressed on their own can be shared too,
+		 * but with context takeover they are unique for this client.
+		 */
+		if (WSU(to)->deflate_bits && WSU(to)->deflate_reset)
+			deflate_bits = WSU(to)->deflate_bits;
+		if (!WSU(to)->deflate)
+#endif
+			frame = websocket_frame_get(opcode, deflate_bits, *msg, *length);
+		if (frame)
 		{
-			/* Some more conversions are needed */
-			char *safe_msg = unrl_utf8_make_valid(*msg);
-			*msg = safe_msg;
-			*length = *msg ? strlen(safe_msg) : 0;
-			websocket_create_frame(WSOP_TEXT, msg, length);
+			/* Queued by reference, see sendbufto_one() */
+			*msg = frame->data;
+			*length = frame->size;
+			packet_out_shared = frame;
+		} else {
+			if (websocket_data_frame(to, opcode, deflate_bits, msg, length) < 0)
+			{
+				dead_socket(to, "WebSocket: compression failed");
+				*msg = NULL;
+				return 0;
+			}
+			websocket_frames_built++;
 		}
+		websocket_frames_sent++;
 		return 0;
 	}
 	return 0;
 }
 
+int websocket_stats(Client *client, char *flag)
+{
+	if (*flag != 'T')
+		return 0;
+
+	sendnumericfmt(client, RPL_STATSDEBUG, "websocket frames built %lu sent %lu",
+		websocket_frames_built, websocket_frames_sent);
+#ifdef HAVE_ZLIB
+	sendnumericfmt(client, RPL_STATSDEBUG, "websocket deflate in %lu out %lu inflate in %lu out %lu",
+		websocket_deflate_in, websocket_deflate_out,
+		websocket_inflate_in, websocket_inflate_out);
+#endif
+	return 1;
+}
+
+/** Handle the frames in a buffer that was just read, in place.
+ * This is used when there is nothing left over from the previous read
+ * and no compression is used, which is the common case. The payloads of
+ * the data frames are unmasked and moved to the start of 'readbuf', so
+ * read_packet() can simply keep them in the recvQ, rather than each
+ * payload being copied into it separately.
+ * @returns Same as websocket_packet_in()
+ */
+int websocket_handle_websocket_inplace(Client *client, char *readbuf, int *length)
+{
+	char *ptr = readbuf;
+	char *compact = readbuf;
+	int left = *length;
+	int n;
+
+	while (left > 0)
+	{
+		if (((*ptr & 0x0F) == WSOP_CLOSE) && (compact > readbuf))
+		{
+			/* The client is gone after this frame. Process what came
+			 * before it now (eg: a QUIT), as it would be lost otherwise.
+			 * It has to be copied, as the recvQ may reuse 'readbuf'.
+			 */
+			int len = compact - readbuf;
+			char *buf = safe_alloc(len);
+			int alive;
+
+			memcpy(buf, readbuf, len);
+			alive = process_packet(client, buf, len, 1);
+			safe_free(buf);
+			if (alive)
+				dead_socket(client, "Connection closed");
+			return -1;
+		}
+		n = websocket_handle_packet(client, ptr, left, &compact);
+		if (n < 0)
+			return -1; /* killed -- STOP processing */
+		if (n == 0)
+		{
+			/* Short read. Save the rest for next time */
+			WSU(client)->lefttoparse = safe_alloc(left);
+			WSU(client)->lefttoparselen = left;
+			memcpy(WSU(client)->lefttoparse, ptr, left);
+			break;
+		}
+		left -= n;
+		ptr += n;
+	}
+
+	*length = compact - readbuf;
+	return (*length > 0) ? 1 : 0;
+}
+
+/** Handle the frames in a buffer that was just read, together with
+ * what was left over from the previous read.
+ * This is used when websocket_handle_websocket_inplace() cannot be,
+ * eg: when compression is used. Both parts are copied into a buffer of
+ * their own, as the recvQ may reuse 'readbuf2' while processing.
+ * @returns Same as websocket_packet_in()
+ */
 int websocket_handle_websocket(Client *client, char *readbuf2, int length2)
 {
 	int n;
 	char *ptr;
 	int length;
 	int length1 = WSU(client)->lefttoparselen;
-	char readbuf[4096];
+	char *readbuf;
 
 	length = length1 + length2;
-	if (length > sizeof(readbuf)-1)
-	{
-		dead_socket(client, "Illegal buffer stacking/Excess flood");
-		return 0;
-	}
+	readbuf = safe_alloc(length);
 
 	if (length1 > 0)
 		memcpy(readbuf, WSU(client)->lefttoparse, length1);
@@ -269,17 +724,19 @@ int websocket_handle_websocket(Client *client, char *readbuf2, int length2)
 
 	ptr = readbuf;
 	do {
-		n = websocket_handle_packet(client, ptr, length);
+		n = websocket_handle_packet(client, ptr, length, NULL);
 		if (n < 0)
+		{
+			safe_free(readbuf);
 			return -1; /* killed -- STOP processing */
+		}
 		if (n == 0)
 		{
 			/* Short read. Stop processing for now, but save data for next time */
-			safe_free(WSU(client)->lefttoparse);
 			WSU(client)->lefttoparse = safe_alloc(length);
 			WSU(client)->lefttoparselen = length;
 			memcpy(WSU(client)->lefttoparse, ptr, length);
-			return 0;
+			break;
 		}
 		length -= n;
 		ptr += n;
@@ -287,6 +744,7 @@ int websocket_handle_websocket(Client *client, char *readbuf2, int length2)
 			abort(); /* less than 0 is impossible */
 	} while(length > 0);
 
+	safe_free(readbuf);
 	return 0;
 }
 
@@ -310,7 +768,11 @@ int websocket_packet_in(Client *client, char *readbuf, int *length)
 		return 1; /* "normal" IRC client */
 
 	if (WSU(client)->handshake_completed)
+	{
+		if (!WSU(client)->lefttoparse && !WEBSOCKET_COMPRESSION(client))
+			return websocket_handle_websocket_inplace(client, readbuf, length);
 		return websocket_handle_websocket(client, readbuf, *length);
+	}
 	/* else.. */
 	return websocket_handle_handshake(client, readbuf, length);
 }
@@ -452,6 +914,92 @@ int websocket_handshake_helper(char *buffer, int len, char **key, char **value,
 /** Handle client GET WebSocket handshake.
  * Yes, I'm going to assume that the header fits in one packet and one packet only.
  */
+#ifdef HAVE_ZLIB
+/** Strip leading and trailing whitespace (and quotes) from a header parameter */
+static char *websocket_param_trim(char *str)
+{
+	char *p;
+
+	while ((*str == ' ') || (*str == '\t') || (*str == '"'))
+		str++;
+	for (p = str + strlen(str); (p > str) && ((p[-1] == ' ') || (p[-1] == '\t') || (p[-1] == '"')); p--)
+		p[-1] = '\0';
+	return str;
+}
+
+/** Handle a Sec-WebSocket-Extensions header during the handshake.
+ * We accept the first permessage-deflate offer that we can honour and
+ * that fits within listen::options::websocket::compression::max-memory
+ * (RFC7692 section 7.1). The window sizes are lowered as needed for the
+ * latter. Compression state without context takeover is not counted,
+ * as that is shared by all clients.
+ */
+static void websocket_negotiate_deflate(Client *client, char *value)
+{
+	char buf[512], *offer, *param, *v;
+	char *offer_save = NULL, *param_save = NULL;
+	int listener_reset = (WEBSOCKET_OPTIONS(client) & WEBSOCKET_DEFLATE_NO_CONTEXT_TAKEOVER) ? 1 : 0;
+	int max_memory = client->local->listener->websocket_deflate_memory;
+
+	strlcpy(buf, value, sizeof(buf));
+	for (offer = strtoken(&offer_save, buf, ","); offer; offer = strtoken(&offer_save, NULL, ","))
+	{
+		int server_reset = listener_reset, client_reset = listener_reset;
+		int server_bits = 15, client_bits = 0; /* 0 = client_max_window_bits not offered */
+		int bits, cbits, mem, invalid = 0;
+
+		param = strtoken(&param_save, offer, ";");
+		if (!param || strcmp(websocket_param_trim(param), "permessage-deflate"))
+			continue;
+
+		while (!invalid && (param = strtoken(&param_save, NULL, ";")))
+		{
+			v = strchr(param, '=');
+			if (v)
+			{
+				*v++ = '\0';
+				v = websocket_param_trim(v);
+			}
+			param = websocket_param_trim(param);
+			if (!strcmp(param, "server_no_context_takeover") && !v)
+				server_reset = 1;
+			else if (!strcmp(param, "client_no_context_takeover") && !v)
+				; /* Only a hint, the client may do this without asking */
+			else if (!strcmp(param, "server_max_window_bits") && v && (atoi(v) >= 8) && (atoi(v) <= 15))
+				server_bits = atoi(v);
+			else if (!strcmp(param, "client_max_window_bits") && !v)
+				client_bits = 15;
+			else if (!strcmp(param, "client_max_window_bits") && v && (atoi(v) >= 8) && (atoi(v) <= 15))
+				client_bits = atoi(v);
+			else
+				invalid = 1;
+		}
+		/* zlib cannot compress with a window of 256 bytes (8 bits) */
+		if (invalid || (server_bits < 9))
+			continue;
+
+		/* Pick the largest window that fits */
+		for (bits = server_bits; bits >= 9; bits--)
+		{
+			cbits = client_bits ? MIN(bits, client_bits) : 15;
+			mem = (server_reset ? 0 : DEFLATE_MEMORY(bits)) + (client_reset ? 0 : INFLATE_MEMORY(cbits));
+			if (mem <= max_memory)
+				break;
+		}
+		if (bits < 9)
+			continue;
+
+		if (!server_reset && !(WSU(client)->deflate = websocket_deflate_new(bits)))
+			return;
+		WSU(client)->deflate_bits = bits;
+		WSU(client)->inflate_bits = client_bits ? cbits : 0;
+		WSU(client)->deflate_reset = server_reset;
+		WSU(client)->inflate_reset = client_reset;
+		return;
+	}
+}
+#endif
+
 int websocket_handle_handshake(Client *client, char *readbuf, int *length)
 {
 	char *key, *value;
@@ -498,6 +1046,13 @@ int websocket_handle_handshake(Client *client, char *readbuf, int *length)
 			}
 			safe_strdup(WSU(client)->handshake_key, value);
 		}
+#ifdef HAVE_ZLIB
+		else if (!strcasecmp(key, "Sec-WebSocket-Extensions"))
+		{
+			if ((WEBSOCKET_OPTIONS(client) & WEBSOCKET_DEFLATE) && !WSU(client)->deflate_bits)
+				websocket_negotiate_deflate(client, value);
+		}
+#endif
 	}
 
 	if (end_of_request)
@@ -528,6 +1083,7 @@ int websocket_handle_handshake(Client *client, char *readbuf, int *length)
 int websocket_complete_handshake(Client *client)
 {
 	char buf[512], hashbuf[64];
+	char extensions[256];
 	SHA_CTX hash;
 	char sha1out[20]; /* 160 bits */
 
@@ -540,13 +1096,30 @@ int websocket_complete_handshake(Client *client)
 
 	b64_encode(sha1out, sizeof(sha1out), hashbuf, sizeof(hashbuf));
 
+	*extensions = '\0';
+#ifdef HAVE_ZLIB
+	if (WSU(client)->deflate_bits)
+	{
+		snprintf(extensions, sizeof(extensions),
+		         "Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=%d%s%s",
+		         WSU(client)->deflate_bits,
+		         WSU(client)->deflate_reset ? "; server_no_context_takeover" : "",
+		         WSU(client)->inflate_reset ? "; client_no_context_takeover" : "");
+		if (WSU(client)->inflate_bits)
+			snprintf(extensions + strlen(extensions), sizeof(extensions) - strlen(extensions),
+			         "; client_max_window_bits=%d", WSU(client)->inflate_bits);
+		strlcat(extensions, "\r\n", sizeof(extensions));
+	}
+#endif
+
 	snprintf(buf, sizeof(buf),
 	         "HTTP/1.1 101 Switching Protocols\r\n"
 	         "Upgrade: websocket\r\n"
 	         "Connection: Upgrade\r\n"
 	         "Sec-WebSocket-Accept: %s\r\n"
+	         "%s"
 	         "\r\n",
-	         hashbuf);
+	         hashbuf, extensions);
 
 	/* Caution: we bypass sendQ flood checking by doing it this way.
 	 * Risk is minimal, though, as we only permit limited text only
@@ -558,38 +1131,191 @@ int websocket_complete_handshake(Client *client)
 	return 0;
 }
 
-/* Add LF (if needed) to a buffer. Max 4K. */
-void add_lf_if_needed(char **buf, int *len)
+/** Unmask a payload (RFC6455 section 5.3).
+ * This can be done in place, or while moving the data to an earlier
+ * position in the same buffer ('dst' before 'src'), as every block is
+ * read before it is written. Since all blocks are a multiple of 4 bytes,
+ * the mask stays aligned with the data.
+ * @param dst		Where to store the unmasked payload
+ * @param src		The masked payload
+ * @param len		The length of the payload
+ * @param maskkey	The 4 byte mask
+ */
+static void websocket_unmask(char *dst, const char *src, int len, const char *maskkey)
+{
+	uint32_t mask32;
+	uint64_t mask64, v;
+	int n = 0;
+
+	memcpy(&mask32, maskkey, 4);
+#ifdef __AVX2__
+	if (len >= 32)
+	{
+		__m256i mask = _mm256_set1_epi32(mask32);
+		for (; n + 32 <= len; n += 32)
+		{
+			__m256i d = _mm256_loadu_si256((const __m256i *)(src + n));
+			_mm256_storeu_si256((__m256i *)(dst + n), _mm256_xor_si256(d, mask));
+		}
+	}
+#endif
+#ifdef __SSE2__
+	if (len - n >= 16)
+	{
+		__m128i mask = _mm_set1_epi32(mask32);
+		for (; n + 16 <= len; n += 16)
+		{
+			__m128i d = _mm_loadu_si128((const __m128i *)(src + n));
+			_mm_storeu_si128((__m128i *)(dst + n), _mm_xor_si128(d, mask));
+		}
+	}
+#endif
+	/* Portable version: 8 bytes at a time, then the rest */
+	mask64 = ((uint64_t)mask32 << 32) | mask32;
+	for (; n + 8 <= len; n += 8)
+	{
+		memcpy(&v, src + n, 8);
+		v ^= mask64;
+		memcpy(dst + n, &v, 8);
+	}
+	for (; n < len; n++)
+		dst[n] = src[n] ^ maskkey[n % 4];
+}
+
+#ifdef HAVE_ZLIB
+/** Decompress data of a compressed message and process the result.
+ * @returns 0 on success, -1 if the client was killed.
+ */
+static int websocket_inflate_data(Client *client, z_stream *z, char *buf, int len)
+{
+	WebSocketUser *wsu = WSU(client);
+	char out[4096];
+	int r, n;
+
+	z->next_in = (Bytef *)buf;
+	z->avail_in = len;
+	websocket_inflate_in += len;
+	do
+	{
+		z->next_out = (Bytef *)out;
+		z->avail_out = sizeof(out);
+		r = inflate(z, Z_SYNC_FLUSH);
+		if (r == Z_STREAM_END)
+		{
+			/* Final block seen, anything after it starts a new stream */
+			inflateReset(z);
+		} else
+		if ((r != Z_OK) && (r != Z_BUF_ERROR))
+		{
+			dead_socket(client, "WebSocket: invalid compressed data");
+			return -1;
+		}
+		n = sizeof(out) - z->avail_out;
+		if (n > 0)
+		{
+			wsu->inflated += n;
+			if (wsu->inflated > WEBSOCKET_INFLATE_MAX)
+			{
+				dead_socket(client, "WebSocket: compressed message too large");
+				return -1;
+			}
+			websocket_inflate_out += n;
+			wsu->inflate_lastbyte = out[n - 1];
+			if (!process_packet(client, out, n, 1)) /* let UnrealIRCd process this data */
+				return -1; /* fatal error occured (such as flood kill) */
+		}
+	} while ((z->avail_out == 0) || ((z->avail_in > 0) && (r != Z_BUF_ERROR)));
+
+	return 0;
+}
+
+/** Handle a frame of a compressed message (RFC7692 section 7.2.2).
+ * @param client	The client
+ * @param buf		The (unmasked) payload
+ * @param len		The length of the payload
+ * @param start		This is the first frame of the message
+ * @param fin		This is the last frame of the message
+ * @returns 0 on success, -1 if the client was killed.
+ */
+static int websocket_inflate(Client *client, char *buf, int len, int start, int fin)
 {
-	static char newbuf[4096];
-	char *b = *buf;
-	int l = *len;
+	WebSocketUser *wsu = WSU(client);
+	z_stream *z;
 
-	if (l <= 0)
-		return; /* too short */
+	if (start)
+	{
+		wsu->inflating = 1;
+		wsu->inflated = 0;
+	}
 
-	if (b[l - 1] == '\n')
-		return; /* already contains \n */
+	if (wsu->inflate)
+	{
+		z = wsu->inflate;
+	} else
+	if (wsu->inflate_reset && start && fin)
+	{
+		/* A complete message that does not depend on earlier ones,
+		 * no need for a state of its own.
+		 */
+		if (!inflate_shared)
+			inflate_shared = websocket_inflate_new(15);
+		z = inflate_shared;
+	} else
+	{
+		z = wsu->inflate = websocket_inflate_new(wsu->inflate_bits ? wsu->inflate_bits : 15);
+	}
 
-	if (l >= sizeof(newbuf)-2)
-		l = sizeof(newbuf)-2; /* cut-off if necessary */
+	if (!z)
+	{
+		dead_socket(client, "WebSocket: unable to decompress");
+		return -1;
+	}
+	if (start && wsu->inflate_reset)
+		inflateReset(z);
+
+	if (websocket_inflate_data(client, z, buf, len) < 0)
+		return -1;
+
+	if (fin)
+	{
+		/* Add the 00 00 FF FF that the client stripped */
+		if (websocket_inflate_data(client, z, "\0\0\xff\xff", 4) < 0)
+			return -1;
+		wsu->inflating = 0;
+		if ((wsu->inflated > 0) && (wsu->inflate_lastbyte != '\n'))
+		{
+			if (!process_packet(client, "\n", 1, 1))
+				return -1;
+		}
+		if (wsu->inflate_reset && wsu->inflate)
+		{
+			/* Only needed while a message was in progress */
+			inflateEnd(wsu->inflate);
+			safe_free(wsu->inflate);
+		}
+	}
 
-	memcpy(newbuf, b, l);
-	newbuf[l] = '\n';
-	newbuf[l + 1] = '\0'; /* not necessary, but I like zero termination */
-	l++;
-	*buf = newbuf; /* new buffer */
-	*len = l; /* new length */
+	return 0;
 }
+#endif
 
 /** WebSocket packet handler.
  * For more information on the format, check out page 28 of RFC6455.
+ * @param client	The client
+ * @param readbuf	The frame (and possibly more frames after it)
+ * @param length	The length of the data in 'readbuf'
+ * @param compact	If NULL, the payload of a data frame is processed
+ *			right away. Otherwise the payload is moved to
+ *			*compact (which is at or before 'readbuf') and
+ *			*compact is advanced, see websocket_handle_websocket_inplace().
  * @returns The number of bytes processed (the size of the frame)
  *          OR 0 to indicate a possible short read (want more data)
  *          OR -1 in case of an error.
  */
-int websocket_handle_packet(Client *client, char *readbuf, int length)
+int websocket_handle_packet(Client *client, char *readbuf, int length, char **compact)
 {
+	char fin; /**< Final frame of the message */
+	char compressed = 0; /**< First frame of a compressed message (RFC7692) */
 	char opcode; /**< Opcode */
 	char masked; /**< Masked */
 	int len; /**< Length of the packet */
@@ -603,13 +1329,28 @@ int websocket_handle_packet(Client *client, char *readbuf, int length)
 		return 0;
 	}
 
-	/* fin    = readbuf[0] & 0x80; -- unused */
-	opcode = readbuf[0] & 0x7F;
+	fin    = readbuf[0] & WSFRAME_FIN;
+	opcode = readbuf[0] & 0x0F;
 	masked = readbuf[1] & 0x80;
 	len    = readbuf[1] & 0x7F;
 	p = &readbuf[2]; /* point to next element */
 
-	/* actually 'fin' is unused.. we don't care. */
+	/* 'fin' only matters for compressed messages */
+
+	if (readbuf[0] & WSFRAME_RSV)
+	{
+#ifdef HAVE_ZLIB
+		if (((readbuf[0] & WSFRAME_RSV) == WSFRAME_RSV1) && WSU(client)->deflate_bits &&
+		    ((opcode == WSOP_TEXT) || (opcode == WSOP_BINARY)))
+		{
+			compressed = 1;
+		} else
+#endif
+		{
+			dead_socket(client, "WebSocket: Unknown opcode");
+			return -1;
+		}
+	}
 
 	if (!masked)
 	{
@@ -656,28 +1397,54 @@ int websocket_handle_packet(Client *client, char *readbuf, int length)
 
 	memcpy(maskkey, p, 4);
 	p+= 4;
-	payload = (len > 0) ? p : NULL;
 
-	if (len > 0)
-	{
-		/* Unmask this thing (page 33, section 5.3) */
-		int n;
-		char v;
-		for (n = 0; n < len; n++)
-		{
-			v = *p;
-			*p++ = v ^ maskkey[n % 4];
-		}
-	}
+	if (compact && (opcode == WSOP_CONTINUATION || opcode == WSOP_TEXT || opcode == WSOP_BINARY))
+		payload = *compact;
+	else
+		payload = p;
+
+	/* Unmask this thing (page 33, section 5.3) */
+	websocket_unmask(payload, p, len, maskkey);
+	if (len == 0)
+		payload = NULL;
 
 	switch(opcode)
 	{
 		case WSOP_CONTINUATION:
 		case WSOP_TEXT:
 		case WSOP_BINARY:
+#ifdef HAVE_ZLIB
+			if ((opcode != WSOP_CONTINUATION) && WSU(client)->inflating)
+			{
+				dead_socket(client, "WebSocket protocol violation (new message before the previous one ended)");
+				return -1;
+			}
+			if (compressed || WSU(client)->inflating)
+			{
+				if (websocket_inflate(client, payload, len, compressed, fin) < 0)
+					return -1;
+				return total_packet_size;
+			}
+#endif
 			if (len > 0)
 			{
-				add_lf_if_needed(&payload, &len);
+				if (compact)
+				{
+					/* Keep it where it is, only add the LF if needed.
+					 * There is room for it, as the frame header is gone.
+					 */
+					*compact += len;
+					if ((*compact)[-1] != '\n')
+						*(*compact)++ = '\n';
+					return total_packet_size;
+				}
+				if (payload[len - 1] != '\n')
+				{
+					/* Add the LF without copying the payload around */
+					dbuf_put(&client->local->recvQ, payload, len);
+					payload = "\n";
+					len = 1;
+				}
 				if (!process_packet(client, payload, len, 1)) /* let UnrealIRCd process this data */
 					return -1; /* fatal error occured (such as flood kill) */
 			}
@@ -726,26 +1493,22 @@ int websocket_handle_packet_pong(Client *client, char *buf, int len)
 /** Create a frame. Used for OUTGOING data. */
 int websocket_create_frame(int opcode, char **buf, int *len)
 {
-	static char sendbuf[8192];
+	websocket_strip_crlf(*buf, len);
+	return websocket_build_frame(opcode | WSFRAME_FIN, buf, len);
+}
 
-	sendbuf[0] = opcode | 0x80; /* opcode & final */
+/** Build a frame from a payload that is ready to be sent as-is.
+ * @param firstbyte	The opcode, with WSFRAME_FIN and possibly WSFRAME_RSV1
+ */
+int websocket_build_frame(int firstbyte, char **buf, int *len)
+{
+	static char sendbuf[16384];
+
+	sendbuf[0] = firstbyte;
 
 	if (*len > sizeof(sendbuf) - 8)
 		abort(); /* should never happen (safety) */
 
-	/* strip LF */
-	if (*len > 0)
-	{
-		if (*(*buf + *len - 1) == '\n')
-			*len = *len - 1;
-	}
-	/* strip CR */
-	if (*len > 0)
-	{
-		if (*(*buf + *len - 1) == '\r')
-			*len = *len - 1;
-	}
-
 	if (*len < 126)
 	{
 		/* Short payload */
@@ -72,6 +72,7 @@ struct who_format
 
 /* Global variables */
 ModDataInfo *whox_md = NULL;
+static long CAP_MULTI_PREFIX = 0L;
 
 /* Forward declarations */
 CMD_FUNC(cmd_whox);
@@ -116,6 +117,8 @@ MOD_INIT()
 
 MOD_LOAD()
 {
+	CAP_MULTI_PREFIX = ClientCapabilityBit("multi-prefix");
+
 	return MOD_SUCCESS;
 }
 
@@ -745,7 +748,7 @@ static void do_who(Client *client, Client *acptr, Channel *channel, struct who_f
 
 		if ((lp = find_membership_link(acptr->user->channel, channel)))
 		{
-			if (!(fmt->fields || HasCapability(client, "multi-prefix")))
+			if (!(fmt->fields || HasCapabilityFast(client, CAP_MULTI_PREFIX)))
 			{
 				/* Standard NAMES reply */
 #ifdef PREFIX_AQ
@@ -52,6 +52,18 @@ int process_packet(Client *client, char *readbuf, int length, int killsafely)
 {
 	dbuf_put(&client->local->recvQ, readbuf, length);
 
+	return process_recvq(client, killsafely);
+}
+
+/** Process data that was added to the recvQ of the client.
+ * This is process_packet() for data that was put in the recvQ
+ * already, eg: by read_packet() which reads into it directly.
+ * @param client      The client
+ * @param killsafely  See process_packet()
+ * @returns 1 in normal circumstances, 0 if client was killed.
+ */
+int process_recvq(Client *client, int killsafely)
+{
 	/* parse some of what we have (inducing fakelag, etc) */
 	parse_client_queued(client);
 
@@ -97,28 +109,58 @@ void parse_client_queued(Client *client)
 {
 	int dolen = 0;
 	char buf[READBUFSIZE];
+	char *line;
+	dbufbuf *pinned;
 
-	if (IsDNSLookup(client))
-		return; /* we delay processing of data until the host is resolved */
+	if (!DBufLength(&client->local->recvQ))
+		return;
 
-	if (IsIdentLookup(client))
-		return; /* we delay processing of data until identd has replied */
+	if (IsDNSLookup(client) || IsIdentLookup(client))
+	{
+		/* we delay processing of data until the host is resolved
+		 * and identd has replied, check again on the next round.
+		 */
+		queue_client_input(client, TStime());
+		return;
+	}
 
 	if (!IsUser(client) && !IsServer(client) && (iConf.handshake_delay > 0) &&
 	    (TStime() - client->local->firsttime < iConf.handshake_delay))
 	{
-		return; /* we delay processing of data until set::handshake-delay is reached */
+		/* we delay processing of data until set::handshake-delay is reached */
+		queue_client_input(client, client->local->firsttime + iConf.handshake_delay);
+		return;
 	}
 
-	while (DBufLength(&client->local->recvQ) && !client_lagged_up(client))
+	while (DBufLength(&client->local->recvQ))
 	{
-		dolen = dbuf_getmsg(&client->local->recvQ, buf);
+		if (client_lagged_up(client))
+		{
+			/* Continue once the fake lag is below 10 seconds again */
+			queue_client_input(client, client->local->since - 9);
+			return;
+		}
+
+		/* Usually the line can be parsed where it is, in the recvQ */
+		dolen = dbuf_getmsg_inplace(&client->local->recvQ, buf, &line, &pinned);
 
 		if (dolen == 0)
 			return;
 
-		dopacket(client, buf, dolen);
-		
+		/* Parse all complete lines in the block before putting it back */
+		for (;;)
+		{
+			dopacket(client, line, dolen);
+			if (!pinned || IsDead(client) || IsDeadSocket(client) || client_lagged_up(client))
+				break;
+			dolen = dbuf_getmsg_next(pinned, &line);
+			if (dolen == 0)
+				break;
+		}
+
+		if (pinned)
+			dbuf_getmsg_done(&client->local->recvQ, pinned, !IsDead(client) && !IsDeadSocket(client));
+
 		if (IsDead(client))
 			return;
 	}
@@ -170,7 +212,7 @@ void dopacket(Client *client, char *buffer, int length)
  */
 void parse(Client *cptr, char *buffer, int length)
 {
-	Hook *h;
+	Hook *h, **hp;
 	Client *from = cptr;
 	char *ch;
 	int i, ret;
@@ -181,9 +223,9 @@ void parse(Client *cptr, char *buffer, int length)
 	 * This, while all the rest of the IRCd code assumes a maximum length
 	 * of BUFSIZE, which is 512 (including NUL byte).
 	 */
-	for (h = Hooks[HOOKTYPE_PACKET]; h; h = h->next)
+	for_each_hook(HOOKTYPE_PACKET, h, hp)
 	{
-		(*(h->func.intfunc))(from, &me, NULL, &buffer, &length);
+		ProfileHook(h, (*(h->func.intfunc))(from, &me, NULL, &buffer, &length));
 		if(!buffer)
 			return;
 	}
@@ -254,6 +296,10 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 #endif
 	RealCommand *cmptr = NULL;
 	int bytes;
+	CommandSource source;
+	uint64_t start, took;
+	char cmdname[64];
+	unsigned long deleted;
 
 	*fromptr = cptr; /* The default, unless a source is specified (and permitted) */
 
@@ -492,18 +538,24 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 	if (IsUser(cptr) && (cmptr->flags & CMD_RESETIDLE))
 		cptr->local->last = TStime();
 
-#ifndef DEBUGMODE
-	if (cmptr->flags & CMD_ALIAS)
-	{
-		(*cmptr->aliasfunc) (from, mtags, i, para, cmptr->cmd);
-	} else {
-		if (!cmptr->overriders)
-			(*cmptr->func) (from, mtags, i, para);
-		else
-			(*cmptr->overriders->func) (cmptr->overriders, from, mtags, i, para);
-	}
-#else
+	/* Decided here, since 'from' may be gone after the command */
+	if (!IsServer(cptr))
+		source = COMMAND_SOURCE_LOCAL;
+	else if (IsServer(from) || IsMe(from))
+		source = COMMAND_SOURCE_SERVER;
+	else
+		source = COMMAND_SOURCE_REMOTE;
+
+	/* The command may be deleted by its own handler (eg: a REHASH
+	 * that unloads the module of the command), so remember the name.
+	 */
+	strlcpy(cmdname, cmptr->cmd, sizeof(cmdname));
+	deleted = commands_deleted;
+
+#ifdef DEBUGMODE
 	then = clock();
+#endif
+	start = profile_time_ns();
 	if (cmptr->flags & CMD_ALIAS)
 	{
 		(*cmptr->aliasfunc) (from, mtags, i, para, cmptr->cmd);
@@ -513,7 +565,14 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, char *ch)
 		else
 			(*cmptr->overriders->func) (cmptr->overriders, from, mtags, i, para);
 	}
-	if (!IsDead(cptr))
+	took = profile_time_ns() - start;
+	if ((deleted != commands_deleted) && (find_command_simple(cmdname) != cmptr))
+		cmptr = NULL; /* gone */
+	if (cmptr)
+		profile_add(&cmptr->profile[source], took);
+	loop_blame("command", cmdname, took);
+#ifdef DEBUGMODE
+	if (!IsDead(cptr) && cmptr)
 	{
 		ticks = (clock() - then);
 		if (IsServer(cptr))
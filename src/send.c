@@ -38,6 +38,44 @@ static int vmakebuf_local_withprefix(char *buf, size_t buflen, Client *from, con
 static char sendbuf[2048];
 static char sendbuf2[4096];
 
+/** Recipient classes for sendto_channel(). Every recipient within
+ * the same class gets the exact same line (apart from message tags),
+ * so the line only needs to be rendered once per class.
+ */
+#define BCAST_LOCAL		0	/**< Local users: prefix is expanded to nick!user@host */
+#define BCAST_REMOTE		1	/**< Remote users and server links: line as-is */
+#define BCAST_CLASSES		2
+#define BCAST_TAG_SLOTS		4	/**< Number of distinct message tag strings to cache per class */
+
+/** A rendered line including message tags */
+typedef struct BroadcastSlot {
+	char used;
+	char mtags[500];	/**< The message tag string (without @) */
+	int len;
+	char line[1024];	/**< "@<mtags> <body>" */
+	dbufshared *shared;	/**< The line as queued in the sendQ's, once it is queued */
+} BroadcastSlot;
+
+/** A rendered line for one recipient class */
+typedef struct BroadcastClass {
+	int bodylen;		/**< Length of body, 0 means: not rendered yet */
+	char body[2048];	/**< The line without message tags, including CR+LF */
+	dbufshared *shared;	/**< The body as queued in the sendQ's, once it is queued */
+	int nextslot;
+	BroadcastSlot slot[BCAST_TAG_SLOTS];
+} BroadcastClass;
+
+static BroadcastClass bcast[BCAST_CLASSES];
+
+/** A HOOKTYPE_PACKET hook that replaces the line by a shared payload
+ * (eg: a websocket frame that is sent to many clients) sets this,
+ * so the payload is queued by reference instead of being copied.
+ * The hook must point the line to packet_out_shared->data.
+ */
+MODVAR dbufshared *packet_out_shared = NULL;
+
+static void sendbufto_one_real(Client *to, char *msg, unsigned int quick, dbufshared **shared);
+
 /** This is used to ensure no duplicate messages are sent
  * to the same server uplink/direction. In send functions
  * that deliver to multiple users or servers the value is
@@ -63,6 +101,7 @@ int dead_socket(Client *to, char *notice)
 {
 	DBufClear(&to->local->recvQ);
 	DBufClear(&to->local->sendQ);
+	tls_worker_sendq_cleared(to);
 
 	if (IsDeadSocket(to))
 		return -1; /* already pending to be closed */
@@ -96,32 +135,73 @@ void send_queued_cb(int fd, int revents, void *data)
 	send_queued(to);
 }
 
+/** Maximum number of bytes to hand to SSL_write() at once,
+ * this is the maximum size of a TLS record.
+ */
+#define SEND_TLS_RECORD_MAX	16384
+
+/** Maximum number of sendQ blocks to write with one writev() */
+#ifndef _WIN32
+ #ifdef IOV_MAX
+  #define SEND_IOV_MAX		IOV_MAX
+ #else
+  #define SEND_IOV_MAX		16
+ #endif
+#endif
+
 /** This function is called when queued data might be ready to be
  * sent to the client. It is called from the event loop and also
  * a couple of other places (such as when closing the connection).
+ * For plaintext connections the sendQ is written with a single
+ * writev() call, and the same goes for SSL/TLS connections where the
+ * kernel does the encryption (kTLS). For other SSL/TLS connections
+ * the sendQ blocks are combined into TLS records of up to 16K, rather
+ * than doing one write (and one record) per block.
  */
 int send_queued(Client *to)
 {
 	int  len, rlen;
-	dbufbuf *block;
+	char *data;
 	int want_read;
+	static char sendqbuf[SEND_TLS_RECORD_MAX];
+#ifndef _WIN32
+	static struct iovec iov[SEND_IOV_MAX];
+	int iovcnt;
+	size_t iovlen;
+#endif
 
 	/* We NEVER write to dead sockets. */
 	if (IsDeadSocket(to))
 		return -1;
 
+	/* Encryption is done by a TLS worker thread */
+	if (to->local->tlsw)
+		return tls_worker_send_queued(to);
+
 	while (DBufLength(&to->local->sendQ) > 0)
 	{
-		block = container_of(to->local->sendQ.dbuf_list.next, dbufbuf, dbuf_node);
-		len = block->size;
-
 		/* Deliver it and check for fatal error.. */
-		if ((rlen = deliver_it(to, block->data, len, &want_read)) < 0)
+#ifndef _WIN32
+		if (!IsTLS(to) || !to->local->ssl || tls_kernel_send(to->local->ssl))
+		{
+			iovcnt = dbuf_map_iovec(&to->local->sendQ, iov, SEND_IOV_MAX, &iovlen);
+			len = iovlen;
+			want_read = 0;
+			rlen = deliver_it_iov(to, iov, iovcnt);
+		} else
+#endif
+		{
+			len = dbuf_map(&to->local->sendQ, sendqbuf, sizeof(sendqbuf), &data);
+			rlen = deliver_it(to, data, len, &want_read);
+		}
+		ircstats.is_sqcalls++;
+		if (rlen < 0)
 		{
 			char buf[256];
 			snprintf(buf, 256, "Write error: %s", STRERROR(ERRNO));
 			return dead_socket(to, buf);
 		}
+		ircstats.is_sqbytes += rlen;
 		dbuf_delete(&to->local->sendQ, rlen);
 		to->local->lastsq = DBufLength(&to->local->sendQ) / 1024;
 		if (want_read)
@@ -143,6 +223,7 @@ int send_queued(Client *to)
 		if (rlen < len)
 		{
 			/* incomplete write due to EWOULDBLOCK, reschedule */
+			fd_wouldblock(to->local->fd, FD_SELECT_WRITE);
 			fd_setselect(to->local->fd, FD_SELECT_WRITE, send_queued_cb, to);
 			break;
 		}
@@ -155,12 +236,50 @@ int send_queued(Client *to)
 	return (IsDeadSocket(to)) ? -1 : 0;
 }
 
-/** Mark "to" with "there is data to be send" */
+/** Clients that have data in their sendQ that still has to be written,
+ * see mark_data_to_send() and flush_marked_clients().
+ */
+static LIST_HEAD(send_list);
+
+/** Mark "to" with "there is data to be send".
+ * The data is written by flush_marked_clients() at the end of this
+ * iteration of the main loop, so a client that is sent several lines
+ * gets them with one write.
+ */
 void mark_data_to_send(Client *to)
 {
-	if (!IsDeadSocket(to) && (to->local->fd >= 0) && (DBufLength(&to->local->sendQ) > 0))
+	if (!IsDeadSocket(to) && (to->local->fd >= 0) && (DBufLength(&to->local->sendQ) > 0) &&
+	    list_empty(&to->send_node))
 	{
-		fd_setselect(to->local->fd, FD_SELECT_WRITE, send_queued_cb, to);
+		list_add_tail(&to->send_node, &send_list);
+	}
+}
+
+/** Write the sendQ of all clients marked by mark_data_to_send().
+ * This is called from the main loop, right before waiting for I/O.
+ * We write directly and only ask to be notified of the socket being
+ * writable if the write could not be completed (see send_queued()).
+ */
+void flush_marked_clients(void)
+{
+	Client *to;
+
+	while (!list_empty(&send_list))
+	{
+		to = list_first_entry(&send_list, Client, send_node);
+		list_del_init(&to->send_node);
+
+		if (IsDeadSocket(to) || (to->local->fd < 0))
+			continue;
+
+		/* Already waiting for the socket to become writable
+		 * (eg: after a partial write), send_queued() will be
+		 * called when it is.
+		 */
+		if (fd_table[to->local->fd].write_callback)
+			continue;
+
+		send_queued(to);
 	}
 }
 
@@ -225,10 +344,24 @@ void vsendto_one(Client *to, MessageTag *mtags, const char *pattern, va_list vl)
  *   effects not mentioned here.
  */
 void sendbufto_one(Client *to, char *msg, unsigned int quick)
+{
+	sendbufto_one_real(to, msg, quick, NULL);
+}
+
+/** Send a line buffer to the client, possibly by reference.
+ * This is the actual implementation of sendbufto_one().
+ * If 'shared' is non-NULL then 'msg' is a line that is sent to
+ * multiple clients (and 'quick' must be set). Unless a hook changed
+ * the line for this particular client, it is queued as a reference
+ * to *shared rather than copied. *shared is created on first use,
+ * the caller is responsible for releasing it afterwards.
+ */
+static void sendbufto_one_real(Client *to, char *msg, unsigned int quick, dbufshared **shared)
 {
 	int len;
-	Hook *h;
+	Hook *h, **hp;
 	Client *intended_to = to;
+	char *orig_msg = msg;
 	
 	Debug((DEBUG_ERROR, "Sending [%s] to %s", msg, to->name));
 
@@ -315,9 +448,10 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 		return;
 	}
 
-	for (h = Hooks[HOOKTYPE_PACKET]; h; h = h->next)
+	packet_out_shared = NULL;
+	for_each_hook(HOOKTYPE_PACKET, h, hp)
 	{
-		(*(h->func.intfunc))(&me, to, intended_to, &msg, &len);
+		ProfileHook(h, (*(h->func.intfunc))(&me, to, intended_to, &msg, &len));
 		if (!msg)
 			return;
 	}
@@ -344,7 +478,22 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 		return;
 	}
 
-	dbuf_put(&to->local->sendQ, msg, len);
+	if (packet_out_shared && (msg == packet_out_shared->data) && ((size_t)len == packet_out_shared->size))
+	{
+		/* A hook replaced the line by a shared payload of its own */
+		dbuf_put_shared(&to->local->sendQ, packet_out_shared);
+	} else
+	if (shared && (msg == orig_msg) && (len == quick))
+	{
+		/* Queue a reference to the payload that is shared with
+		 * the other recipients, rather than copying it.
+		 */
+		if (!*shared)
+			*shared = dbuf_shared_new(msg, len);
+		dbuf_put_shared(&to->local->sendQ, *shared);
+	} else {
+		dbuf_put(&to->local->sendQ, msg, len);
+	}
 
 	/*
 	 * Update statistics. The following is slightly incorrect
@@ -362,6 +511,115 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 	mark_data_to_send(to);
 }
 
+/** Reset the broadcast cache, called at the start of each sendto_channel() */
+static void bcast_reset(void)
+{
+	int i, j;
+
+	for (i = 0; i < BCAST_CLASSES; i++)
+	{
+		bcast[i].bodylen = 0;
+		bcast[i].nextslot = 0;
+		for (j = 0; j < BCAST_TAG_SLOTS; j++)
+			bcast[i].slot[j].used = 0;
+	}
+}
+
+/** Drop our references to the shared payloads, called at the end of
+ * each sendto_channel(). The sendQ's of the recipients hold their own.
+ */
+static void bcast_release(void)
+{
+	int i, j;
+
+	for (i = 0; i < BCAST_CLASSES; i++)
+	{
+		if (bcast[i].shared)
+		{
+			dbuf_shared_release(bcast[i].shared);
+			bcast[i].shared = NULL;
+		}
+		for (j = 0; j < BCAST_TAG_SLOTS; j++)
+		{
+			if (bcast[i].slot[j].shared)
+			{
+				dbuf_shared_release(bcast[i].slot[j].shared);
+				bcast[i].slot[j].shared = NULL;
+			}
+		}
+	}
+}
+
+/** Render the line (without message tags) for a recipient class */
+static void bcast_render_body(BroadcastClass *c, int cls, Client *from, const char *pattern, va_list vl)
+{
+	int len;
+
+	if (cls == BCAST_LOCAL)
+	{
+		c->bodylen = vmakebuf_local_withprefix(c->body, sizeof(c->body), from, pattern, vl);
+	} else {
+		ircvsnprintf(c->body, sizeof(c->body), pattern, vl);
+		len = strlen(c->body);
+		ADD_CRLF(c->body, len);
+		c->bodylen = len;
+	}
+	ircstats.is_bcrender++;
+}
+
+/** Deliver the already rendered line of class 'c' to 'to'.
+ * The message tag string is the only thing that can differ between
+ * recipients of the same class (it depends on the CAPs of 'to'),
+ * so we keep a couple of fully built lines around, keyed by that string.
+ */
+static void bcast_deliver(Client *to, BroadcastClass *c, MessageTag *mtags)
+{
+	char *mtags_str = mtags ? mtags_to_string(mtags, to) : NULL;
+	BroadcastSlot *s;
+	int i;
+
+	ircstats.is_bcdeliver++;
+
+	if (BadPtr(mtags_str))
+	{
+		/* Simple message without message tags */
+		sendbufto_one_real(to, c->body, c->bodylen, &c->shared);
+		return;
+	}
+
+	if (strlen(mtags_str) >= sizeof(s->mtags))
+	{
+		/* Oversized, let sendbufto_one() deal with it (it will reject it) */
+		snprintf(sendbuf2, sizeof(sendbuf2), "@%s %s", mtags_str, c->body);
+		sendbufto_one(to, sendbuf2, 0);
+		return;
+	}
+
+	for (i = 0; i < BCAST_TAG_SLOTS; i++)
+	{
+		s = &c->slot[i];
+		if (s->used && !strcmp(s->mtags, mtags_str))
+		{
+			sendbufto_one_real(to, s->line, s->len, &s->shared);
+			return;
+		}
+	}
+
+	/* Not seen yet in this broadcast, (re)use the next slot */
+	s = &c->slot[c->nextslot];
+	c->nextslot = (c->nextslot + 1) % BCAST_TAG_SLOTS;
+	if (s->shared)
+	{
+		dbuf_shared_release(s->shared);
+		s->shared = NULL;
+	}
+	strlcpy(s->mtags, mtags_str, sizeof(s->mtags));
+	s->len = snprintf(s->line, sizeof(s->line), "@%s %s", mtags_str, c->body);
+	s->used = 1;
+	ircstats.is_bcrender++;
+	sendbufto_one_real(to, s->line, s->len, &s->shared);
+}
+
 /** A single function to send data to a channel.
  * Previously there were 6, now there is 1. This means there
  * are likely some parameters that you will pass as NULL or 0
@@ -389,8 +647,10 @@ void sendto_channel(Channel *channel, Client *from, Client *skip,
 	va_list vl;
 	Member *lp;
 	Client *acptr;
+	BroadcastClass *c;
 
 	++current_serial;
+	bcast_reset();
 	for (lp = channel->members; lp; lp = lp->next)
 	{
 		acptr = lp->client;
@@ -430,9 +690,14 @@ good:
 			/* Local client */
 			if (sendflags & SEND_LOCAL)
 			{
-				va_start(vl, pattern);
-				vsendto_prefix_one(acptr, from, mtags, pattern, vl);
-				va_end(vl);
+				c = &bcast[BCAST_LOCAL];
+				if (!c->bodylen)
+				{
+					va_start(vl, pattern);
+					bcast_render_body(c, BCAST_LOCAL, from, pattern, vl);
+					va_end(vl);
+				}
+				bcast_deliver(acptr, c, mtags);
 			}
 		}
 		else
@@ -443,9 +708,14 @@ good:
 				/* Message already sent to remote link? */
 				if (acptr->direction->local->serial != current_serial)
 				{
-					va_start(vl, pattern);
-					vsendto_prefix_one(acptr, from, mtags, pattern, vl);
-					va_end(vl);
+					c = &bcast[BCAST_REMOTE];
+					if (!c->bodylen)
+					{
+						va_start(vl, pattern);
+						bcast_render_body(c, BCAST_REMOTE, from, pattern, vl);
+						va_end(vl);
+					}
+					bcast_deliver(acptr, c, mtags);
 
 					acptr->direction->local->serial = current_serial;
 				}
@@ -470,15 +740,22 @@ good:
 					continue; /* still obey this rule.. */
 				if (acptr->direction->local->serial != current_serial)
 				{
-					va_start(vl, pattern);
-					vsendto_prefix_one(acptr, from, mtags, pattern, vl);
-					va_end(vl);
+					c = &bcast[BCAST_REMOTE];
+					if (!c->bodylen)
+					{
+						va_start(vl, pattern);
+						bcast_render_body(c, BCAST_REMOTE, from, pattern, vl);
+						va_end(vl);
+					}
+					bcast_deliver(acptr, c, mtags);
 
 					acptr->direction->local->serial = current_serial;
 				}
 			}
 		}
 	}
+
+	bcast_release();
 }
 
 /** Send a message to a server, taking into account server options if needed.
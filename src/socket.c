@@ -35,8 +35,9 @@ void completed_connection(int, int, void *);
 void set_sock_opts(int, Client *, int);
 void set_ipv6_opts(int);
 void close_listener(ConfigItem_listen *listener);
-static char readbuf[BUFSIZE];
 char zlinebuf[BUFSIZE];
+static int handshakes_active = 0; /**< TLS handshakes in progress, see set::max-concurrent-handshakes */
+static LIST_HEAD(handshake_queue); /**< TLS handshakes waiting for a free slot */
 extern char *version;
 MODVAR time_t last_allinuse = 0;
 
@@ -45,6 +46,7 @@ extern void url_do_transfers_async(void);
 #endif
 
 void start_of_normal_client_handshake(Client *client);
+static int start_tls_accept(Client *client);
 void proceed_normal_client_handshake(Client *client, struct hostent *he);
 
 /** Close all connections - only used when we terminate the server (eg: /DIE or SIGTERM) */
@@ -181,6 +183,8 @@ static void listener_accept(int listener_fd, int revents, void *data)
 
 	if ((cli_fd = fd_accept(listener->fd)) < 0)
 	{
+		if (ERRNO == P_EWOULDBLOCK)
+			fd_wouldblock(listener_fd, FD_SELECT_READ);
 		if ((ERRNO != P_EWOULDBLOCK) && (ERRNO != P_ECONNABORTED))
 		{
 			/* Trouble! accept() returns a strange error.
@@ -200,6 +204,7 @@ static void listener_accept(int listener_fd, int revents, void *data)
 
 	ircstats.is_ac++;
 
+	fd_setedge(cli_fd);
 	set_sock_opts(cli_fd, NULL, listener->ipv6);
 
 	if ((++OpenFiles >= maxclients) || (cli_fd >= maxclients))
@@ -308,6 +313,7 @@ int unreal_listen(ConfigItem_listen *listener, char *ip, int port, int ipv6)
 	}
 #endif
 
+	fd_setedge(listener->fd);
 	fd_setselect(listener->fd, FD_SELECT_READ, listener_accept, listener);
 
 	return 0;
@@ -581,6 +587,9 @@ void completed_connection(int fd, int revents, void *data)
 	Client *client = data;
 	ConfigItem_link *aconf = client->serv ? client->serv->conf : NULL;
 
+	/* We are connected, from now on writes are handled by send_queued() */
+	fd_setselect(fd, FD_SELECT_WRITE, NULL, client);
+
 	if (IsHandshake(client))
 	{
 		/* Due to delayed ircd_SSL_connect call */
@@ -666,6 +675,8 @@ void close_connection(Client *client)
 	 */
 	unrealdns_delreq_bycptr(client);
 
+	handshake_release(client);
+
 	if (client->local->authfd >= 0)
 	{
 		fd_close(client->local->authfd);
@@ -676,13 +687,19 @@ void close_connection(Client *client)
 	if (client->local->fd >= 0)
 	{
 		send_queued(client);
-		if (IsTLS(client) && client->local->ssl) {
-			SSL_set_shutdown(client->local->ssl, SSL_RECEIVED_SHUTDOWN);
-			SSL_smart_shutdown(client->local->ssl);
-			SSL_free(client->local->ssl);
-			client->local->ssl = NULL;
+		if (client->local->tlsw)
+		{
+			/* The worker does the shutdown, and the socket is closed after that */
+			tls_worker_detach(client);
+		} else {
+			if (IsTLS(client) && client->local->ssl) {
+				SSL_set_shutdown(client->local->ssl, SSL_RECEIVED_SHUTDOWN);
+				SSL_smart_shutdown(client->local->ssl);
+				SSL_free(client->local->ssl);
+				client->local->ssl = NULL;
+			}
+			fd_close(client->local->fd);
 		}
-		fd_close(client->local->fd);
 		client->local->fd = -2;
 		--OpenFiles;
 		DBufClear(&client->local->sendQ);
@@ -877,6 +894,7 @@ Client *add_connection(ConfigItem_listen *listener, int fd)
 		}
 refuse_client:
 			ircstats.is_ref++;
+			handshake_release(client);
 			client->local->fd = -2;
 			free_client(client);
 			fd_close(fd);
@@ -920,38 +938,103 @@ refuse_client:
 	client->status = CLIENT_STATUS_UNKNOWN;
 
 	list_add(&client->lclient_node, &unknown_list);
+	schedule_ping_check(client, TStime() + iConf.handshake_timeout + 1);
 
 	if ((listener->options & LISTENER_TLS) && ctx_server)
 	{
-		SSL_CTX *ctx = listener->ssl_ctx ? listener->ssl_ctx : ctx_server;
-
-		if (ctx)
+		SetTLSAcceptHandshake(client);
+		if (iConf.max_concurrent_handshakes && (handshakes_active >= iConf.max_concurrent_handshakes))
 		{
-			SetTLSAcceptHandshake(client);
-			Debug((DEBUG_DEBUG, "Starting TLS accept handshake for %s", client->local->sockhost));
-			if ((client->local->ssl = SSL_new(ctx)) == NULL)
-			{
-				goto refuse_client;
-			}
-			SetTLS(client);
-			SSL_set_fd(client->local->ssl, fd);
-			SSL_set_nonblocking(client->local->ssl);
-			SSL_set_ex_data(client->local->ssl, ssl_client_index, client);
-			if (!ircd_SSL_accept(client, fd))
-			{
-				Debug((DEBUG_DEBUG, "Failed TLS accept handshake in instance 1: %s", client->local->sockhost));
-				SSL_set_shutdown(client->local->ssl, SSL_RECEIVED_SHUTDOWN);
-				SSL_smart_shutdown(client->local->ssl);
-				SSL_free(client->local->ssl);
-				goto refuse_client;
-			}
+			/* Wait for a free slot, see handshake_admit() */
+			Debug((DEBUG_DEBUG, "Queueing TLS accept handshake for %s", client->local->sockhost));
+			list_add_tail(&client->handshake_node, &handshake_queue);
+			return client;
 		}
+		if (!start_tls_accept(client))
+			goto refuse_client;
 	}
 	else
 		start_of_normal_client_handshake(client);
 	return client;
 }
 
+/** Start the TLS handshake of a client that connected to a TLS port.
+ * The handshake is done by a TLS worker thread if set::tls-workers is set,
+ * otherwise by ircd_SSL_accept().
+ * @param client	The client
+ * @returns 1 if the handshake is in progress (or failed already, in which
+ *          case the client is marked as a dead socket), 0 if it could not
+ *          be started.
+ */
+static int start_tls_accept(Client *client)
+{
+	ConfigItem_listen *listener = client->local->listener;
+	SSL_CTX *ctx = (listener && listener->ssl_ctx) ? listener->ssl_ctx : ctx_server;
+	int fd = client->local->fd;
+
+	if (!ctx)
+		return 0;
+
+	Debug((DEBUG_DEBUG, "Starting TLS accept handshake for %s", client->local->sockhost));
+	if ((client->local->ssl = SSL_new(ctx)) == NULL)
+		return 0;
+	SetTLS(client);
+	SSL_set_fd(client->local->ssl, fd);
+	SSL_set_nonblocking(client->local->ssl);
+	SSL_set_ex_data(client->local->ssl, ssl_client_index, client);
+
+	client->local->handshake_slot = 1;
+	handshakes_active++;
+
+	if (tls_worker_accept(client))
+		return 1;
+
+	if (!ircd_SSL_accept(client, fd))
+	{
+		Debug((DEBUG_DEBUG, "Failed TLS accept handshake in instance 1: %s", client->local->sockhost));
+		SSL_set_shutdown(client->local->ssl, SSL_RECEIVED_SHUTDOWN);
+		SSL_smart_shutdown(client->local->ssl);
+		SSL_free(client->local->ssl);
+		client->local->ssl = NULL;
+		handshake_release(client);
+		return 0;
+	}
+	return 1;
+}
+
+/** Free the set::max-concurrent-handshakes slot of a client, or take
+ * it off the queue if it was still waiting for one. This is called when
+ * the TLS handshake has finished and when the connection is closed.
+ * @param client	The client
+ */
+void handshake_release(Client *client)
+{
+	if (!list_empty(&client->handshake_node))
+		list_del_init(&client->handshake_node);
+	if (client->local->handshake_slot)
+	{
+		client->local->handshake_slot = 0;
+		handshakes_active--;
+	}
+}
+
+/** Start queued TLS handshakes, as far as set::max-concurrent-handshakes allows.
+ * This is called from the main loop, after the I/O has been processed.
+ */
+void handshake_admit(void)
+{
+	Client *client;
+
+	while (!list_empty(&handshake_queue) &&
+	       (!iConf.max_concurrent_handshakes || (handshakes_active < iConf.max_concurrent_handshakes)))
+	{
+		client = list_first_entry(&handshake_queue, Client, handshake_node);
+		list_del_init(&client->handshake_node);
+		if (!start_tls_accept(client))
+			dead_socket(client, "Could not start TLS handshake");
+	}
+}
+
 static int dns_special_flag = 0; /* This is for an "interesting" race condition  very ugly. */
 
 /** Start of normal client handshake - DNS and ident lookups, etc.
@@ -964,6 +1047,11 @@ void start_of_normal_client_handshake(Client *client)
 	struct hostent *he;
 
 	client->status = CLIENT_STATUS_UNKNOWN; /* reset, to be sure (TLS handshake has ended) */
+	handshake_release(client);
+	/* The TLS handshake may have asked for write-ready notification,
+	 * from now on writes are handled by send_queued().
+	 */
+	fd_setselect(client->local->fd, FD_SELECT_WRITE, NULL, client);
 
 	RunHook(HOOKTYPE_HANDSHAKE, client);
 
@@ -1019,10 +1107,13 @@ void proceed_normal_client_handshake(Client *client, struct hostent *he)
 void read_packet(int fd, int revents, void *data)
 {
 	Client *client = data;
-	int length = 0;
+	int length = 0, readlen;
 	time_t now = TStime();
-	Hook *h;
+	Hook *h, **hp;
 	int processdata;
+	char *readbuf;
+	dbufbuf *block;
+	size_t room;
 
 	/* Don't read from dead sockets */
 	if (IsDeadSocket(client))
@@ -1034,18 +1125,37 @@ void read_packet(int fd, int revents, void *data)
 	SET_ERRNO(0);
 
 	fd_setselect(fd, FD_SELECT_READ, read_packet, client);
-	/* Restore handling of writes towards send_queued_cb(), since
-	 * it may be overwritten in an earlier call to read_packet(),
-	 * to handle (SSL) writes by read_packet(), see below under
-	 * SSL_ERROR_WANT_WRITE.
+	/* Writes are done directly by send_queued(), which only asks for
+	 * write-ready notification if it could not write everything.
+	 * If we are here because of SSL_ERROR_WANT_WRITE (see below),
+	 * then drop that and have any pending sendQ written at the end
+	 * of this loop.
 	 */
-	fd_setselect(fd, FD_SELECT_WRITE, send_queued_cb, client);
+	if (fd_table[fd].write_callback == read_packet)
+	{
+		fd_setselect(fd, FD_SELECT_WRITE, NULL, client);
+		mark_data_to_send(client);
+	}
+
+	/* Established TLS connections of users may be handed
+	 * over to a TLS worker thread (set::tls-workers).
+	 */
+	if (client->local->ssl && !client->local->tlsw && iConf.tls_workers)
+		tls_worker_attach(client);
+	if (client->local->tlsw)
+	{
+		tls_worker_read_packet(client);
+		return;
+	}
 
 	while (1)
 	{
+		/* Read straight into the recvQ, that saves a copy */
+		readbuf = dbuf_reserve(&client->local->recvQ, &block, &room);
+
 		if (IsTLS(client) && client->local->ssl != NULL)
 		{
-			length = SSL_read(client->local->ssl, readbuf, sizeof(readbuf));
+			length = SSL_read(client->local->ssl, readbuf, room);
 
 			if (length < 0)
 			{
@@ -1054,12 +1164,14 @@ void read_packet(int fd, int revents, void *data)
 				switch (err)
 				{
 				case SSL_ERROR_WANT_WRITE:
+					fd_wouldblock(fd, FD_SELECT_WRITE);
 					fd_setselect(fd, FD_SELECT_READ, NULL, client);
 					fd_setselect(fd, FD_SELECT_WRITE, read_packet, client);
 					length = -1;
 					SET_ERRNO(P_EWOULDBLOCK);
 					break;
 				case SSL_ERROR_WANT_READ:
+					fd_wouldblock(fd, FD_SELECT_READ);
 					fd_setselect(fd, FD_SELECT_READ, read_packet, client);
 					length = -1;
 					SET_ERRNO(P_EWOULDBLOCK);
@@ -1079,10 +1191,16 @@ void read_packet(int fd, int revents, void *data)
 			}
 		}
 		else
-			length = recv(client->local->fd, readbuf, sizeof(readbuf), 0);
+		{
+			length = recv(client->local->fd, readbuf, room, 0);
+			/* A short read means we drained the socket */
+			if ((length < (int)room) && ((length > 0) || (ERRNO == P_EWOULDBLOCK) || (ERRNO == P_EAGAIN)))
+				fd_wouldblock(fd, FD_SELECT_READ);
+		}
 
 		if (length <= 0)
 		{
+			dbuf_commit(&client->local->recvQ, block, 0);
 			if (length < 0 && ((ERRNO == P_EWOULDBLOCK) || (ERRNO == P_EAGAIN) || (ERRNO == P_EINTR)))
 				return;
 
@@ -1101,71 +1219,112 @@ void read_packet(int fd, int revents, void *data)
 
 		ClearPingWarning(client);
 
+		/* Note that 'readbuf' points into the recvQ here, so hooks
+		 * that take the data must copy it before calling process_packet().
+		 */
+		readlen = length;
 		processdata = 1;
-		for (h = Hooks[HOOKTYPE_RAWPACKET_IN]; h; h = h->next)
+		for_each_hook(HOOKTYPE_RAWPACKET_IN, h, hp)
 		{
-			processdata = (*(h->func.intfunc))(client, readbuf, &length);
+			ProfileHook(h, processdata = (*(h->func.intfunc))(client, readbuf, &length));
 			if (processdata < 0)
+			{
+				dbuf_commit(&client->local->recvQ, block, 0);
 				return;
+			}
 		}
 
-		if (processdata && !process_packet(client, readbuf, length, 0))
+		dbuf_commit(&client->local->recvQ, block, processdata ? length : 0);
+		if (processdata && !process_recvq(client, 0))
 			return;
 
 		/* bail on short read! */
-		if (length < sizeof(readbuf))
+		if (readlen < room)
 			return;
 	}
 }
 
-/** Process input from clients that may have been deliberately delayed due to fake lag */
+/** Process data that was read from a client by someone else than
+ * read_packet(), such as a TLS worker thread (src/tls_worker.c).
+ * This does what read_packet() does with the data it reads itself.
+ * @param client	The client
+ * @param readbuf	The data
+ * @param length	The length of the data
+ * @returns 1 in normal circumstances, 0 if the client was killed.
+ */
+int read_packet_process(Client *client, char *readbuf, int length)
+{
+	Hook *h, **hp;
+	int processdata = 1;
+
+	client->local->lasttime = TStime();
+	if (client->local->lasttime > client->local->since)
+		client->local->since = client->local->lasttime;
+	ClearPingSent(client);
+	ClearPingWarning(client);
+
+	for_each_hook(HOOKTYPE_RAWPACKET_IN, h, hp)
+	{
+		ProfileHook(h, processdata = (*(h->func.intfunc))(client, readbuf, &length));
+		if (processdata < 0)
+			return 0;
+	}
+
+	if (processdata && !process_packet(client, readbuf, length, 0))
+		return 0;
+
+	return 1;
+}
+
+/** Clients with data in their recvQ that could not be processed yet,
+ * eg: due to fake lag. See queue_client_input().
+ */
+static LIST_HEAD(input_queue);
+
+/** Remember that the client has input that has to be processed later.
+ * This is called by parse_client_queued() when it has to stop
+ * processing the recvQ, eg: because the client is (fake) lagged.
+ * @param client	The client
+ * @param when		The time at which processing can continue
+ */
+void queue_client_input(Client *client, time_t when)
+{
+	client->local->input_wake = when;
+	if (list_empty(&client->input_node))
+		list_add_tail(&client->input_node, &input_queue);
+}
+
+/** Process input from clients that may have been deliberately delayed due to fake lag.
+ * Only the clients on the input_queue are looked at, see queue_client_input().
+ */
 void process_clients(void)
 {
 	Client *client;
-        
-	/* Problem:
-	 * When processing a client, that current client may exit due to eg QUIT.
-	 * Similarly, current->next may be killed due to /KILL.
-	 * When a client is killed, in the past we were not allowed to touch it anymore
-	 * so that was a bit problematic. Now we can touch current->next, but it may
-	 * have been removed from the lclient_list or unknown_list.
-	 * In other words, current->next->next may be NULL even though there are more
-	 * clients on the list.
-	 * This is why the whole thing is wrapped in an additional do { } while() loop
-	 * to make sure we re-run the list if we ended prematurely.
-	 * We could use some kind of 'tagging' to mark already processed clients.
-	 * However, parse_client_queued() already takes care not to read (fake) lagged
-	 * clients, and we don't actually read/recv anything in the meantime, so clients
-	 * in the beginning of the list won't benefit, they won't get higher prio.
-	 * Another alternative is not to run the loop again, but that WOULD be
-	 * unfair to clients later in the list which wouldn't be processed then
-	 * under a heavy (kill) load scenario.
-	 * I think the chosen solution is best, though it remains silly. -- Syzop
+	LIST_HEAD(work);
+
+	/* Clients may be killed while we process others, and parse_client_queued()
+	 * may put them back on the queue. So we take the queue as it is now and
+	 * pop one client at a time, that way we never hold on to a pointer to
+	 * another client. free_client() removes the client from the queue.
 	 */
+	list_splice_init(&input_queue, &work);
+	while (!list_empty(&work))
+	{
+		client = list_first_entry(&work, Client, input_node);
+		list_del_init(&client->input_node);
 
-	do {
-		list_for_each_entry(client, &lclient_list, lclient_node)
-		{
-			if ((client->local->fd >= 0) && DBufLength(&client->local->recvQ) && !IsDead(client))
-			{
-				parse_client_queued(client);
-				if (IsDead(client))
-					break;
-			}
-		}
-	} while(&client->lclient_node != &lclient_list);
+		if ((client->local->fd < 0) || IsDead(client))
+			continue;
 
-	do {
-		list_for_each_entry(client, &unknown_list, lclient_node)
+		if (client->local->input_wake > TStime())
 		{
-			if ((client->local->fd >= 0) && DBufLength(&client->local->recvQ) && !IsDead(client))
-			{
-				parse_client_queued(client);
-				if (IsDead(client) || (client->status > CLIENT_STATUS_UNKNOWN))
-					break;
-			}
+			/* Not yet, put it back */
+			list_add_tail(&client->input_node, &input_queue);
+			continue;
 		}
-	} while(&client->lclient_node != &unknown_list);
+
+		parse_client_queued(client);
+	}
 }
 
 /** Returns 4 if 'str' is a valid IPv4 address
@@ -1280,6 +1439,7 @@ int connect_server(ConfigItem_link *aconf, Client *by, struct hostent *hp)
 	SetOutgoing(client);
 	irccounts.unknown++;
 	list_add(&client->lclient_node, &unknown_list);
+	schedule_ping_check(client, TStime() + iConf.handshake_timeout + 1);
 	set_sockhost(client, aconf->outgoing.hostname);
 	add_client_to_list(client);
 
@@ -1325,6 +1485,7 @@ static int connect_server_helper(ConfigItem_link *aconf, Client *client)
 		report_baderror("opening stream socket to server %s:%s", client);
 		return 0;
 	}
+	fd_setedge(client->local->fd);
 	if (++OpenFiles >= maxclients)
 	{
 		sendto_ops_and_log("No more connections allowed (%s)", client->name);
@@ -1367,6 +1528,26 @@ int ipv6_capable(void)
 	return 1; /* YES */
 }
 
+static int deliver_it_result(Client *client, int retval);
+
+/** Check if we may write to this client at all, see deliver_it() */
+static int deliver_it_sane(Client *client, char *str, int len)
+{
+	if (IsDeadSocket(client) || (!IsServer(client) && !IsUser(client)
+	    && !IsHandshake(client) 
+	    && !IsTLSHandshake(client)
+ 
+	    && !IsUnknown(client)))
+	{
+		/* Note: 'str' may point into a shared buffer, so don't modify it */
+		sendto_ops
+		    ("* * * DEBUG ERROR * * * !!! Calling deliver_it() for %s, status %d %s, with message: %.*s",
+		    client->name, client->status, IsDeadSocket(client) ? "DEAD" : "", len, str);
+		return 0;
+	}
+	return 1;
+}
+
 /** Attempt to deliver data to a client.
  * This function is only called from send_queued() and will deal
  * with sending to the SSL/TLS or plaintext connection.
@@ -1393,18 +1574,8 @@ int deliver_it(Client *client, char *str, int len, int *want_read)
 
 	*want_read = 0;
 
-	if (IsDeadSocket(client) || (!IsServer(client) && !IsUser(client)
-	    && !IsHandshake(client) 
-	    && !IsTLSHandshake(client)
- 
-	    && !IsUnknown(client)))
-	{
-		str[len] = '\0';
-		sendto_ops
-		    ("* * * DEBUG ERROR * * * !!! Calling deliver_it() for %s, status %d %s, with message: %s",
-		    client->name, client->status, IsDeadSocket(client) ? "DEAD" : "", str);
+	if (!deliver_it_sane(client, str, len))
 		return -1;
-	}
 
 	if (IsTLS(client) && client->local->ssl != NULL)
 	{
@@ -1416,6 +1587,7 @@ int deliver_it(Client *client, char *str, int len, int *want_read)
 			{
 			case SSL_ERROR_WANT_READ:
 				SET_ERRNO(P_EWOULDBLOCK);
+				fd_wouldblock(client->local->fd, FD_SELECT_READ);
 				*want_read = 1;
 				return 0;
 			case SSL_ERROR_WANT_WRITE:
@@ -1434,6 +1606,39 @@ int deliver_it(Client *client, char *str, int len, int *want_read)
 	}
 	else
 		retval = send(client->local->fd, str, len, 0);
+
+	return deliver_it_result(client, retval);
+}
+
+#ifndef _WIN32
+/** Attempt to deliver multiple buffers to a plaintext client at once.
+ * This is the writev() variant of deliver_it(), used by send_queued()
+ * to flush many sendQ blocks with a single system call.
+ * It may not be used for SSL/TLS connections, unless the kernel
+ * does the encryption (see tls_kernel_send()).
+ * @param client The client
+ * @param iov    The buffers to send
+ * @param iovcnt The number of buffers in 'iov'
+ * @returns Same as deliver_it()
+ */
+int deliver_it_iov(Client *client, struct iovec *iov, int iovcnt)
+{
+	int retval;
+
+	if (!deliver_it_sane(client, iov[0].iov_base, iov[0].iov_len))
+		return -1;
+
+	retval = writev(client->local->fd, iov, iovcnt);
+
+	return deliver_it_result(client, retval);
+}
+#endif
+
+/** Map the result of a write to a client to the deliver_it()
+ * return value and update the traffic statistics.
+ */
+static int deliver_it_result(Client *client, int retval)
+{
 	/*
 	   ** Convert WOULDBLOCK to a return of "0 bytes moved". This
 	   ** should occur only if socket was non-blocking. Note, that
@@ -1446,10 +1651,15 @@ int deliver_it(Client *client, char *str, int len, int *want_read)
 	if (retval < 0 && (errno == EWOULDBLOCK || errno == EAGAIN ||
 	    errno == ENOBUFS))
 # else
-		if (retval < 0 && (WSAGetLastError() == WSAEWOULDBLOCK ||
-		    WSAGetLastError() == WSAENOBUFS))
+	if (retval < 0 && (WSAGetLastError() == WSAEWOULDBLOCK ||
+	    WSAGetLastError() == WSAENOBUFS))
 # endif
-			retval = 0;
+	{
+		/* ENOBUFS is not about this socket, so no fd_wouldblock() for that one */
+		if (ERRNO == P_EWOULDBLOCK || ERRNO == P_EAGAIN)
+			fd_wouldblock(client->local->fd, FD_SELECT_WRITE);
+		retval = 0;
+	}
 
 	if (retval > 0)
 	{
@@ -24,6 +24,11 @@
 
 #include "unrealircd.h"
 #include "openssl_hostname_validation.h"
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #ifdef _WIN32
 #define IDC_PASS                        1166
@@ -37,6 +42,7 @@ extern HWND hwIRCDWnd;
 #define SAFE_SSL_CONNECT 4
 
 static int fatal_ssl_error(int ssl_error, int where, int my_errno, Client *client);
+static int fatal_ssl_error_ex(int ssl_error, int where, int my_errno, unsigned long additional_errno, Client *client);
 extern int cipher_check(SSL_CTX *ctx, char **errstr);
 extern int certificate_quality_check(SSL_CTX *ctx, char **errstr);
 
@@ -53,6 +59,35 @@ typedef struct {
 
 MODVAR int ssl_client_index = 0;
 
+/** Number of session ticket keys we keep: the current one, the previous
+ * one (tickets made with it are still accepted) and a spare slot, which
+ * is the only one that is written to when rotating.
+ */
+#define TLS_TICKET_KEYS		3
+
+/** A key to encrypt and authenticate session tickets with */
+typedef struct TicketKey {
+	unsigned char name[16];		/**< Identifies the key, sent along with the ticket */
+	unsigned char aes_key[32];	/**< Key for encrypting the ticket */
+	unsigned char hmac_key[32];	/**< Key for the HMAC of the ticket */
+	time_t created;			/**< Time the key was created (0 if the slot is unused) */
+} TicketKey;
+
+/** Session ticket keys. These don't belong to any SSL_CTX, so clients
+ * can still resume their session after a REHASH -tls.
+ */
+static TicketKey ticket_keys[TLS_TICKET_KEYS];
+static int ticket_key_current = -1;
+
+/* Session tickets are also handled by the TLS worker threads (set::tls-workers) */
+#ifdef _WIN32
+ #define ticket_key_get()	(ticket_key_current)
+ #define ticket_key_set(x)	(ticket_key_current = (x))
+#else
+ #define ticket_key_get()	__atomic_load_n(&ticket_key_current, __ATOMIC_ACQUIRE)
+ #define ticket_key_set(x)	__atomic_store_n(&ticket_key_current, (x), __ATOMIC_RELEASE)
+#endif
+
 #define CHK_SSL(err) if ((err)==-1) { ERR_print_errors_fp(stderr); }
 #ifdef _WIN32
 /** Ask SSL private key password (Windows GUI mode only) */
@@ -341,6 +376,129 @@ void disable_ssl_protocols(SSL_CTX *ctx, TLSOptions *tlsoptions)
 #endif
 }
 
+/** Create a new session ticket key and make it the current one.
+ * @returns 1 on success, 0 on failure (the old key stays in use then).
+ */
+static int new_ticket_key(void)
+{
+	int next = (ticket_key_get() + 1) % TLS_TICKET_KEYS;
+	TicketKey *key = &ticket_keys[next];
+
+	if ((RAND_bytes(key->name, sizeof(key->name)) <= 0) ||
+	    (RAND_bytes(key->aes_key, sizeof(key->aes_key)) <= 0) ||
+	    (RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) <= 0))
+	{
+		return 0;
+	}
+	key->created = TStime();
+	ticket_key_set(next);
+	return 1;
+}
+
+/** Rotate the session ticket keys every tls::session-timeout */
+EVENT(tls_rotate_ticket_keys)
+{
+	int cur = ticket_key_get();
+
+	if ((cur < 0) || (TStime() - ticket_keys[cur].created >= iConf.tls_options->session_timeout))
+		new_ticket_key();
+}
+
+/** Find the key for a session ticket and set up the cipher for it.
+ * @returns Same as the session ticket key callback.
+ */
+static int ticket_key_cipher(unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, int enc, TicketKey **keyp)
+{
+	int cur = ticket_key_get();
+	TicketKey *key;
+	int i;
+
+	if (cur < 0)
+		return enc ? -1 : 0;
+
+	if (enc)
+	{
+		key = &ticket_keys[cur];
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+			return -1;
+		memcpy(key_name, key->name, sizeof(key->name));
+		if (!EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv))
+			return -1;
+		*keyp = key;
+		return 1;
+	}
+
+	/* Tickets made with the previous key are accepted too,
+	 * but the client gets a new ticket then (return value 2).
+	 */
+	for (i = 0; i < 2; i++)
+	{
+		key = &ticket_keys[(cur + TLS_TICKET_KEYS - i) % TLS_TICKET_KEYS];
+		if (key->created && !memcmp(key_name, key->name, sizeof(key->name)))
+		{
+			if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv))
+				return -1;
+			*keyp = key;
+			return i ? 2 : 1;
+		}
+	}
+
+	return 0; /* unknown or expired key: do a full handshake */
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/** Set up the HMAC of a session ticket */
+static int ticket_key_hmac(EVP_MAC_CTX *hctx, TicketKey *key)
+{
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_octet_string(OSSL_MAC_PARAM_KEY, key->hmac_key, sizeof(key->hmac_key)),
+		OSSL_PARAM_utf8_string(OSSL_MAC_PARAM_DIGEST, "sha256", 6),
+		OSSL_PARAM_END
+	};
+
+	return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+/** Session ticket key callback */
+static int ssl_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+	TicketKey *key;
+	int ret;
+
+	if ((ret = ticket_key_cipher(key_name, iv, ctx, enc, &key)) <= 0)
+		return ret;
+
+	if (!ticket_key_hmac(hctx, key))
+		return -1;
+
+	return ret;
+}
+#else
+/** Session ticket key callback */
+static int ssl_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+{
+	TicketKey *key;
+	int ret;
+
+	if ((ret = ticket_key_cipher(key_name, iv, ctx, enc, &key)) <= 0)
+		return ret;
+
+	if (!HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL))
+		return -1;
+
+	return ret;
+}
+#endif
+
+/** Count a finished TLS handshake of an incoming connection (STATS T) */
+static void tls_count_handshake(SSL *ssl)
+{
+	if (SSL_session_reused(ssl))
+		ircstats.is_tlsresumed++;
+	else
+		ircstats.is_tlsfull++;
+}
+
 /** Initialize SSL/TLS context
  * @param tlsoptions	The ::tls-options configuration
  * @param server	Set to 1 if we are initializing a server, 0 for client.
@@ -376,11 +534,50 @@ SSL_CTX *init_ctx(TLSOptions *tlsoptions, int server)
 		 */
 		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER|SSL_VERIFY_CLIENT_ONCE | (tlsoptions->options & TLSFLAG_FAILIFNOCERT ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0), ssl_verify_callback);
 	}
-	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	if (server && (tlsoptions->session_cache_size > 0))
+	{
+		/* Clients that reconnect (eg: after a netsplit) can resume
+		 * their session, which skips the expensive part of the handshake.
+		 */
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx, tlsoptions->session_cache_size);
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	}
+	if (server)
+	{
+		/* Needed for resumption when asking for client certificates */
+		SSL_CTX_set_session_id_context(ctx, (unsigned char *)"UnrealIRCd", 10);
+		SSL_CTX_set_timeout(ctx, tlsoptions->session_timeout);
+	}
 #ifndef SSL_OP_NO_TICKET
  #error "Your system has an outdated OpenSSL version. Please upgrade OpenSSL."
 #endif
-	SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	if (!server || (tlsoptions->options & TLSFLAG_NOSESSIONTICKETS))
+	{
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	} else {
+		/* Our own ticket keys, which are rotated, see tls_rotate_ticket_keys() */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ssl_ticket_key_callback);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, ssl_ticket_key_callback);
+#endif
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L) && !defined(LIBRESSL_VERSION_NUMBER)
+		/* TLSv1.3 sends two tickets by default, one is enough to reconnect */
+		SSL_CTX_set_num_tickets(ctx, 1);
+#endif
+	}
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Have the kernel encrypt and decrypt the records once the handshake is
+	 * done. OpenSSL falls back to doing it itself if the kernel can't,
+	 * eg: if the tls module is not loaded or for an unsupported cipher.
+	 */
+	if (tlsoptions->options & TLSFLAG_KTLS)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	/* send_queued() may retry a write from a different buffer */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
 	if (!setup_dh_params(ctx))
 		goto fail;
@@ -543,6 +740,8 @@ int early_init_ssl(void)
 int init_ssl(void)
 {
 	/* SSL preliminaries. We keep the certificate and key with the context. */
+	if ((ticket_key_get() < 0) && !new_ticket_key())
+		return 0;
 	ctx_server = init_ctx(iConf.tls_options, 1);
 	if (!ctx_server)
 		return 0;
@@ -561,6 +760,9 @@ void reinit_ssl(Client *client)
 	ConfigItem_sni *sni;
 	ConfigItem_link *link;
 
+	/* TLS worker threads may be looking at the sni { } contexts */
+	tls_worker_quiesce();
+
 	if (!client)
 		mylog("Reloading all SSL related data (./unrealircd reloadtls)");
 	else if (IsUser(client))
@@ -658,6 +860,19 @@ char *tls_get_cipher(SSL *ssl)
 	return buf;
 }
 
+/** Check if the kernel encrypts the data that we send (kTLS).
+ * If so, data can be written to the socket directly, without SSL_write().
+ * See the 'kernel-tls' option in set::tls::options.
+ */
+int tls_kernel_send(SSL *ssl)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+	return 0;
+#endif
+}
+
 /** Get the applicable ::tls-options block for this local client,
  * which may be defined in the link block, listen block, or set block.
  */
@@ -736,6 +951,38 @@ void ircd_SSL_client_handshake(int fd, int revents, void *data)
 
 }
 
+/** Check if a client on an SSL/TLS-only port started talking plaintext IRC.
+ * If so, then tell the client what is wrong and reject the connection.
+ * @param client	The client
+ * @param buf		The first data received from the client
+ * @param n		Number of bytes in buf
+ * @returns 1 if the connection is rejected (the client is marked as a dead socket),
+ *          0 if not.
+ */
+int tls_check_plaintext(Client *client, char *buf, int n)
+{
+	char *msg;
+
+	if ((n >= 8) && !strncmp(buf, "STARTTLS", 8))
+	{
+		msg = "ERROR :STARTTLS received but this is an SSL-only port. Check your connect settings. "
+		      "If this is a server linking in then add 'ssl' in your link::outgoing::options block.\r\n";
+	}
+	else if (((n >= 4) && (!strncmp(buf, "USER", 4) || !strncmp(buf, "NICK", 4) || !strncmp(buf, "PASS", 4) || !strncmp(buf, "CAP ", 4))) ||
+	         ((n >= 8) && (!strncmp(buf, "PROTOCTL", 8) || !strncmp(buf, "SERVER", 6))))
+	{
+		msg = "ERROR :NON-SSL command received on SSL-only port. Check your connection settings.\r\n";
+	}
+	else
+	{
+		return 0;
+	}
+
+	(void)send(client->local->fd, msg, strlen(msg), 0);
+	fatal_ssl_error(SSL_ERROR_SSL, SAFE_SSL_ACCEPT, ERRNO, client);
+	return 1;
+}
+
 /** Called by I/O engine to (re)try accepting an SSL/TLS connection */
 static void ircd_SSL_accept_retry(int fd, int revents, void *data)
 {
@@ -755,31 +1002,8 @@ int ircd_SSL_accept(Client *client, int fd)
 		int n;
 		
 		n = recv(fd, buf, sizeof(buf), MSG_PEEK);
-		if ((n >= 8) && !strncmp(buf, "STARTTLS", 8))
-		{
-			char buf[512];
-			snprintf(buf, sizeof(buf),
-				"ERROR :STARTTLS received but this is an SSL-only port. Check your connect settings. "
-				"If this is a server linking in then add 'ssl' in your link::outgoing::options block.\r\n");
-			(void)send(fd, buf, strlen(buf), 0);
-			return fatal_ssl_error(SSL_ERROR_SSL, SAFE_SSL_ACCEPT, ERRNO, client);
-		}
-		if ((n >= 4) && (!strncmp(buf, "USER", 4) || !strncmp(buf, "NICK", 4) || !strncmp(buf, "PASS", 4) || !strncmp(buf, "CAP ", 4)))
-		{
-			char buf[512];
-			snprintf(buf, sizeof(buf),
-				"ERROR :NON-SSL command received on SSL-only port. Check your connection settings.\r\n");
-			(void)send(fd, buf, strlen(buf), 0);
-			return fatal_ssl_error(SSL_ERROR_SSL, SAFE_SSL_ACCEPT, ERRNO, client);
-		}
-		if ((n >= 8) && (!strncmp(buf, "PROTOCTL", 8) || !strncmp(buf, "SERVER", 6)))
-		{
-			char buf[512];
-			snprintf(buf, sizeof(buf),
-				"ERROR :NON-SSL command received on SSL-only port. Check your connection settings.\r\n");
-			(void)send(fd, buf, strlen(buf), 0);
-			return fatal_ssl_error(SSL_ERROR_SSL, SAFE_SSL_ACCEPT, ERRNO, client);
-		}
+		if (tls_check_plaintext(client, buf, n))
+			return -1;
 		if (n > 0)
 			SetNextCall(client);
 	}
@@ -791,14 +1015,18 @@ int ircd_SSL_accept(Client *client, int fd)
 			case SSL_ERROR_SYSCALL:
 				if (ERRNO == P_EINTR || ERRNO == P_EWOULDBLOCK || ERRNO == P_EAGAIN)
 				{
+					if (ERRNO != P_EINTR)
+						fd_wouldblock(fd, FD_SELECT_READ);
 					return 1;
 				}
 				return fatal_ssl_error(ssl_err, SAFE_SSL_ACCEPT, ERRNO, client);
 			case SSL_ERROR_WANT_READ:
+				fd_wouldblock(fd, FD_SELECT_READ);
 				fd_setselect(fd, FD_SELECT_READ, ircd_SSL_accept_retry, client);
 				fd_setselect(fd, FD_SELECT_WRITE, NULL, client);
 				return 1;
 			case SSL_ERROR_WANT_WRITE:
+				fd_wouldblock(fd, FD_SELECT_WRITE);
 				fd_setselect(fd, FD_SELECT_READ, NULL, client);
 				fd_setselect(fd, FD_SELECT_WRITE, ircd_SSL_accept_retry, client);
 				return 1;
@@ -809,11 +1037,41 @@ int ircd_SSL_accept(Client *client, int fd)
 		return -1;
 	}
 
+	tls_count_handshake(client->local->ssl);
 	start_of_normal_client_handshake(client);
 
 	return 1;
 }
 
+/** Called when the TLS handshake of a client was done by a TLS worker thread.
+ * The SNI servername is only recorded here, since the worker can't touch
+ * the client (see tls_worker_accept()).
+ * @param client	The client
+ */
+void ircd_SSL_accept_done(Client *client)
+{
+	char *name = (char *)SSL_get_servername(client->local->ssl, TLSEXT_NAMETYPE_host_name);
+
+	SSL_set_ex_data(client->local->ssl, ssl_client_index, client);
+	if (name && find_sni(name))
+		set_client_sni_name(client->local->ssl, name);
+
+	tls_count_handshake(client->local->ssl);
+	start_of_normal_client_handshake(client);
+}
+
+/** Report a failed TLS handshake that was done by a TLS worker thread.
+ * The worker has to pass the OpenSSL error, as the error queue is per-thread.
+ * @param client		The client
+ * @param ssl_error		The error as from SSL_get_error()
+ * @param additional_errno	The error as from ERR_get_error()
+ * @returns Always -1, the client is marked as a dead socket.
+ */
+int ircd_SSL_accept_failed(Client *client, int ssl_error, unsigned long additional_errno)
+{
+	return fatal_ssl_error_ex(ssl_error, SAFE_SSL_ACCEPT, 0, additional_errno, client);
+}
+
 /** Called by the I/O engine to (re)try to connect to a remote host */
 static void ircd_SSL_connect_retry(int fd, int revents, void *data)
 {
@@ -837,15 +1095,19 @@ int ircd_SSL_connect(Client *client, int fd)
 					/* Hmmm. This implementation is different than in ircd_SSL_accept().
 					 * One of them must be wrong -- better check! (TODO)
 					 */
+					if (ERRNO != P_EINTR)
+						fd_wouldblock(fd, FD_SELECT_READ|FD_SELECT_WRITE);
 					fd_setselect(fd, FD_SELECT_READ|FD_SELECT_WRITE, ircd_SSL_connect_retry, client);
 					return 0;
 				}
 				return fatal_ssl_error(ssl_err, SAFE_SSL_CONNECT, ERRNO, client);
 			case SSL_ERROR_WANT_READ:
+				fd_wouldblock(fd, FD_SELECT_READ);
 				fd_setselect(fd, FD_SELECT_READ, ircd_SSL_connect_retry, client);
 				fd_setselect(fd, FD_SELECT_WRITE, NULL, client);
 				return 0;
 			case SSL_ERROR_WANT_WRITE:
+				fd_wouldblock(fd, FD_SELECT_WRITE);
 				fd_setselect(fd, FD_SELECT_READ, NULL, client);
 				fd_setselect(fd, FD_SELECT_WRITE, ircd_SSL_connect_retry, client);
 				return 0;
@@ -885,11 +1147,19 @@ int SSL_smart_shutdown(SSL *ssl)
  * @param client The client the error is associated with.
  */
 static int fatal_ssl_error(int ssl_error, int where, int my_errno, Client *client)
+{
+	return fatal_ssl_error_ex(ssl_error, where, my_errno, ERR_get_error(), client);
+}
+
+/**
+ * Report a fatal SSL error and disconnect the associated client.
+ * Same as fatal_ssl_error() but with the error from ERR_get_error() passed by the caller.
+ */
+static int fatal_ssl_error_ex(int ssl_error, int where, int my_errno, unsigned long additional_errno, Client *client)
 {
 	/* don`t alter ERRNO */
 	int errtmp = ERRNO;
 	char *ssl_errstr, *ssl_func;
-	unsigned long additional_errno = ERR_get_error();
 	char additional_info[256];
 	const char *one, *two;
 
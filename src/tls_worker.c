@@ -0,0 +1,1018 @@
+/*
+ * UnrealIRCd, src/tls_worker.c
+ * TLS worker threads
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 1, or (at your option)
+ *   any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ * @brief TLS worker threads.
+ *
+ * When set::tls-workers is non-zero, the encryption and decryption of
+ * established TLS connections of users is done by a pool of worker
+ * threads, so it is no longer limited to the CPU core of the main thread.
+ * The same goes for the TLS handshake of incoming connections, which is
+ * the expensive part of a connection storm.
+ *
+ * Everything else stays in the main thread, including all socket I/O:
+ * it reads the ciphertext from the socket and hands it to a worker, which
+ * feeds it to OpenSSL through a memory BIO and returns the plaintext.
+ * Similarly, the main thread hands a copy of the start of the sendQ to the
+ * worker, which returns the encrypted data that is then written out.
+ *
+ * A connection is always handled by the same worker, and the main thread
+ * does not touch the SSL object of a connection after handing it over.
+ * Jobs are passed through single-producer/single-consumer rings, so no
+ * locks are involved.
+ *
+ * After a handshake the connection goes back to the main thread (once
+ * everything the worker produced is sent), so registration, certificate
+ * checks and the handshake hooks work as usual. Only users are handed
+ * over again, server links stay in the main thread.
+ */
+
+#include "unrealircd.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+/* Renegotiation can't be allowed in the threads (see tls_worker_attach) */
+#if defined(SSL_OP_NO_RENEGOTIATION) && (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+ #define TLS_WORKERS_SUPPORTED
+#endif
+#endif
+
+#ifdef TLS_WORKERS_SUPPORTED
+
+/** Maximum number of bytes read from the socket at once */
+#define TLSW_READ_SIZE		16384
+
+/** Maximum number of bytes of the sendQ that is encrypted at once */
+#define TLSW_WRITE_SIZE		65536
+
+/** Maximum number of blocks to write with one writev() */
+#define TLSW_IOV_MAX		16
+
+#define TLSW_JOB_READ		1	/**< Decrypt data read from the socket */
+#define TLSW_JOB_WRITE		2	/**< Encrypt data from the sendQ */
+#define TLSW_JOB_CLOSE		3	/**< Send a close_notify and free the SSL object */
+
+#define TLSW_HANDSHAKE_NONE	0	/**< Not in a handshake (established connection) */
+#define TLSW_HANDSHAKE_BUSY	1	/**< Handshake in progress */
+#define TLSW_HANDSHAKE_DONE	2	/**< Handshake done, waiting to go back to the main thread */
+
+typedef struct TLSWorker TLSWorker;
+typedef struct TLSWorkerJob TLSWorkerJob;
+typedef struct TLSWorkerRing TLSWorkerRing;
+
+/** A job for a worker thread. Once queued, the worker owns the job
+ * (and the SSL object), until the main thread takes it back from
+ * the 'done' ring.
+ */
+struct TLSWorkerJob {
+	int type;		/**< One of TLSW_JOB_* */
+	int busy;		/**< Job is handed to the worker (main thread only) */
+	TLSWorkerConn *conn;	/**< Connection the job belongs to */
+	char *in;		/**< Ciphertext (READ) or plaintext (WRITE, CLOSE) */
+	size_t inlen;		/**< Length of 'in' */
+	char *out;		/**< Decrypted data (READ) */
+	size_t outlen;		/**< Length of 'out' */
+	char *cipher;		/**< Data to be sent to the client */
+	size_t cipherlen;	/**< Length of 'cipher' */
+	int more;		/**< READ: OpenSSL has more data for us */
+	int error;		/**< Fatal TLS error, or EOF */
+	int handshake;		/**< READ: job counts towards tls_handshake_jobs */
+	int handshake_done;	/**< READ: the handshake finished during this job */
+	int ssl_error;		/**< READ: SSL_get_error() of a failed handshake */
+	unsigned long err;	/**< READ: ERR_get_error() of a failed handshake */
+};
+
+/** A connection that is handled by a worker thread */
+struct TLSWorkerConn {
+	Client *client;		/**< The client, NULL once the client is gone */
+	SSL *ssl;		/**< The SSL object, only used by the worker */
+	int fd;			/**< Socket, which is closed by us after a detach */
+	TLSWorker *worker;	/**< The worker thread */
+	TLSWorkerJob readjob;	/**< Decryption job */
+	TLSWorkerJob writejob;	/**< Encryption job */
+	TLSWorkerJob closejob;	/**< Close job */
+	dbuf cipherQ;		/**< Encrypted data that still has to be sent */
+	size_t sendq_busy;	/**< Bytes at the start of the sendQ that the write job is encrypting */
+	int handshake;		/**< One of TLSW_HANDSHAKE_* */
+	dbuf earlyQ;		/**< Data that arrived along with the end of the handshake */
+};
+
+/** Single-producer/single-consumer ring of jobs */
+struct TLSWorkerRing {
+	TLSWorkerJob **jobs;	/**< Slots */
+	unsigned int mask;	/**< Number of slots minus one */
+	unsigned int head;	/**< Next slot to fill, only written by the producer */
+	char pad[64];		/**< Keep head and tail on different cache lines */
+	unsigned int tail;	/**< Next slot to take, only written by the consumer */
+};
+
+/** A worker thread */
+struct TLSWorker {
+	int num;		/**< Number of this worker (0, 1, ..) */
+	pthread_t thread;	/**< The thread */
+	int wakeup[2];		/**< Pipe to wake up the thread */
+	int sleeping;		/**< Thread is waiting for the pipe */
+	TLSWorkerRing jobs;	/**< Jobs for the thread */
+	TLSWorkerRing done;	/**< Finished jobs, for the main thread */
+	int connections;	/**< Number of connections (main thread only) */
+	unsigned long long stat_jobs;		/**< Jobs done (thread only) */
+	unsigned long long stat_handshakes;	/**< Handshakes done (thread only) */
+	unsigned long long stat_bytes_in;	/**< Bytes decrypted (thread only) */
+	unsigned long long stat_bytes_out;	/**< Bytes encrypted (thread only) */
+};
+
+static TLSWorker *tls_workers[TLS_WORKERS_MAX];
+static int num_tls_workers = 0;
+static int tls_workers_tried = 0;
+static int tls_worker_notify[2] = { -1, -1 };
+static int tls_worker_notify_pending = 0;
+static int tls_handshake_jobs = 0;
+
+/* Forward declarations */
+static void tls_worker_done(int fd, int revents, void *data);
+
+static void ring_init(TLSWorkerRing *ring)
+{
+	unsigned int size = 1;
+
+	/* A connection has at most 3 jobs in progress and there can't be
+	 * more connections than fds, so the rings can never overflow.
+	 */
+	while (size < MAXCONNECTIONS * 3)
+		size <<= 1;
+	ring->jobs = safe_alloc(sizeof(TLSWorkerJob *) * size);
+	ring->mask = size - 1;
+}
+
+static void ring_push(TLSWorkerRing *ring, TLSWorkerJob *job)
+{
+	unsigned int head = ring->head;
+
+	ring->jobs[head & ring->mask] = job;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static TLSWorkerJob *ring_pop(TLSWorkerRing *ring)
+{
+	unsigned int tail = ring->tail;
+	TLSWorkerJob *job;
+
+	if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	job = ring->jobs[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return job;
+}
+
+static int ring_count(TLSWorkerRing *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+}
+
+/** Collect everything OpenSSL wants to send (worker thread) */
+static void tls_worker_collect(TLSWorkerJob *job, SSL *ssl)
+{
+	BIO *wbio = SSL_get_wbio(ssl);
+	size_t len = BIO_ctrl_pending(wbio);
+	int n;
+
+	if (len == 0)
+		return;
+	job->cipher = safe_alloc(len);
+	n = BIO_read(wbio, job->cipher, len);
+	job->cipherlen = (n > 0) ? n : 0;
+}
+
+/** Encrypt the input of a job (worker thread) */
+static void tls_worker_encrypt(TLSWorker *worker, TLSWorkerJob *job, SSL *ssl)
+{
+	int n;
+
+	/* With a memory BIO this always writes everything, unless there is an error */
+	n = SSL_write(ssl, job->in, job->inlen);
+	if (n <= 0)
+		job->error = 1;
+	else
+		__atomic_store_n(&worker->stat_bytes_out, worker->stat_bytes_out + n, __ATOMIC_RELAXED);
+}
+
+/** Continue the TLS handshake (worker thread).
+ * The error is stored in the job, as the OpenSSL error queue is per-thread.
+ * @returns 1 if the handshake is done, 0 if not (yet).
+ */
+static int tls_worker_handshake(TLSWorker *worker, TLSWorkerJob *job, SSL *ssl)
+{
+	int n;
+
+	n = SSL_do_handshake(ssl);
+	if (n == 1)
+	{
+		job->handshake_done = 1;
+		__atomic_store_n(&worker->stat_handshakes, worker->stat_handshakes + 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	job->ssl_error = SSL_get_error(ssl, n);
+	if (job->ssl_error != SSL_ERROR_WANT_READ)
+	{
+		job->err = ERR_get_error();
+		job->error = 1;
+	}
+	return 0;
+}
+
+/** Decrypt the input of a job (worker thread) */
+static void tls_worker_decrypt(TLSWorker *worker, TLSWorkerJob *job, SSL *ssl)
+{
+	size_t size = job->inlen + TLSW_READ_SIZE;
+	int n;
+
+	job->out = safe_alloc(size);
+	while (job->outlen < size)
+	{
+		n = SSL_read(ssl, job->out + job->outlen, size - job->outlen);
+		if (n > 0)
+		{
+			job->outlen += n;
+			continue;
+		}
+		if (SSL_get_error(ssl, n) != SSL_ERROR_WANT_READ)
+			job->error = 1; /* closed or a fatal error */
+		return;
+	}
+
+	/* Buffer is full, let the main thread come back for the rest */
+	job->more = 1;
+}
+
+/** Do a job (worker thread) */
+static void tls_worker_do_job(TLSWorker *worker, TLSWorkerJob *job)
+{
+	SSL *ssl = job->conn->ssl;
+
+	ERR_clear_error();
+	switch (job->type)
+	{
+		case TLSW_JOB_READ:
+			if (job->inlen)
+			{
+				BIO_write(SSL_get_rbio(ssl), job->in, job->inlen);
+				__atomic_store_n(&worker->stat_bytes_in, worker->stat_bytes_in + job->inlen, __ATOMIC_RELAXED);
+			}
+			/* Data that follows the end of the handshake is decrypted right away */
+			if (SSL_is_init_finished(ssl) || tls_worker_handshake(worker, job, ssl))
+				tls_worker_decrypt(worker, job, ssl);
+			break;
+		case TLSW_JOB_WRITE:
+			tls_worker_encrypt(worker, job, ssl);
+			break;
+		case TLSW_JOB_CLOSE:
+			if (job->inlen)
+				tls_worker_encrypt(worker, job, ssl);
+			SSL_set_shutdown(ssl, SSL_RECEIVED_SHUTDOWN);
+			SSL_smart_shutdown(ssl);
+			break;
+	}
+
+	/* This also picks up anything OpenSSL wants to send after reading,
+	 * such as a TLS 1.3 key update.
+	 */
+	tls_worker_collect(job, ssl);
+
+	if (job->type == TLSW_JOB_CLOSE)
+	{
+		SSL_free(ssl);
+		job->conn->ssl = NULL;
+	}
+	__atomic_store_n(&worker->stat_jobs, worker->stat_jobs + 1, __ATOMIC_RELAXED);
+	if (job->handshake)
+		__atomic_sub_fetch(&tls_handshake_jobs, 1, __ATOMIC_RELEASE);
+}
+
+/** Tell the main thread that there are finished jobs (worker thread) */
+static void tls_worker_notify_main(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_exchange_n(&tls_worker_notify_pending, 1, __ATOMIC_SEQ_CST))
+	{
+		if (write(tls_worker_notify[1], "", 1) < 0)
+		{
+			/* The pipe is full, so the main thread will wake up anyway */
+		}
+	}
+}
+
+/** Main function of a worker thread */
+static void *tls_worker_thread(void *arg)
+{
+	TLSWorker *worker = arg;
+	TLSWorkerJob *job;
+	char buf[64];
+
+	while (1)
+	{
+		while ((job = ring_pop(&worker->jobs)))
+		{
+			tls_worker_do_job(worker, job);
+			ring_push(&worker->done, job);
+			tls_worker_notify_main();
+		}
+
+		/* Nothing to do. The flag is set before checking the ring
+		 * again, so any job that is added from now on either shows
+		 * up here or makes the main thread write to the pipe.
+		 */
+		__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (ring_count(&worker->jobs) > 0)
+		{
+			__atomic_store_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (read(worker->wakeup[0], buf, sizeof(buf)) < 0)
+		{
+			/* EINTR, just check again */
+		}
+	}
+
+	return NULL;
+}
+
+/** Hand a job to the worker thread of the connection */
+static void tls_worker_submit(TLSWorkerJob *job)
+{
+	TLSWorker *worker = job->conn->worker;
+
+	job->busy = 1;
+	if ((job->type == TLSW_JOB_READ) && (job->conn->handshake == TLSW_HANDSHAKE_BUSY))
+	{
+		/* See tls_worker_quiesce() */
+		job->handshake = 1;
+		__atomic_add_fetch(&tls_handshake_jobs, 1, __ATOMIC_SEQ_CST);
+	}
+	ring_push(&worker->jobs, job);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST))
+	{
+		if (write(worker->wakeup[1], "", 1) < 0)
+		{
+			/* The pipe is full, so the thread will wake up anyway */
+		}
+	}
+}
+
+/** Set both ends of a pipe to non-blocking mode */
+static int tls_worker_pipe(int *fds, int nonblocking_read)
+{
+	if (pipe(fds) < 0)
+		return 0;
+	if ((nonblocking_read && (fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0)) ||
+	    (fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0))
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return 0;
+	}
+	return 1;
+}
+
+/** Start worker threads, until there are set::tls-workers of them */
+static void tls_workers_start(void)
+{
+	TLSWorker *worker;
+	sigset_t all, old;
+	int err;
+
+	tls_workers_tried = iConf.tls_workers;
+
+	if (tls_worker_notify[0] == -1)
+	{
+		if (!tls_worker_pipe(tls_worker_notify, 1))
+		{
+			ircd_log(LOG_ERROR, "Could not start TLS workers: pipe() failed: %s", strerror(errno));
+			sendto_realops("Could not start TLS workers: pipe() failed: %s", strerror(errno));
+			return;
+		}
+		fd_open(tls_worker_notify[0], "TLS worker notification pipe");
+		fd_setselect(tls_worker_notify[0], FD_SELECT_READ, tls_worker_done, NULL);
+	}
+
+	/* Signals are for the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	while (num_tls_workers < iConf.tls_workers)
+	{
+		worker = safe_alloc(sizeof(TLSWorker));
+		worker->num = num_tls_workers;
+		if (!tls_worker_pipe(worker->wakeup, 0))
+		{
+			ircd_log(LOG_ERROR, "Could not start TLS worker: pipe() failed: %s", strerror(errno));
+			sendto_realops("Could not start TLS worker: pipe() failed: %s", strerror(errno));
+			safe_free(worker);
+			break;
+		}
+		ring_init(&worker->jobs);
+		ring_init(&worker->done);
+		if ((err = pthread_create(&worker->thread, NULL, tls_worker_thread, worker)))
+		{
+			ircd_log(LOG_ERROR, "Could not start TLS worker: %s", strerror(err));
+			sendto_realops("Could not start TLS worker: %s", strerror(err));
+			close(worker->wakeup[0]);
+			close(worker->wakeup[1]);
+			safe_free(worker->jobs.jobs);
+			safe_free(worker->done.jobs);
+			safe_free(worker);
+			break;
+		}
+		tls_workers[num_tls_workers++] = worker;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/** Pick a worker thread and set up a connection for it.
+ * The SSL object gets memory BIOs, the socket is not touched by OpenSSL anymore.
+ * @param client	The client
+ * @returns The connection, or NULL if no worker thread is available.
+ */
+static TLSWorkerConn *tls_worker_new(Client *client)
+{
+	TLSWorkerConn *conn;
+	TLSWorker *worker = NULL;
+	SSL *ssl = client->local->ssl;
+	BIO *rbio, *wbio;
+	int i;
+
+	if ((num_tls_workers < iConf.tls_workers) && (tls_workers_tried != iConf.tls_workers))
+		tls_workers_start();
+
+	/* Pick the least busy worker. If set::tls-workers was lowered
+	 * then the workers above it finish their current connections
+	 * but don't get new ones.
+	 */
+	for (i = 0; (i < num_tls_workers) && (i < iConf.tls_workers); i++)
+		if (!worker || (tls_workers[i]->connections < worker->connections))
+			worker = tls_workers[i];
+	if (!worker)
+		return NULL;
+
+	rbio = BIO_new(BIO_s_mem());
+	wbio = BIO_new(BIO_s_mem());
+	if (!rbio || !wbio)
+	{
+		if (rbio)
+			BIO_free(rbio);
+		if (wbio)
+			BIO_free(wbio);
+		return NULL;
+	}
+	/* An empty read BIO means 'try again later', not EOF */
+	BIO_set_mem_eof_return(rbio, -1);
+	SSL_set_bio(ssl, rbio, wbio);
+
+	conn = safe_alloc(sizeof(TLSWorkerConn));
+	conn->client = client;
+	conn->ssl = ssl;
+	conn->fd = client->local->fd;
+	conn->worker = worker;
+	conn->readjob.type = TLSW_JOB_READ;
+	conn->readjob.conn = conn;
+	conn->writejob.type = TLSW_JOB_WRITE;
+	conn->writejob.conn = conn;
+	conn->closejob.type = TLSW_JOB_CLOSE;
+	conn->closejob.conn = conn;
+	dbuf_queue_init(&conn->cipherQ);
+	dbuf_queue_init(&conn->earlyQ);
+	worker->connections++;
+	client->local->tlsw = conn;
+	return conn;
+}
+
+/** Hand the TLS connection of a client over to a worker thread.
+ * This is done for users once the handshake is done, from read_packet().
+ * @param client	The client
+ * @returns 1 if the connection is now handled by a worker thread, 0 if not.
+ */
+int tls_worker_attach(Client *client)
+{
+	TLSWorkerConn *conn;
+	SSL *ssl = client->local->ssl;
+
+	if (!IsUser(client) || !ssl || client->local->tlsw || (client->local->fd < 0) ||
+	    IsDeadSocket(client) || !SSL_is_init_finished(ssl))
+	{
+		return 0;
+	}
+
+	/* Nothing to offload if the kernel does the encryption already */
+	if (tls_kernel_send(ssl))
+		return 0;
+
+	if (!(conn = tls_worker_new(client)))
+		return 0;
+
+	/* A renegotiation would run the info callback of tls_antidos in
+	 * the thread, so refuse renegotiations instead of counting them.
+	 */
+	SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+	SSL_set_info_callback(ssl, NULL);
+
+	/* OpenSSL may have read more than just the handshake already */
+	if (SSL_has_pending(ssl))
+		tls_worker_submit(&conn->readjob);
+
+	return 1;
+}
+
+/** Have the TLS handshake of a new connection done by a worker thread.
+ * This is called when accepting a connection on a TLS port.
+ * @param client	The client, with a fresh SSL object
+ * @returns 1 if a worker thread does the handshake, 0 if not.
+ */
+int tls_worker_accept(Client *client)
+{
+	TLSWorkerConn *conn;
+
+	if (!iConf.tls_workers || !(conn = tls_worker_new(client)))
+		return 0;
+
+	conn->handshake = TLSW_HANDSHAKE_BUSY;
+	SSL_set_accept_state(conn->ssl);
+
+	/* The SNI callback runs in the thread and must not touch the client,
+	 * the servername is picked up by ircd_SSL_accept_done() instead.
+	 */
+	SSL_set_ex_data(conn->ssl, ssl_client_index, NULL);
+
+	fd_setselect(conn->fd, FD_SELECT_READ, read_packet, client);
+	return 1;
+}
+
+/** Give a connection back to the main thread after the handshake.
+ * The SSL object uses the socket again and the normal client handshake
+ * starts, after which anything the client sent along is processed.
+ * @param client	The client
+ * @returns Same as send_queued().
+ */
+static int tls_worker_handshake_finish(Client *client)
+{
+	static char buf[TLSW_READ_SIZE];
+	TLSWorkerConn *conn = client->local->tlsw;
+	SSL *ssl = conn->ssl;
+	int alive = 1;
+	size_t len;
+	char *data;
+
+	if (!SSL_set_fd(ssl, conn->fd))
+		return dead_socket(client, "TLS error");
+	SSL_set_nonblocking(ssl);
+
+	client->local->tlsw = NULL;
+	conn->client = NULL;
+	conn->ssl = NULL;
+	conn->worker->connections--;
+
+	ircd_SSL_accept_done(client);
+
+	while (alive && (DBufLength(&conn->earlyQ) > 0) && !IsDeadSocket(client))
+	{
+		len = dbuf_map(&conn->earlyQ, buf, sizeof(buf), &data);
+		if (data != buf)
+			memcpy(buf, data, len);
+		dbuf_delete(&conn->earlyQ, len);
+		alive = read_packet_process(client, buf, len);
+	}
+
+	DBufClear(&conn->earlyQ);
+	DBufClear(&conn->cipherQ);
+	safe_free(conn);
+	return alive ? 0 : -1;
+}
+
+/** Copy up to 'max' bytes from the start of the sendQ into the input of a job */
+static void tls_worker_copy_sendq(Client *client, TLSWorkerJob *job, size_t max)
+{
+	size_t len = MIN(DBufLength(&client->local->sendQ), max);
+	char *data;
+
+	if (len == 0)
+		return;
+	job->in = safe_alloc(len);
+	len = dbuf_map(&client->local->sendQ, job->in, len, &data);
+	if (data != job->in)
+		memcpy(job->in, data, len);
+	job->inlen = len;
+}
+
+/** Stop using the TLS connection of a client, called when closing the connection.
+ * The worker thread sends the remaining data and a close_notify, after which
+ * the socket is closed. The socket is removed from the fd table right away.
+ * @param client	The client
+ */
+void tls_worker_detach(Client *client)
+{
+	TLSWorkerConn *conn = client->local->tlsw;
+
+	client->local->tlsw = NULL;
+	client->local->ssl = NULL;
+	conn->client = NULL;
+
+	/* Whatever the worker is encrypting at the moment is sent already,
+	 * as far as the sendQ is concerned, then pass along what is left.
+	 */
+	dbuf_delete(&client->local->sendQ, conn->sendq_busy);
+	conn->sendq_busy = 0;
+	tls_worker_copy_sendq(client, &conn->closejob, TLSW_WRITE_SIZE);
+
+	fd_unmap(conn->fd);
+	tls_worker_submit(&conn->closejob);
+}
+
+/** Called when the sendQ of a client was cleared, eg: by dead_socket().
+ * What the write job is encrypting is no longer in the sendQ then,
+ * so it must not be deleted from it once the job is done.
+ * @param client	The client
+ */
+void tls_worker_sendq_cleared(Client *client)
+{
+	if (client->local->tlsw)
+		client->local->tlsw->sendq_busy = 0;
+}
+
+/** Read data from a client that is handled by a worker thread.
+ * This is called from read_packet().
+ * @param client	The client
+ */
+void tls_worker_read_packet(Client *client)
+{
+	static char readbuf[TLSW_READ_SIZE];
+	TLSWorkerConn *conn = client->local->tlsw;
+	TLSWorkerJob *job = &conn->readjob;
+	int fd = client->local->fd;
+	int length;
+
+	/* Only one read at a time, continue when the worker is done.
+	 * After the handshake OpenSSL reads from the socket itself.
+	 */
+	if (job->busy || (conn->handshake == TLSW_HANDSHAKE_DONE))
+	{
+		fd_setselect(fd, FD_SELECT_READ, NULL, client);
+		return;
+	}
+
+	length = recv(fd, readbuf, sizeof(readbuf), 0);
+	/* A short read means we drained the socket */
+	if ((length < (int)sizeof(readbuf)) && ((length > 0) || (ERRNO == P_EWOULDBLOCK) || (ERRNO == P_EAGAIN)))
+		fd_wouldblock(fd, FD_SELECT_READ);
+
+	if (length <= 0)
+	{
+		if (length < 0 && ((ERRNO == P_EWOULDBLOCK) || (ERRNO == P_EAGAIN) || (ERRNO == P_EINTR)))
+			return;
+
+		exit_client(client, NULL, "Read error");
+		return;
+	}
+
+	/* Someone talking plaintext IRC to a TLS port? */
+	if ((conn->handshake == TLSW_HANDSHAKE_BUSY) && !IsNextCall(client))
+	{
+		if (tls_check_plaintext(client, readbuf, length))
+			return;
+		SetNextCall(client);
+	}
+
+	job->in = safe_alloc(length);
+	memcpy(job->in, readbuf, length);
+	job->inlen = length;
+	tls_worker_submit(job);
+	fd_setselect(fd, FD_SELECT_READ, NULL, client);
+}
+
+/** Send queued data to a client that is handled by a worker thread.
+ * This is called from send_queued().
+ * @param client	The client
+ * @returns Same as send_queued().
+ */
+int tls_worker_send_queued(Client *client)
+{
+	TLSWorkerConn *conn = client->local->tlsw;
+	TLSWorkerJob *job = &conn->writejob;
+	struct iovec iov[TLSW_IOV_MAX];
+	size_t len;
+	int iovcnt, rlen;
+
+	/* First write out what is encrypted already */
+	while (DBufLength(&conn->cipherQ) > 0)
+	{
+		iovcnt = dbuf_map_iovec(&conn->cipherQ, iov, TLSW_IOV_MAX, &len);
+		rlen = deliver_it_iov(client, iov, iovcnt);
+		ircstats.is_sqcalls++;
+		if (rlen < 0)
+		{
+			char buf[256];
+			snprintf(buf, 256, "Write error: %s", STRERROR(ERRNO));
+			return dead_socket(client, buf);
+		}
+		ircstats.is_sqbytes += rlen;
+		dbuf_delete(&conn->cipherQ, rlen);
+		if (rlen < len)
+		{
+			/* incomplete write due to EWOULDBLOCK, reschedule */
+			fd_wouldblock(client->local->fd, FD_SELECT_WRITE);
+			fd_setselect(client->local->fd, FD_SELECT_WRITE, send_queued_cb, client);
+			return 0;
+		}
+	}
+
+	/* Nothing is encrypted during the handshake. Once it is done and
+	 * everything is sent, the connection goes back to the main thread.
+	 */
+	if (conn->handshake)
+	{
+		if ((conn->handshake == TLSW_HANDSHAKE_DONE) && !conn->readjob.busy && !IsClosing(client))
+			return tls_worker_handshake_finish(client);
+		fd_setselect(client->local->fd, FD_SELECT_WRITE, NULL, client);
+		return 0;
+	}
+
+	/* Then have the next part of the sendQ encrypted. It stays
+	 * in the sendQ until that is done, so sendQ limits still work.
+	 */
+	if (!job->busy && (DBufLength(&client->local->sendQ) > 0))
+	{
+		tls_worker_copy_sendq(client, job, TLSW_WRITE_SIZE);
+		conn->sendq_busy = job->inlen;
+		tls_worker_submit(job);
+	}
+
+	/* We will be called again when the worker is done */
+	fd_setselect(client->local->fd, FD_SELECT_WRITE, NULL, client);
+	return 0;
+}
+
+/** Free the buffers of a finished job */
+static void tls_worker_job_free(TLSWorkerJob *job)
+{
+	safe_free(job->in);
+	safe_free(job->out);
+	safe_free(job->cipher);
+	job->inlen = job->outlen = job->cipherlen = 0;
+	job->more = job->error = 0;
+	job->handshake = job->handshake_done = job->ssl_error = 0;
+	job->err = 0;
+}
+
+/** Finish a connection after the close job is done: send what
+ * we can without blocking, close the socket and free everything.
+ */
+static void tls_worker_close_done(TLSWorkerConn *conn)
+{
+	struct iovec iov[TLSW_IOV_MAX];
+	size_t len;
+	int iovcnt, n;
+
+	while (DBufLength(&conn->cipherQ) > 0)
+	{
+		iovcnt = dbuf_map_iovec(&conn->cipherQ, iov, TLSW_IOV_MAX, &len);
+		n = writev(conn->fd, iov, iovcnt);
+		if (n <= 0)
+			break;
+		dbuf_delete(&conn->cipherQ, n);
+	}
+	DBufClear(&conn->cipherQ);
+	DBufClear(&conn->earlyQ);
+	CLOSE_SOCK(conn->fd);
+	conn->worker->connections--;
+	safe_free(conn);
+}
+
+/** Deal with a finished read job of a connection that is in the handshake.
+ * Data that came along is kept until the handshake hooks have run.
+ */
+static void tls_worker_handshake_done(Client *client, TLSWorkerJob *job)
+{
+	TLSWorkerConn *conn = job->conn;
+
+	if (job->error)
+	{
+		int ssl_error = job->ssl_error;
+		unsigned long err = job->err;
+
+		tls_worker_job_free(job);
+		if (conn->handshake == TLSW_HANDSHAKE_BUSY)
+			ircd_SSL_accept_failed(client, ssl_error, err);
+		else
+			exit_client(client, NULL, "Read error");
+		return;
+	}
+
+	if (job->outlen)
+		dbuf_put(&conn->earlyQ, job->out, job->outlen);
+	if (job->handshake_done)
+		conn->handshake = TLSW_HANDSHAKE_DONE;
+
+	if (job->more)
+	{
+		tls_worker_job_free(job);
+		tls_worker_submit(job);
+	} else {
+		tls_worker_job_free(job);
+		if (conn->handshake == TLSW_HANDSHAKE_BUSY)
+			fd_setselect(client->local->fd, FD_SELECT_READ, read_packet, client);
+	}
+
+	/* Send our part of the handshake, this also finishes it if we can */
+	send_queued(client);
+}
+
+/** Deal with a job that was finished by a worker (main thread) */
+static void tls_worker_job_done(TLSWorkerJob *job)
+{
+	TLSWorkerConn *conn = job->conn;
+	Client *client = conn->client;
+
+	job->busy = 0;
+
+	/* Encrypted data is kept even if the client is gone, so it can
+	 * still be sent before the close_notify.
+	 */
+	if (job->cipherlen)
+		dbuf_put(&conn->cipherQ, job->cipher, job->cipherlen);
+
+	if (job->type == TLSW_JOB_CLOSE)
+	{
+		tls_worker_job_free(job);
+		tls_worker_close_done(conn);
+		return;
+	}
+
+	if (!client || IsDeadSocket(client))
+	{
+		tls_worker_job_free(job);
+		return;
+	}
+
+	if ((job->type == TLSW_JOB_READ) && conn->handshake)
+	{
+		tls_worker_handshake_done(client, job);
+	}
+	else if (job->type == TLSW_JOB_READ)
+	{
+		if (job->outlen && !read_packet_process(client, job->out, job->outlen))
+		{
+			/* Client is gone */
+			tls_worker_job_free(job);
+			return;
+		}
+		if (job->error)
+		{
+			tls_worker_job_free(job);
+			exit_client(client, NULL, "Read error");
+			return;
+		}
+		if (job->more)
+		{
+			tls_worker_job_free(job);
+			tls_worker_submit(job);
+		} else {
+			tls_worker_job_free(job);
+			fd_setselect(client->local->fd, FD_SELECT_READ, read_packet, client);
+		}
+		if (DBufLength(&conn->cipherQ) > 0)
+			send_queued(client);
+	}
+	else if (job->type == TLSW_JOB_WRITE)
+	{
+		if (job->error)
+		{
+			tls_worker_job_free(job);
+			dead_socket(client, "Write error: TLS error");
+			return;
+		}
+		dbuf_delete(&client->local->sendQ, conn->sendq_busy);
+		conn->sendq_busy = 0;
+		client->local->lastsq = DBufLength(&client->local->sendQ) / 1024;
+		tls_worker_job_free(job);
+		send_queued(client);
+	}
+}
+
+/** Called when a worker thread has finished one or more jobs */
+static void tls_worker_done(int fd, int revents, void *data)
+{
+	TLSWorkerJob *job;
+	char buf[256];
+	int i;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	/* Clear the flag before looking at the rings, a job that is
+	 * finished from now on causes a new notification.
+	 */
+	__atomic_store_n(&tls_worker_notify_pending, 0, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < num_tls_workers; i++)
+		while ((job = ring_pop(&tls_workers[i]->done)))
+			tls_worker_job_done(job);
+}
+
+/** Wait until the worker threads are not doing any TLS handshakes.
+ * The handshake looks at the sni { } blocks and their SSL contexts,
+ * so this is called before those are changed or freed.
+ */
+void tls_worker_quiesce(void)
+{
+	while (__atomic_load_n(&tls_handshake_jobs, __ATOMIC_SEQ_CST) > 0)
+		usleep(1000);
+}
+
+/** Get statistics of a TLS worker thread.
+ * @param num	The number of the worker (0, 1, ..)
+ * @param stats	The statistics are stored here
+ * @returns 1 if the worker exists, 0 if not.
+ */
+int tls_worker_stats(int num, TLSWorkerStats *stats)
+{
+	TLSWorker *worker;
+	clockid_t cid;
+	struct timespec ts;
+
+	if ((num < 0) || (num >= num_tls_workers))
+		return 0;
+
+	worker = tls_workers[num];
+	memset(stats, 0, sizeof(TLSWorkerStats));
+	stats->connections = worker->connections;
+	stats->queued = ring_count(&worker->jobs);
+	stats->completed = ring_count(&worker->done);
+	stats->jobs = __atomic_load_n(&worker->stat_jobs, __ATOMIC_RELAXED);
+	stats->handshakes = __atomic_load_n(&worker->stat_handshakes, __ATOMIC_RELAXED);
+	stats->bytes_in = __atomic_load_n(&worker->stat_bytes_in, __ATOMIC_RELAXED);
+	stats->bytes_out = __atomic_load_n(&worker->stat_bytes_out, __ATOMIC_RELAXED);
+	stats->cpu_usec = -1;
+	if (!pthread_getcpuclockid(worker->thread, &cid) && !clock_gettime(cid, &ts))
+		stats->cpu_usec = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	return 1;
+}
+
+#else
+
+/* TLS worker threads are not available on this platform,
+ * client->local->tlsw is never set.
+ */
+int tls_worker_attach(Client *client)
+{
+	return 0;
+}
+
+void tls_worker_detach(Client *client)
+{
+}
+
+void tls_worker_sendq_cleared(Client *client)
+{
+}
+
+void tls_worker_read_packet(Client *client)
+{
+}
+
+int tls_worker_send_queued(Client *client)
+{
+	return 0;
+}
+
+int tls_worker_accept(Client *client)
+{
+	return 0;
+}
+
+void tls_worker_quiesce(void)
+{
+}
+
+int tls_worker_stats(int num, TLSWorkerStats *stats)
+{
+	return 0;
+}
+
+#endif
@@ -1,4 +1,7 @@
 #include "unrealircd.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 /**************** UTF8 HELPER FUNCTIONS START HERE *****************/
 
@@ -26,13 +29,61 @@
       goto error;                   \
   } while(0)
 
+/** Skip over plain ASCII characters, which is what most of the text is.
+ * This looks at 32 (AVX2) or 16 (SSE2) bytes at a time if possible,
+ * otherwise 8 bytes at a time.
+ * @param p     Where to start
+ * @param end   The end of the string (the NUL byte)
+ * @returns The first byte that is not ASCII, or 'end'.
+ */
+static inline const char *skip_ascii(const char *p, const char *end)
+{
+#ifdef __AVX2__
+	while (end - p >= 32)
+	{
+		int mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)p));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+#ifdef __SSE2__
+	while (end - p >= 16)
+	{
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (end - p >= 8)
+	{
+		uint64_t v;
+
+		memcpy(&v, p, 8);
+		if (v & 0x8080808080808080ULL)
+			break;
+		p += 8;
+	}
+	while ((p < end) && (*p < 128))
+		p++;
+	return p;
+}
+
 /* see IETF RFC 3629 Section 4 */
 
-static const char *fast_validate(const char *str)
+/** Find the first invalid UTF8 sequence.
+ * @param str   The string to validate
+ * @param end   The end of the string (the NUL byte)
+ * @param skip  Skip ASCII in blocks with skip_ascii(). If 0, then this
+ *              is the old byte-at-a-time scan, utf8_test() compares both.
+ * @returns The first invalid UTF8 sequence, or 'end' if the string is valid.
+ */
+static inline const char *validate(const char *str, const char *end, int skip)
 {
 	const char *p;
 
-	for (p = str; *p; p++)
+	for (p = skip ? skip_ascii(str, end) : str; *p; p = skip ? skip_ascii(p + 1, end) : p + 1)
 	{
 		if (*p >= 128)
 		{
@@ -100,6 +151,12 @@ error:
 	return p;
 }
 
+/** Find the first invalid UTF8 sequence, see validate() */
+static const char *fast_validate(const char *str, const char *end)
+{
+	return validate(str, end, 1);
+}
+
 /** Check if a string is valid UTF8.
  * @param str   The string to validate
  * @param end   Pointer to char *, as explained in notes below.
@@ -111,7 +168,7 @@ int unrl_utf8_validate(const char *str, const char **end)
 {
 	const char *p;
 
-	p = fast_validate(str);
+	p = fast_validate(str, str + strlen(str));
 
 	if (end)
 		*end = p;
@@ -147,38 +204,40 @@ char *unrl_utf8_find_prev_char (const char *begin, const char *p)
 char *unrl_utf8_make_valid(const char *str)
 {
 	static char string[4096]; /* crazy, but lazy, max amplification is x3, so x4 is safe. */
-	const char *remainder, *invalid;
-	int remaining_bytes, valid_bytes, len;
-	int replaced = 0; /**< UTF8 string needed replacement (was invalid) */
+	const char *remainder, *invalid, *end;
+	char *o;
+	int valid_bytes;
 
 	if (!str)
 		return NULL;
 
-	len = strlen(str);
+	end = str + strlen(str);
+	invalid = fast_validate(str, end);
+	if (invalid == end)
+		return (char *)str; /* return original string (no changes needed) */
 
-	if (len >= 1024)
+	if (end - str >= 1024)
 		abort(); /* better safe than sorry */
 
-	*string = '\0';
+	/* Only from the first invalid byte onwards we need to do some work */
+	o = string;
 	remainder = str;
-	remaining_bytes = len;
-
-	while (remaining_bytes != 0)
+	do
 	{
-		if (unrl_utf8_validate(remainder, &invalid))
-			break;
-		replaced = 1;
 		valid_bytes = invalid - remainder;
+		memcpy(o, remainder, valid_bytes);
+		o += valid_bytes;
+		memcpy(o, "\357\277\275", 3);
+		o += 3;
 
-		strlncat(string, remainder, sizeof(string), valid_bytes); /*g_string_append_len(string, remainder, valid_bytes);*/
-		strlcat(string, "\357\277\275", sizeof(string));
-
-		remaining_bytes -= valid_bytes + 1;
 		remainder = invalid + 1;
-	}
+		invalid = fast_validate(remainder, end);
+	} while (invalid != end);
 
-	if (!replaced)
-		return (char *)str; /* return original string (no changes needed) */
+	/* And the valid part at the end */
+	valid_bytes = invalid - remainder;
+	memcpy(o, remainder, valid_bytes);
+	o[valid_bytes] = '\0';
 
 	/* If output size is too much for an IRC message then cut the string at
 	 * the appropriate place (as in: not to cause invalid UTF8 due to
@@ -199,13 +258,177 @@ char *unrl_utf8_make_valid(const char *str)
 
 /**************** END OF UTF8 HELPER FUNCTIONS *****************/
 
-/** This is just for internal testing */
-void utf8_test(void)
+/** Check that unrl_utf8_make_valid() turns 'in' into 'expect'.
+ * The input is copied to a buffer of its own size, so ASan catches
+ * any read past the end (eg: by the vector code in skip_ascii()).
+ * @returns 1 if OK, 0 if not (this is also printed).
+ */
+static int utf8_test_one(const char *in, const char *expect)
+{
+	char *heapbuf = strdup(in);
+	char *res = unrl_utf8_make_valid(heapbuf);
+	int ok = !strcmp(res, expect);
+
+	if (!ok)
+		printf("[FAIL] \"%s\" became \"%s\" instead of \"%s\"\n", in, res, expect);
+	free(heapbuf);
+	return ok;
+}
+
+/** Built-in tests, with the bad byte or a multibyte sequence at every
+ * offset from 0 to 99, so every code path of skip_ascii() (32, 16,
+ * 8 bytes at a time and the rest) is crossed.
+ * @returns The number of failed tests.
+ */
+static int utf8_test_builtin(void)
+{
+	static const char *sequences[] = {
+		"\303\251", /* U+00E9 */
+		"\342\202\254", /* U+20AC */
+		"\360\235\204\236", /* U+1D11E */
+		NULL
+	};
+	char in[128], expect[128];
+	int failed = 0, tests = 0;
+	int len, pos, i, j;
+
+	/* The bytes after the first bad one must not get lost */
+	tests++;
+	if (!utf8_test_one("ab\377cd", "ab\357\277\275cd"))
+		failed++;
+
+	for (len = 1; len <= 100; len++)
+	{
+		for (pos = 0; pos < len; pos++)
+		{
+			/* A bad byte: replaced, the rest stays */
+			memset(in, 'a', len);
+			in[len] = '\0';
+			in[pos] = '\377';
+			memset(expect, 'a', pos);
+			memcpy(expect + pos, "\357\277\275", 3);
+			memset(expect + pos + 3, 'a', len - pos - 1);
+			expect[len + 2] = '\0';
+			tests++;
+			if (!utf8_test_one(in, expect))
+				failed++;
+
+			/* Valid sequences: left as they are.
+			 * Cut off ones: each byte is replaced.
+			 */
+			for (i = 0; sequences[i]; i++)
+			{
+				int seqlen = strlen(sequences[i]);
+
+				if (pos + seqlen > len)
+					continue;
+				memset(in, 'a', len);
+				in[len] = '\0';
+				memcpy(in + pos, sequences[i], seqlen);
+				tests++;
+				if (!utf8_test_one(in, in))
+					failed++;
+
+				in[pos + seqlen - 1] = 'a';
+				memset(expect, 'a', pos);
+				memset(expect + pos + 3 * (seqlen - 1), 'a', len - pos - seqlen + 1);
+				expect[len + 2 * (seqlen - 1)] = '\0';
+				for (j = 0; j < seqlen - 1; j++)
+					memcpy(expect + pos + 3 * j, "\357\277\275", 3);
+				tests++;
+				if (!utf8_test_one(in, expect))
+					failed++;
+			}
+		}
+	}
+
+	printf("Built-in tests: %d of %d failed\n", failed, tests);
+	return failed;
+}
+
+/** Time how long it takes to validate 'str' 'iterations' times.
+ * @param str         The string to validate
+ * @param skip        See validate()
+ * @param iterations  How many times
+ * @returns Nanoseconds per call.
+ */
+static double utf8_benchmark_one(const char *str, int skip, int iterations)
+{
+	const char *volatile in = str; /* so the calls can't be optimized away */
+	static volatile size_t sink;
+	struct timeval start, end;
+	const char *s;
+	size_t len = strlen(str);
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++)
+	{
+		s = in;
+		sink += validate(s, s + len, skip) - s;
+	}
+	gettimeofday(&end, NULL);
+
+	return ((end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec)) * 1000.0 / iterations;
+}
+
+/** Compare the speed of the validation with the old byte-at-a-time scan,
+ * on lines of 400 bytes.
+ */
+static void utf8_benchmark(void)
+{
+	static const char *multibyte = "caf\303\251 \342\202\254 \360\235\204\236 na\303\257ve ";
+	const int iterations = 200000;
+	char ascii[401], multi[401], early[401], late[401];
+	struct {
+		const char *name;
+		const char *str;
+	} *b, benchmarks[] = {
+		{ "valid ASCII", ascii },
+		{ "valid multibyte", multi },
+		{ "invalid early", early },
+		{ "invalid late", late },
+		{ NULL, NULL }
+	};
+	double old_ns, new_ns;
+	int i;
+
+	for (i = 0; i < 400; i++)
+		ascii[i] = 'a' + (i % 26);
+	ascii[400] = '\0';
+	for (i = 0; i + strlen(multibyte) <= 400; i += strlen(multibyte))
+		memcpy(multi + i, multibyte, strlen(multibyte));
+	multi[i] = '\0';
+	strcpy(early, ascii);
+	early[2] = '\377';
+	strcpy(late, ascii);
+	late[397] = '\377';
+
+	printf("Benchmark, nanoseconds per line of about 400 bytes:\n");
+	printf("%-16s %8s %8s %8s\n", "", "old", "new", "speedup");
+	for (b = benchmarks; b->name; b++)
+	{
+		old_ns = utf8_benchmark_one(b->str, 0, iterations);
+		new_ns = utf8_benchmark_one(b->str, 1, iterations);
+		printf("%-16s %8.1f %8.1f %7.1fx\n", b->name, old_ns, new_ns, old_ns / new_ns);
+	}
+}
+
+/** This is just for internal testing.
+ * Runs the built-in tests and a benchmark, and then shows the
+ * result for each line on stdin.
+ * @returns The number of failed built-in tests.
+ */
+int utf8_test(void)
 {
 	char buf[1024];
 	char *res;
 	int cnt = 0;
 	char *heapbuf; /* for strict OOB testing with ASan */
+	int failed;
+
+	failed = utf8_test_builtin();
+	utf8_benchmark();
 
 	while ((fgets(buf, sizeof(buf), stdin)))
 	{
@@ -220,4 +443,5 @@ void utf8_test(void)
 		}
 		free(heapbuf);
 	}
+	return failed;
 }